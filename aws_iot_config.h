@@ -39,12 +39,25 @@
 // =================================================
 
 // MQTT PubSub
-#define AWS_IOT_MQTT_TX_BUF_LEN 512 ///< Any time a message is sent out through the MQTT layer. The message is copied into this buffer anytime a publish is done. This will also be used in the case of Thing Shadow
-#define AWS_IOT_MQTT_RX_BUF_LEN 512 ///< Any message that comes into the device should be less than this buffer size. If a received message is bigger than this buffer size the message will be dropped.
+#define AWS_IOT_MQTT_TX_BUF_LEN 512 ///< Any time a message is sent out through the MQTT layer it is serialized into this buffer. Publish payloads that do not fit behind the header are written straight from the caller, then only the topic and header have to fit. This will also be used in the case of Thing Shadow
+#define AWS_IOT_MQTT_RX_BUF_LEN 512 ///< Any message that comes into the device should be less than this buffer size. If a received message is bigger than this buffer size the message will be dropped, unless it was subscribed to with streaming enabled in which case the payload is delivered in chunks.
+#define AWS_IOT_MQTT_RX_RING_LEN AWS_IOT_MQTT_RX_BUF_LEN ///< Size of the receive ring the MQTT client reads the network into. Packets up to this size are framed from memory and several small acks are pulled with one network read
+#define AWS_IOT_MQTT_MAX_CLIENTS 1 ///< Maximum number of MQTT clients that can be set up with aws_iot_mqtt_init at any given time. Each one holds its own TX and RX buffers and MQTT client state
 #define AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS 5 ///< Maximum number of topic filters the MQTT client can handle at any given time. This should be increased appropriately when using Thing Shadow
+#define AWS_IOT_MQTT_MAX_TOPIC_TRIE_NODES 32 ///< Maximum number of distinct topic filter levels across all subscriptions. Filters sharing a prefix share its levels, the Thing Shadow topics of one thing need about 15
+#define AWS_IOT_MQTT_MAX_INFLIGHT_PUBLISHES 4 ///< Maximum number of QoS1 and QoS2 publishes that can be waiting for a PUBACK or PUBCOMP at any given time. The payload and topic of each of them must stay valid until its completion handler is called
+#define AWS_IOT_MQTT_COMMAND_QUEUE_LEN 8 ///< Number of publish/subscribe commands other threads can queue for the MQTT I/O thread. Only used when the MQTT client is built with MQTT_TASK, must be a power of two
+#define AWS_IOT_MQTT_DISPATCH_WORKERS 2 ///< Number of worker threads received messages are handed to, so slow message handlers never hold up the MQTT I/O thread. Messages on one topic always go to the same worker and keep their order. Subscriptions with streaming enabled, which includes all Thing Shadow subscriptions, are always handled on the I/O thread. Only used with MQTT_TASK, 0 calls the handlers on the I/O thread
+#define AWS_IOT_MQTT_DISPATCH_QUEUE_LEN 4 ///< Number of received messages each dispatch worker can have waiting. Every entry holds a copy of the message of up to AWS_IOT_MQTT_RX_BUF_LEN bytes, must be a power of two. A message arriving while the queue of its worker is full is acknowledged and lost, see aws_iot_mqtt_get_dispatch_dropped_count
+#define AWS_IOT_MQTT_OFFLINE_QUEUE_LEN 4 ///< Number of publishes kept while the connection is down and auto-reconnect is enabled. They are sent in order once it is back, and publishes made before all of them went out are queued behind them. 0 makes a publish fail while disconnected
+#define AWS_IOT_MQTT_OFFLINE_MESSAGE_LEN AWS_IOT_MQTT_TX_BUF_LEN ///< Maximum topic plus payload length of a publish kept while the connection is down
+#define AWS_IOT_MQTT_OFFLINE_DRAIN_INTERVAL_MS 100 ///< Minimum time between two kept publishes sent after a reconnect, so a backlog does not flood the connection
+#define AWS_IOT_MQTT_MAX_PUBLISH_RETRIES 3 ///< Number of times an unacknowledged QoS1 or QoS2 publish (or the PUBREL of a QoS2 publish) is sent again before it is reported as failed. The retry interval is the MQTT command timeout
+#define AWS_IOT_MQTT_PING_RESPONSE_TIMEOUT_MS 5000 ///< Time to wait for any packet from the broker after a PINGREQ before the connection is considered lost. A PINGREQ is only sent after a keepalive interval in which nothing was sent
+#define AWS_IOT_MQTT_MAX_INBOUND_QOS2 4 ///< Maximum number of received QoS2 messages waiting for their PUBREL. Their packet ids are remembered so that a message sent again is not handled twice. Beyond this number a QoS2 message is still handled and acknowledged, but only at least once: a copy sent again after a reconnect is handled again
 
 // Thing Shadow specific configs
-#define SHADOW_MAX_SIZE_OF_RX_BUFFER AWS_IOT_MQTT_RX_BUF_LEN+1 ///< Maximum size of the SHADOW buffer to store the received Shadow message
+#define SHADOW_MAX_SIZE_OF_RX_BUFFER 2048+1 ///< Maximum size of the SHADOW buffer to store the received Shadow message. Shadow documents are streamed through the MQTT receive buffer, so this is independent of AWS_IOT_MQTT_RX_BUF_LEN. Documents of this size or larger are dropped
 #define MAX_SIZE_OF_UNIQUE_CLIENT_ID_BYTES 80  ///< Maximum size of the Unique Client Id. For More info on the Client Id refer \ref response "Acknowledgments"
 #define MAX_SIZE_CLIENT_ID_WITH_SEQUENCE MAX_SIZE_OF_UNIQUE_CLIENT_ID_BYTES + 10 ///< This is size of the extra sequence number that will be appended to the Unique client Id
 #define MAX_SIZE_CLIENT_TOKEN_CLIENT_SEQUENCE MAX_SIZE_CLIENT_ID_WITH_SEQUENCE + 20 ///< This is size of the the total clientToken key and value pair in the JSON
@@ -56,7 +69,9 @@
 #define MAX_SHADOW_TOPIC_LENGTH_BYTES MAX_SHADOW_TOPIC_LENGTH_WITHOUT_THINGNAME + MAX_SIZE_OF_THING_NAME ///< This size includes the length of topic with Thing Name
 
 // Auto Reconnect specific config
-#define AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL 1000 ///< Minimum time before the First reconnect attempt is made as part of the exponential back-off algorithm
-#define AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL 8000 ///< Maximum time interval after which exponential back-off will stop attempting to reconnect.
+#define AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL 1000 ///< Shortest wait before a reconnect attempt. Each wait is drawn at random between this and three times the previous wait
+#define AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL 60000 ///< Longest wait between two reconnect attempts
+#define AWS_IOT_MQTT_PIPELINED_RECONNECT 1 ///< 1 writes the SUBSCRIBEs restoring the subscriptions together with the CONNECT of a reconnect instead of after the CONNACK, saving a round trip. 0 waits for the CONNACK first
+#define AWS_IOT_MQTT_MAX_RECONNECT_ATTEMPTS 0 ///< Number of failed reconnect attempts after which the client gives up with NETWORK_RECONNECT_TIMED_OUT. Attempts made while the network link is down are not counted. 0 never gives up
 
 #endif /* SRC_SHADOW_IOT_SHADOW_CONFIG_H_ */
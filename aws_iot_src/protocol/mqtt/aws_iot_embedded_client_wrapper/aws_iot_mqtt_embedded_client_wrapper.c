@@ -13,17 +13,35 @@
  * permissions and limitations under the License.
  */
 
+#include <string.h>
+
 #include "timer_interface.h"
 #include "aws_iot_mqtt_interface.h"
 #include "MQTTClient.h"
 #include "aws_iot_config.h"
 
-static Client c;
-
-static iot_disconnect_handler clientDisconnectHandler;
-
-static unsigned char writebuf[AWS_IOT_MQTT_TX_BUF_LEN];
-static unsigned char readbuf[AWS_IOT_MQTT_RX_BUF_LEN];
+/**
+ * State behind one MQTTClient_t.  The paho client comes first so a Client pointer
+ * handed back by a paho callback is also a pointer to its context.
+ */
+typedef struct {
+	Client c;
+	unsigned char writebuf[AWS_IOT_MQTT_TX_BUF_LEN];
+	unsigned char readbuf[AWS_IOT_MQTT_RX_BUF_LEN];
+	iot_disconnect_handler clientDisconnectHandler;
+	MQTTClient_t *pClient;
+	bool isPowerCycle;
+	bool isUsed;
+} MQTTClientContext_t;
+
+static MQTTClientContext_t clientContexts[AWS_IOT_MQTT_MAX_CLIENTS];
+
+static Client *getPahoClient(MQTTClient_t *pClient) {
+	if(NULL == pClient || NULL == pClient->pContext) {
+		return NULL;
+	}
+	return &((MQTTClientContext_t *)pClient->pContext)->c;
+}
 
 const MQTTConnectParams MQTTConnectParamsDefault = {
 		.enableAutoReconnect = 0,
@@ -48,17 +66,21 @@ const MQTTConnectParams MQTTConnectParamsDefault = {
 
 const MQTTPublishParams MQTTPublishParamsDefault={
 		.pTopic = NULL,
-		.MessageParams = {.qos = QOS_0, .isRetained=false, .isDuplicate = false, .id = 0, .pPayload = NULL, .PayloadLen = 0}
+		.MessageParams = {.qos = QOS_0, .isRetained=false, .isDuplicate = false, .id = 0, .pPayload = NULL, .PayloadLen = 0, .priority = 0}
 };
 const MQTTSubscribeParams MQTTSubscribeParamsDefault={
 		.pTopic = NULL,
 		.qos = QOS_0,
-		.mHandler = NULL
+		.mHandler = NULL,
+		.isStreamingEnabled = false
 };
 const MQTTCallbackParams MQTTCallbackParamsDefault={
 		.pTopicName = NULL,
 		.TopicNameLen = 0,
-		.MessageParams = {.qos = QOS_0, .isRetained=false, .isDuplicate = false, .id = 0, .pPayload = NULL, .PayloadLen = 0}
+		.pClient = NULL,
+		.MessageParams = {.qos = QOS_0, .isRetained=false, .isDuplicate = false, .id = 0, .pPayload = NULL, .PayloadLen = 0},
+		.TotalPayloadLen = 0,
+		.PayloadOffset = 0
 };
 const MQTTMessageParams MQTTMessageParamsDefault={
 		.qos = QOS_0,
@@ -66,7 +88,8 @@ const MQTTMessageParams MQTTMessageParamsDefault={
 		.isDuplicate = false,
 		.id = 0,
 		.pPayload = NULL,
-		.PayloadLen = 0
+		.PayloadLen = 0,
+		.priority = 0
 };
 const MQTTwillOptions MQTTwillOptionsDefault={
 		.pTopicName = NULL,
@@ -97,25 +120,57 @@ void pahoMessageCallback(MessageData* md) {
 		params.MessageParams.isRetained = message->retained;
 		params.MessageParams.id = message->id;
 	}
+	params.pClient = (NULL != md->client) ? ((MQTTClientContext_t *)md->client)->pClient : NULL;
+	params.TotalPayloadLen = md->totalPayloadLen;
+	params.PayloadOffset = md->payloadOffset;
 
 	((iot_message_handler)(md->applicationHandler))(params);
 }
 
-void pahoDisconnectHandler(void) {
-	if(NULL != clientDisconnectHandler) {
-		clientDisconnectHandler();
+void pahoPublishCompletionCallback(PublishCompletionData *cd) {
+	IoT_Error_t status = (SUCCESS == cd->rc) ? NONE_ERROR : PUBLISH_ERROR;
+
+	if(MQTT_PUBLISH_STORED_OFFLINE == cd->rc) {
+		status = PUBLISH_STORED_OFFLINE;
 	}
+
+	if (cd->applicationHandler == NULL) {
+		return;
+	}
+
+	((iot_publish_complete_handler)(cd->applicationHandler))(cd->packetId, status, cd->pApplicationContext);
+}
+
+#if defined(MQTT_TASK)
+void pahoSubscribeCompletionCallback(PublishCompletionData *cd) {
+	IoT_Error_t status = (SUCCESS == cd->rc) ? NONE_ERROR : SUBSCRIBE_ERROR;
+
+	if (cd->applicationHandler == NULL) {
+		return;
+	}
+
+	((iot_publish_complete_handler)(cd->applicationHandler))(cd->packetId, status, cd->pApplicationContext);
 }
+#endif
 
-static bool isPowerCycle = true;
+void pahoDisconnectHandler(Client *pahoClient) {
+	MQTTClientContext_t *pContext = (MQTTClientContext_t *)pahoClient;
 
-IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams) {
+	if(NULL != pContext->clientDisconnectHandler) {
+		pContext->clientDisconnectHandler(pContext->pClient);
+	}
+}
+
+IoT_Error_t aws_iot_mqtt_connect(MQTTClient_t *pClient, MQTTConnectParams *pParams) {
 	IoT_Error_t rc = NONE_ERROR;
 	MQTTReturnCode pahoRc = SUCCESS;
+	MQTTClientContext_t *pContext;
 
-	if(NULL == pParams || NULL == pParams->pClientID || NULL == pParams->pHostURL) {
+	if(NULL == pClient || NULL == pClient->pContext || NULL == pParams || NULL == pParams->pClientID
+			|| NULL == pParams->pHostURL) {
 		return NULL_VALUE_ERROR;
 	}
+	pContext = (MQTTClientContext_t *)pClient->pContext;
 
 	TLSConnectParams TLSParams;
 	TLSParams.DestinationPort = pParams->port;
@@ -129,14 +184,14 @@ IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams) {
 	// This implementation assumes you are not going to switch between cleansession 1 to 0
 	// As we don't have a default subscription handler support in the MQTT client every time a device power cycles it has to re-subscribe to let the MQTT client to pass the message up to the application callback.
 	// The default message handler will be implemented in the future revisions.
-	if(pParams->isCleansession || isPowerCycle){
-		pahoRc = MQTTClient(&c, (unsigned int)(pParams->mqttCommandTimeout_ms), writebuf,
-				   AWS_IOT_MQTT_TX_BUF_LEN, readbuf, AWS_IOT_MQTT_RX_BUF_LEN,
+	if(pParams->isCleansession || pContext->isPowerCycle){
+		pahoRc = MQTTClient(&pContext->c, (unsigned int)(pParams->mqttCommandTimeout_ms), pContext->writebuf,
+				   AWS_IOT_MQTT_TX_BUF_LEN, pContext->readbuf, AWS_IOT_MQTT_RX_BUF_LEN,
 				   pParams->enableAutoReconnect, iot_tls_init, &TLSParams);
 		if(SUCCESS != pahoRc) {
 			return CONNECTION_ERROR;
 		}
-		isPowerCycle = false;
+		pContext->isPowerCycle = false;
 	}
 
 	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
@@ -155,8 +210,8 @@ IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams) {
 	}
 
 	// register our disconnect handler, save customer's handler
-	setDisconnectHandler(&c, pahoDisconnectHandler);
-	clientDisconnectHandler = pParams->disconnectHandler;
+	setDisconnectHandler(&pContext->c, pahoDisconnectHandler);
+	pContext->clientDisconnectHandler = pParams->disconnectHandler;
 
 	data.clientID.cstring = pParams->pClientID;
 	data.username.cstring = pParams->pUserName;
@@ -168,7 +223,7 @@ IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams) {
 	data.keepAliveInterval = pParams->KeepAliveInterval_sec;
 	data.cleansession = pParams->isCleansession;
 
-	pahoRc = MQTTConnect(&c, &data);
+	pahoRc = MQTTConnect(&pContext->c, &data);
 	if(MQTT_NETWORK_ALREADY_CONNECTED_ERROR == pahoRc) {
 		rc = NETWORK_ALREADY_CONNECTED;
 	} else if(SUCCESS != pahoRc) {
@@ -178,17 +233,48 @@ IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams) {
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_subscribe(MQTTSubscribeParams *pParams) {
+IoT_Error_t aws_iot_mqtt_subscribe(MQTTClient_t *pClient, MQTTSubscribeParams *pParams) {
+	return aws_iot_mqtt_subscribe_many(pClient, pParams, 1);
+}
+
+IoT_Error_t aws_iot_mqtt_subscribe_many(MQTTClient_t *pClient, MQTTSubscribeParams *pParams, uint32_t count) {
 	IoT_Error_t rc = NONE_ERROR;
+	Client *c = getPahoClient(pClient);
+	const char *topics[MAX_FILTERS_PER_SUBSCRIBE];
+	QoS qos[MAX_FILTERS_PER_SUBSCRIBE];
+	pApplicationHandler_t handlers[MAX_FILTERS_PER_SUBSCRIBE];
+	uint8_t isStreaming[MAX_FILTERS_PER_SUBSCRIBE];
+	uint32_t i;
+
+	if(NULL == c || NULL == pParams || 0 == count) {
+		return NULL_VALUE_ERROR;
+	}
+
+	if(MAX_FILTERS_PER_SUBSCRIBE < count) {
+		return SUBSCRIBE_ERROR;
+	}
+
+	for(i = 0; i < count; i++) {
+		topics[i] = pParams[i].pTopic;
+		qos[i] = (enum QoS)pParams[i].qos;
+		handlers[i] = (void (*)(void))(pParams[i].mHandler);
+		isStreaming[i] = pParams[i].isStreamingEnabled ? 1 : 0;
+	}
 
-	if (0 != MQTTSubscribe(&c, pParams->pTopic, (enum QoS)pParams->qos, pahoMessageCallback, (void (*)(void))(pParams->mHandler))) {
-			rc = SUBSCRIBE_ERROR;
+	if (0 != MQTTSubscribeMany(c, count, topics, qos, pahoMessageCallback, handlers, isStreaming)) {
+		rc = SUBSCRIBE_ERROR;
 	}
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_publish(MQTTPublishParams *pParams) {
+IoT_Error_t aws_iot_mqtt_publish(MQTTClient_t *pClient, MQTTPublishParams *pParams) {
 	IoT_Error_t rc = NONE_ERROR;
+	MQTTReturnCode pahoRc;
+	Client *c = getPahoClient(pClient);
+
+	if(NULL == c || NULL == pParams) {
+		return NULL_VALUE_ERROR;
+	}
 
 	MQTTMessage Message;
 	Message.dup = pParams->MessageParams.isDuplicate;
@@ -198,34 +284,77 @@ IoT_Error_t aws_iot_mqtt_publish(MQTTPublishParams *pParams) {
 	Message.qos = (enum QoS)pParams->MessageParams.qos;
 	Message.retained = pParams->MessageParams.isRetained;
 
-	if(0 != MQTTPublish(&c, pParams->pTopic, &Message)){
+	pahoRc = MQTTPublishWithPriority(c, pParams->pTopic, &Message, pParams->MessageParams.priority);
+	if(MQTT_PUBLISH_STORED_OFFLINE == pahoRc) {
+		rc = PUBLISH_STORED_OFFLINE;
+	} else if(SUCCESS != pahoRc) {
 		rc = PUBLISH_ERROR;
 	}
 
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_unsubscribe(char *pTopic) {
+IoT_Error_t aws_iot_mqtt_publish_async(MQTTClient_t *pClient, MQTTPublishParams *pParams,
+		iot_publish_complete_handler handler, void *pContext) {
 	IoT_Error_t rc = NONE_ERROR;
+	MQTTReturnCode pahoRc;
+	Client *c = getPahoClient(pClient);
 
-	if(0 != MQTTUnsubscribe(&c, pTopic)){
+	if(NULL == c || NULL == pParams) {
+		return NULL_VALUE_ERROR;
+	}
+
+	MQTTMessage Message;
+	Message.dup = pParams->MessageParams.isDuplicate;
+	Message.id = pParams->MessageParams.id;
+	Message.payload = pParams->MessageParams.pPayload;
+	Message.payloadlen = pParams->MessageParams.PayloadLen;
+	Message.qos = (enum QoS)pParams->MessageParams.qos;
+	Message.retained = pParams->MessageParams.isRetained;
+
+	pahoRc = MQTTPublishAsync(c, pParams->pTopic, &Message, pahoPublishCompletionCallback,
+			(void (*)(void))handler, pContext);
+	if(MQTT_MAX_INFLIGHT_PUBLISHES_REACHED_ERROR == pahoRc) {
+		rc = PUBLISH_INFLIGHT_WINDOW_FULL;
+	} else if(SUCCESS != pahoRc) {
+		rc = PUBLISH_ERROR;
+	} else {
+		pParams->MessageParams.id = Message.id;
+	}
+
+	return rc;
+}
+
+IoT_Error_t aws_iot_mqtt_unsubscribe(MQTTClient_t *pClient, char *pTopic) {
+	IoT_Error_t rc = NONE_ERROR;
+	Client *c = getPahoClient(pClient);
+
+	if(NULL == c) {
+		return NULL_VALUE_ERROR;
+	}
+
+	if(0 != MQTTUnsubscribe(c, pTopic)){
 		rc = UNSUBSCRIBE_ERROR;
 	}
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_disconnect() {
+IoT_Error_t aws_iot_mqtt_disconnect(MQTTClient_t *pClient) {
 	IoT_Error_t rc = NONE_ERROR;
+	Client *c = getPahoClient(pClient);
+
+	if(NULL == c) {
+		return NULL_VALUE_ERROR;
+	}
 
-	if(0 != MQTTDisconnect(&c)){
+	if(0 != MQTTDisconnect(c)){
 		rc = DISCONNECT_ERROR;
 	}
 
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_yield(int timeout) {
-	MQTTReturnCode pahoRc = MQTTYield(&c, timeout);
+static IoT_Error_t parseYieldReturnCode(MQTTReturnCode pahoRc) {
 	IoT_Error_t rc = NONE_ERROR;
 	if(MQTT_NETWORK_RECONNECTED == pahoRc){
 		rc = RECONNECT_SUCCESSFUL;
@@ -250,8 +379,119 @@ IoT_Error_t aws_iot_mqtt_yield(int timeout) {
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_attempt_reconnect() {
-	MQTTReturnCode pahoRc = MQTTAttemptReconnect(&c);
+IoT_Error_t aws_iot_mqtt_yield(MQTTClient_t *pClient, int timeout) {
+	return parseYieldReturnCode(MQTTYield(getPahoClient(pClient), timeout));
+}
+
+int aws_iot_mqtt_get_poll_fd(MQTTClient_t *pClient) {
+	return MQTTGetPollFd(getPahoClient(pClient));
+}
+
+int32_t aws_iot_mqtt_next_deadline_ms(MQTTClient_t *pClient) {
+	return MQTTNextDeadlineMs(getPahoClient(pClient));
+}
+
+IoT_Error_t aws_iot_mqtt_process(MQTTClient_t *pClient, bool isReadable) {
+	return parseYieldReturnCode(MQTTProcess(getPahoClient(pClient), isReadable ? MQTT_EVENT_READABLE : 0));
+}
+
+#if defined(MQTT_TASK)
+static IoT_Error_t enqueueCommand(MQTTClient_t *pClient, MQTTCommand *pCommand) {
+	MQTTReturnCode pahoRc = MQTTEnqueueCommand(getPahoClient(pClient), pCommand);
+
+	if(MQTT_NULL_VALUE_ERROR == pahoRc) {
+		return NULL_VALUE_ERROR;
+	} else if(MQTT_COMMAND_QUEUE_FULL_ERROR == pahoRc) {
+		return MQTT_COMMAND_QUEUE_FULL;
+	}
+	return NONE_ERROR;
+}
+
+IoT_Error_t aws_iot_mqtt_publish_queued(MQTTClient_t *pClient, MQTTPublishParams *pParams,
+		iot_publish_complete_handler handler, void *pContext) {
+	MQTTCommand command;
+
+	if(NULL == pParams) {
+		return NULL_VALUE_ERROR;
+	}
+
+	memset(&command, 0, sizeof(command));
+	command.type = MQTT_COMMAND_PUBLISH;
+	command.topic = pParams->pTopic;
+	command.message.dup = pParams->MessageParams.isDuplicate;
+	command.message.id = pParams->MessageParams.id;
+	command.message.payload = pParams->MessageParams.pPayload;
+	command.message.payloadlen = pParams->MessageParams.PayloadLen;
+	command.message.qos = (enum QoS)pParams->MessageParams.qos;
+	command.message.retained = pParams->MessageParams.isRetained;
+	command.priority = pParams->MessageParams.priority;
+	command.completionHandler = pahoPublishCompletionCallback;
+	command.completionApplicationHandler = (void (*)(void))handler;
+	command.pApplicationContext = pContext;
+
+	return enqueueCommand(pClient, &command);
+}
+
+IoT_Error_t aws_iot_mqtt_subscribe_queued(MQTTClient_t *pClient, MQTTSubscribeParams *pParams,
+		iot_publish_complete_handler handler, void *pContext) {
+	MQTTCommand command;
+
+	if(NULL == pParams) {
+		return NULL_VALUE_ERROR;
+	}
+
+	memset(&command, 0, sizeof(command));
+	command.type = MQTT_COMMAND_SUBSCRIBE;
+	command.topic = pParams->pTopic;
+	command.qos = (enum QoS)pParams->qos;
+	command.isStreaming = pParams->isStreamingEnabled ? 1 : 0;
+	command.messageHandler = pahoMessageCallback;
+	command.applicationHandler = (void (*)(void))(pParams->mHandler);
+	command.completionHandler = pahoSubscribeCompletionCallback;
+	command.completionApplicationHandler = (void (*)(void))handler;
+	command.pApplicationContext = pContext;
+
+	return enqueueCommand(pClient, &command);
+}
+
+IoT_Error_t aws_iot_mqtt_run_dispatch_worker(MQTTClient_t *pClient, uint32_t worker) {
+#if defined(MQTT_DISPATCH)
+	MQTTReturnCode pahoRc = MQTTRunDispatchWorker(getPahoClient(pClient), worker);
+
+	if(MQTT_NULL_VALUE_ERROR == pahoRc) {
+		return NULL_VALUE_ERROR;
+	} else if(SUCCESS != pahoRc) {
+		return GENERIC_ERROR;
+	}
+#endif
+	// without workers the handlers run on the I/O thread and there is never anything to do
+	return NONE_ERROR;
+}
+
+IoT_Error_t aws_iot_mqtt_set_dispatch_wake_handler(MQTTClient_t *pClient, iot_dispatch_wake_handler handler,
+		void *pContext) {
+#if defined(MQTT_DISPATCH)
+	if(SUCCESS != setDispatchWakeHandler(getPahoClient(pClient), handler, pContext)) {
+		return NULL_VALUE_ERROR;
+	}
+#endif
+	return NONE_ERROR;
+}
+
+uint32_t aws_iot_mqtt_get_dispatch_dropped_count(MQTTClient_t *pClient) {
+#if defined(MQTT_DISPATCH)
+	Client *c = getPahoClient(pClient);
+
+	if(NULL != c) {
+		return MQTTGetDispatchDroppedCount(c);
+	}
+#endif
+	return 0;
+}
+#endif
+
+IoT_Error_t aws_iot_mqtt_attempt_reconnect(MQTTClient_t *pClient) {
+	MQTTReturnCode pahoRc = MQTTAttemptReconnect(getPahoClient(pClient));
 	IoT_Error_t rc = RECONNECT_SUCCESSFUL;
 	if(MQTT_NETWORK_RECONNECTED == pahoRc){
 		rc = RECONNECT_SUCCESSFUL;
@@ -270,33 +510,97 @@ IoT_Error_t aws_iot_mqtt_attempt_reconnect() {
 	return rc;
 }
 
-IoT_Error_t aws_iot_mqtt_autoreconnect_set_status(bool value) {
-	MQTTReturnCode rc = setAutoReconnectEnabled(&c, (uint8_t) value);
+IoT_Error_t aws_iot_mqtt_autoreconnect_set_status(MQTTClient_t *pClient, bool value) {
+	Client *c = getPahoClient(pClient);
+
+	if(NULL == c) {
+		return NULL_VALUE_ERROR;
+	}
+
+	setAutoReconnectEnabled(c, (uint8_t) value);
+
+	return NONE_ERROR;
+}
+
+IoT_Error_t aws_iot_mqtt_set_offline_drop_policy(MQTTClient_t *pClient, OfflineDropPolicy_t policy) {
+	Client *c = getPahoClient(pClient);
 
-	if(MQTT_NULL_VALUE_ERROR == rc) {
+	if(NULL == c) {
 		return NULL_VALUE_ERROR;
 	}
 
+	setOfflineDropPolicy(c, (OFFLINE_DROP_LOWEST_PRIORITY == policy) ?
+			MQTT_OFFLINE_DROP_LOWEST_PRIORITY : MQTT_OFFLINE_DROP_OLDEST);
+
 	return NONE_ERROR;
 }
 
-bool aws_iot_is_mqtt_connected(void) {
-	return MQTTIsConnected(&c);
+uint32_t aws_iot_mqtt_get_offline_dropped_count(MQTTClient_t *pClient) {
+	return MQTTGetOfflineDroppedCount(getPahoClient(pClient));
+}
+
+bool aws_iot_is_mqtt_connected(MQTTClient_t *pClient) {
+	Client *c = getPahoClient(pClient);
+
+	return (NULL != c) ? MQTTIsConnected(c) : false;
 }
 
-bool aws_iot_is_autoreconnect_enabled(void) {
-	return MQTTIsAutoReconnectEnabled(&c);
+bool aws_iot_is_autoreconnect_enabled(MQTTClient_t *pClient) {
+	Client *c = getPahoClient(pClient);
+
+	return (NULL != c) ? MQTTIsAutoReconnectEnabled(c) : false;
 }
 
-void aws_iot_mqtt_init(MQTTClient_t *pClient){
+IoT_Error_t aws_iot_mqtt_init(MQTTClient_t *pClient){
+	uint32_t i;
+
+	if(NULL == pClient) {
+		return NULL_VALUE_ERROR;
+	}
+
 	pClient->connect = aws_iot_mqtt_connect;
 	pClient->disconnect = aws_iot_mqtt_disconnect;
 	pClient->isConnected = aws_iot_is_mqtt_connected;
 	pClient->reconnect = aws_iot_mqtt_attempt_reconnect;
 	pClient->publish = aws_iot_mqtt_publish;
+	pClient->publishAsync = aws_iot_mqtt_publish_async;
 	pClient->subscribe = aws_iot_mqtt_subscribe;
+	pClient->subscribeMany = aws_iot_mqtt_subscribe_many;
 	pClient->unsubscribe = aws_iot_mqtt_unsubscribe;
 	pClient->yield = aws_iot_mqtt_yield;
+	pClient->getPollFd = aws_iot_mqtt_get_poll_fd;
+	pClient->nextDeadlineMs = aws_iot_mqtt_next_deadline_ms;
+	pClient->process = aws_iot_mqtt_process;
 	pClient->isAutoReconnectEnabled = aws_iot_is_autoreconnect_enabled;
 	pClient->setAutoReconnectStatus = aws_iot_mqtt_autoreconnect_set_status;
+	pClient->pContext = NULL;
+
+	for(i = 0; i < AWS_IOT_MQTT_MAX_CLIENTS; i++) {
+		if(!clientContexts[i].isUsed) {
+			clientContexts[i].isUsed = true;
+			clientContexts[i].isPowerCycle = true;
+			clientContexts[i].clientDisconnectHandler = NULL;
+			clientContexts[i].pClient = pClient;
+			pClient->pContext = &clientContexts[i];
+			return NONE_ERROR;
+		}
+	}
+
+	// without a context every call on this client fails with NULL_VALUE_ERROR
+	return MQTT_CLIENT_POOL_FULL;
+}
+
+void aws_iot_mqtt_free(MQTTClient_t *pClient){
+	Client *c = getPahoClient(pClient);
+
+	if(NULL == c) {
+		return;
+	}
+
+	if(MQTTIsConnected(c)) {
+		MQTTDisconnect(c);
+	}
+
+	((MQTTClientContext_t *)pClient->pContext)->isUsed = false;
+	pClient->pContext = NULL;
 }
@@ -47,6 +47,28 @@ typedef struct{
 	unsigned char ServerVerificationFlag;	///< Boolean.  True = perform server certificate hostname validation.  False = skip validation \b NOT recommended.
 }TLSConnectParams;
 
+/**
+ * @brief Network I/O Vector
+ *
+ * One buffer of a scatter/gather write. Lets the MQTT client send a packet header
+ * and the caller's payload without copying them into one buffer first.
+ */
+typedef struct{
+	unsigned char *pBuffer;	///< Pointer to the bytes to write
+	int len;				///< Number of bytes at pBuffer
+}NetworkIOVector;
+
+/**
+ * @brief TLS Handshake Statistics
+ *
+ * Counts the handshakes of all connections since start up. A resumed handshake reuses the
+ * session stored at the last clean disconnect and skips the certificate exchange.
+ */
+typedef struct{
+	unsigned int fullHandshakes;	///< Number of handshakes that negotiated a new session
+	unsigned int resumedHandshakes;	///< Number of handshakes that resumed a stored session
+}TLSHandshakeStats;
+
 /**
  * @brief Network Structure
  *
@@ -54,11 +76,16 @@ typedef struct{
  */
 struct Network{
 	int my_socket;	///< Integer holding the socket file descriptor
+	void *pTLSContext;	///< Pointer to the TLS state of this connection, owned by the platform implementation. NULL until iot_tls_init
 	int (*connect) (Network *, TLSConnectParams);
 	int (*mqttread) (Network*, unsigned char*, int, int);	///< Function pointer pointing to the network function to read from the network
+	int (*mqttrecv) (Network*, unsigned char*, int, int);	///< Function pointer pointing to the network function to read whatever is available from the network. May be NULL
 	int (*mqttwrite) (Network*, unsigned char*, int, int);	///< Function pointer pointing to the network function to write to the network
+	int (*mqttwritev) (Network*, NetworkIOVector*, int, int);	///< Function pointer pointing to the network function to write several buffers to the network in order. May be NULL
 	void (*disconnect) (Network*);		///< Function pointer pointing to the network function to disconnect from the network
 	int (*isConnected) (Network*);     ///< Function pointer pointing to the network function to check if physical layer is connected
+	int (*getPollFd) (Network*);	///< Function pointer pointing to the network function returning the socket descriptor to wait on for readability. May be NULL
+	int (*hasPending) (Network*);	///< Function pointer pointing to the network function telling if received bytes are buffered above the socket, which polling the descriptor does not report. May be NULL
 	int (*destroy) (Network*);		///< Function pointer pointing to the network function to destroy the network object
 };
 
@@ -96,6 +123,19 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams TLSParams);
  */
 int iot_tls_write(Network*, unsigned char*, int, int);
 
+/**
+ * @brief Write several buffers to the network socket
+ *
+ * The buffers are written in order as one continuous stream of bytes.
+ *
+ * @param Network - Pointer to a Network struct defining the network interface.
+ * @param NetworkIOVector pointer - array of buffers to write to socket
+ * @param integer - number of entries in the array
+ * @param integer - write timeout value in milliseconds
+ * @return integer - total number of bytes written or TLS error
+ */
+int iot_tls_writev(Network*, NetworkIOVector*, int, int);
+
 /**
  * @brief Read bytes from the network socket
  *
@@ -107,6 +147,20 @@ int iot_tls_write(Network*, unsigned char*, int, int);
  */
 int iot_tls_read(Network*, unsigned char*, int, int);
 
+/**
+ * @brief Read the bytes available on the network socket
+ *
+ * Unlike iot_tls_read this returns as soon as some data is available, which lets the
+ * MQTT client pull several small packets with a single call.
+ *
+ * @param Network - Pointer to a Network struct defining the network interface.
+ * @param unsigned char pointer - pointer to buffer where read bytes should be copied
+ * @param integer - maximum number of bytes to read
+ * @param integer - time in milliseconds to wait for the first byte
+ * @return integer - number of bytes read, 0 if nothing arrived in time, or TLS error
+ */
+int iot_tls_recv(Network*, unsigned char*, int, int);
+
 /**
  * @brief Disconnect from network socket
  *
@@ -134,4 +188,44 @@ int iot_tls_destroy(Network *pNetwork);
  */
 int iot_tls_is_connected(Network *pNetwork);
 
+/**
+ * @brief Socket descriptor of the TLS connection
+ *
+ * Called to get the descriptor a host event loop can wait on for readability.
+ *
+ * @param Network - Pointer to a Network struct defining the network interface.
+ * @return int - the socket descriptor, or -1 if there is no open connection
+ */
+int iot_tls_get_poll_fd(Network *pNetwork);
+
+/**
+ * @brief Check for decrypted bytes not read yet
+ *
+ * A read may leave part of a TLS record decrypted in the TLS layer once the socket itself is
+ * drained, so the descriptor returned by iot_tls_get_poll_fd no longer becomes readable for them.
+ *
+ * @param Network - Pointer to a Network struct defining the network interface.
+ * @return int - 1 if bytes can be read without waiting on the socket, 0 otherwise
+ */
+int iot_tls_has_pending(Network *pNetwork);
+
+/**
+ * @brief Reload the cached TLS credentials
+ *
+ * The root CA, device certificate and private key are read once and shared by every
+ * connection and reconnect. Call this after the files have been replaced to read them again.
+ * Connections opened afterwards use the new credentials, open connections are not affected.
+ *
+ * @return integer - successful reload or TLS error. On error the previous credentials stay in use
+ */
+int iot_tls_reload_credentials(void);
+
+/**
+ * @brief Read the TLS handshake counters
+ *
+ * @param pStats - Pointer to the struct the counters are copied to
+ * @return integer - 0 on success or TLS error
+ */
+int iot_tls_get_handshake_stats(TLSHandshakeStats *pStats);
+
 #endif //__NETWORK_INTERFACE_H_
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2010-2015 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/**
+ * @file network_reactor.c
+ * @brief Linux epoll implementation of the network reactor.
+ */
+
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "network_reactor.h"
+
+static uint32_t toEpollEvents(unsigned int events) {
+	uint32_t epollEvents = 0;
+
+	if(events & NETWORK_REACTOR_READABLE) {
+		epollEvents |= EPOLLIN;
+	}
+	if(events & NETWORK_REACTOR_WRITABLE) {
+		epollEvents |= EPOLLOUT;
+	}
+	return epollEvents;
+}
+
+static unsigned int fromEpollEvents(uint32_t epollEvents) {
+	unsigned int events = 0;
+
+	if(epollEvents & EPOLLIN) {
+		events |= NETWORK_REACTOR_READABLE;
+	}
+	if(epollEvents & EPOLLOUT) {
+		events |= NETWORK_REACTOR_WRITABLE;
+	}
+	if(epollEvents & (EPOLLERR | EPOLLHUP)) {
+		events |= NETWORK_REACTOR_ERROR;
+	}
+	return events;
+}
+
+static IoT_Error_t control(NetworkReactor *pReactor, int operation, NetworkReactorEntry *pEntry,
+		unsigned int events) {
+	struct epoll_event event;
+	Network *pNetwork;
+	int fd;
+
+	if(NULL == pReactor || NULL == pEntry || NULL == pEntry->pNetwork || NULL == pEntry->pNetwork->getPollFd) {
+		return NULL_VALUE_ERROR;
+	}
+
+	// my_socket may hold something else than the descriptor, only the port knows
+	pNetwork = pEntry->pNetwork;
+	fd = pNetwork->getPollFd(pNetwork);
+	if(0 > fd) {
+		return NULL_VALUE_ERROR;
+	}
+
+	event.events = toEpollEvents(events);
+	event.data.ptr = pEntry;
+
+	if(0 != epoll_ctl(pReactor->epollFd, operation, fd, &event)) {
+		return TCP_SETUP_ERROR;
+	}
+	return NONE_ERROR;
+}
+
+static int hasPending(NetworkReactorEntry *pEntry) {
+	Network *pNetwork = pEntry->pNetwork;
+
+	return (NULL != pNetwork->hasPending && pNetwork->hasPending(pNetwork)) ? 1 : 0;
+}
+
+IoT_Error_t iot_reactor_init(NetworkReactor *pReactor) {
+	if(NULL == pReactor) {
+		return NULL_VALUE_ERROR;
+	}
+
+	pReactor->pEntries = NULL;
+	pReactor->run = 0;
+	pReactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(0 > pReactor->epollFd) {
+		return TCP_SETUP_ERROR;
+	}
+	return NONE_ERROR;
+}
+
+IoT_Error_t iot_reactor_add(NetworkReactor *pReactor, NetworkReactorEntry *pEntry, unsigned int events) {
+	IoT_Error_t rc;
+
+	if(NULL == pEntry || NULL == pEntry->callback) {
+		return NULL_VALUE_ERROR;
+	}
+
+	rc = control(pReactor, EPOLL_CTL_ADD, pEntry, events);
+	if(NONE_ERROR == rc) {
+		pEntry->readRun = pReactor->run;
+		pEntry->pNext = pReactor->pEntries;
+		pReactor->pEntries = pEntry;
+	}
+	return rc;
+}
+
+IoT_Error_t iot_reactor_modify(NetworkReactor *pReactor, NetworkReactorEntry *pEntry, unsigned int events) {
+	return control(pReactor, EPOLL_CTL_MOD, pEntry, events);
+}
+
+IoT_Error_t iot_reactor_remove(NetworkReactor *pReactor, NetworkReactorEntry *pEntry) {
+	NetworkReactorEntry **ppLink;
+
+	if(NULL == pReactor || NULL == pEntry) {
+		return NULL_VALUE_ERROR;
+	}
+
+	for(ppLink = &(pReactor->pEntries); NULL != *ppLink; ppLink = &((*ppLink)->pNext)) {
+		if(pEntry == *ppLink) {
+			*ppLink = pEntry->pNext;
+			break;
+		}
+	}
+	return control(pReactor, EPOLL_CTL_DEL, pEntry, 0);
+}
+
+int iot_reactor_run(NetworkReactor *pReactor, int timeout_ms) {
+	struct epoll_event events[AWS_IOT_NETWORK_REACTOR_MAX_EVENTS];
+	NetworkReactorEntry *pEntry;
+	NetworkReactorEntry *pNext;
+	unsigned int readyEvents;
+	int readyCount;
+	int calledCount;
+	int i;
+
+	if(NULL == pReactor) {
+		return NULL_VALUE_ERROR;
+	}
+
+	// bytes already decrypted do not wake epoll up, do not wait while there are any
+	for(pEntry = pReactor->pEntries; NULL != pEntry && 0 != timeout_ms; pEntry = pEntry->pNext) {
+		if(hasPending(pEntry)) {
+			timeout_ms = 0;
+		}
+	}
+
+	readyCount = epoll_wait(pReactor->epollFd, events, AWS_IOT_NETWORK_REACTOR_MAX_EVENTS, timeout_ms);
+	if(0 > readyCount) {
+		// a signal only cuts the wait short
+		if(EINTR != errno) {
+			return TCP_SETUP_ERROR;
+		}
+		readyCount = 0;
+	}
+
+	pReactor->run++;
+	for(i = 0; i < readyCount; i++) {
+		pEntry = (NetworkReactorEntry *)events[i].data.ptr;
+		readyEvents = fromEpollEvents(events[i].events);
+		if(readyEvents & NETWORK_REACTOR_READABLE) {
+			pEntry->readRun = pReactor->run;
+		}
+		pEntry->callback(pEntry, readyEvents);
+	}
+	calledCount = readyCount;
+
+	for(pEntry = pReactor->pEntries; NULL != pEntry; pEntry = pNext) {
+		pNext = pEntry->pNext;
+		if(pReactor->run != pEntry->readRun && hasPending(pEntry)) {
+			pEntry->callback(pEntry, NETWORK_REACTOR_READABLE);
+			calledCount++;
+		}
+	}
+
+	return calledCount;
+}
+
+void iot_reactor_destroy(NetworkReactor *pReactor) {
+	if(NULL == pReactor || 0 > pReactor->epollFd) {
+		return;
+	}
+	close(pReactor->epollFd);
+	pReactor->epollFd = -1;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2010-2015 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef SRC_PROTOCOL_MQTT_AWS_IOT_EMBEDDED_CLIENT_WRAPPER_PLATFORM_LINUX_COMMON_NETWORK_REACTOR_H_
+#define SRC_PROTOCOL_MQTT_AWS_IOT_EMBEDDED_CLIENT_WRAPPER_PLATFORM_LINUX_COMMON_NETWORK_REACTOR_H_
+
+/**
+ * @file network_reactor.h
+ * @brief Optional epoll reactor for serving many connections from one thread.
+ *
+ * Each connected Network is registered with a readiness callback. A single call to
+ * iot_reactor_run waits on all of them at once and calls back the ready ones, so the cost
+ * of a wait does not grow with the number of connections. Only the check for bytes the TLS
+ * layer already decrypted, which epoll cannot see, visits every connection.
+ */
+
+#include "aws_iot_error.h"
+#include "network_interface.h"
+
+/**
+ * Maximum number of ready connections handled by one call to iot_reactor_run.
+ * Connections left over are reported by the next call.
+ */
+#ifndef AWS_IOT_NETWORK_REACTOR_MAX_EVENTS
+#define AWS_IOT_NETWORK_REACTOR_MAX_EVENTS 64
+#endif
+
+#define NETWORK_REACTOR_READABLE 0x01	///< The connection has data to read
+#define NETWORK_REACTOR_WRITABLE 0x02	///< The connection can be written without blocking
+#define NETWORK_REACTOR_ERROR 0x04		///< The connection was closed or failed
+
+typedef struct NetworkReactorEntry NetworkReactorEntry;
+
+/**
+ * @brief Readiness callback
+ *
+ * @param pEntry - the registration of the ready connection
+ * @param events - NETWORK_REACTOR_* flags of the readiness
+ */
+typedef void (*NetworkReactorCallback)(NetworkReactorEntry *pEntry, unsigned int events);
+
+/**
+ * @brief Registration of one connection
+ *
+ * Owned by the caller and must stay valid until the connection is removed from the reactor.
+ */
+struct NetworkReactorEntry{
+	Network *pNetwork;					///< The registered connection
+	NetworkReactorCallback callback;	///< Called when the connection is ready
+	void *pUserData;					///< Passed through untouched, typically the MQTT client of the connection
+	NetworkReactorEntry *pNext;			///< Next registered connection, owned by the reactor
+	unsigned int readRun;				///< Last run that reported the connection readable, owned by the reactor
+};
+
+/**
+ * @brief Network Reactor
+ */
+typedef struct{
+	int epollFd;					///< epoll instance waiting on all registered connections
+	NetworkReactorEntry *pEntries;	///< Registered connections, checked for pending TLS bytes
+	unsigned int run;				///< Number of calls to iot_reactor_run
+}NetworkReactor;
+
+/**
+ * @brief Create the epoll instance of a reactor
+ *
+ * @param pReactor - the reactor to initialize
+ * @return NONE_ERROR or TCP_SETUP_ERROR
+ */
+IoT_Error_t iot_reactor_init(NetworkReactor *pReactor);
+
+/**
+ * @brief Register a connected Network
+ *
+ * The connection is watched on the descriptor returned by Network::getPollFd, so it must be
+ * connected before it is added.
+ *
+ * @param pReactor - the reactor
+ * @param pEntry - registration filled in with the connection, callback and user data
+ * @param events - NETWORK_REACTOR_READABLE and/or NETWORK_REACTOR_WRITABLE
+ * @return NONE_ERROR, NULL_VALUE_ERROR if the port has no descriptor to offer, or TCP_SETUP_ERROR
+ */
+IoT_Error_t iot_reactor_add(NetworkReactor *pReactor, NetworkReactorEntry *pEntry, unsigned int events);
+
+/**
+ * @brief Change the readiness a registered connection is waiting for
+ *
+ * @param pReactor - the reactor
+ * @param pEntry - registration passed to iot_reactor_add
+ * @param events - NETWORK_REACTOR_READABLE and/or NETWORK_REACTOR_WRITABLE
+ * @return NONE_ERROR or TCP_SETUP_ERROR
+ */
+IoT_Error_t iot_reactor_modify(NetworkReactor *pReactor, NetworkReactorEntry *pEntry, unsigned int events);
+
+/**
+ * @brief Remove a connection, call before it is disconnected
+ *
+ * @param pReactor - the reactor
+ * @param pEntry - registration passed to iot_reactor_add
+ * @return NONE_ERROR, NULL_VALUE_ERROR if the connection no longer has a descriptor, or TCP_SETUP_ERROR
+ */
+IoT_Error_t iot_reactor_remove(NetworkReactor *pReactor, NetworkReactorEntry *pEntry);
+
+/**
+ * @brief Wait for ready connections and call their callbacks
+ *
+ * A connection whose TLS layer holds decrypted bytes the socket no longer signals, as reported
+ * by Network::hasPending, is called back as readable without waiting. A callback may remove
+ * its own connection, but no other one.
+ *
+ * @param pReactor - the reactor
+ * @param timeout_ms - maximum time to wait, 0 to return immediately
+ * @return number of connections called back, or TCP_SETUP_ERROR
+ */
+int iot_reactor_run(NetworkReactor *pReactor, int timeout_ms);
+
+/**
+ * @brief Close the epoll instance of a reactor
+ *
+ * @param pReactor - the reactor
+ */
+void iot_reactor_destroy(NetworkReactor *pReactor);
+
+#endif /* SRC_PROTOCOL_MQTT_AWS_IOT_EMBEDDED_CLIENT_WRAPPER_PLATFORM_LINUX_COMMON_NETWORK_REACTOR_H_ */
@@ -19,38 +19,36 @@
  */
 
 #include <stddef.h>
-#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "timer_linux.h"
 
+/* CLOCK_MONOTONIC, so a wall clock set by NTP or by hand does not move running timeouts */
+static int64_t getTimeInMillis(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 char expired(Timer* timer) {
-	struct timeval now, res;
-	gettimeofday(&now, NULL);
-	timersub(&timer->end_time, &now, &res);
-	return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+	return timer->end_time <= getTimeInMillis();
 }
 
 void countdown_ms(Timer* timer, unsigned int timeout) {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	struct timeval interval = { timeout / 1000, (timeout % 1000) * 1000 };
-	timeradd(&now, &interval, &timer->end_time);
+	timer->end_time = getTimeInMillis() + timeout;
 }
 
 void countdown(Timer* timer, unsigned int timeout) {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	struct timeval interval = { timeout, 0 };
-	timeradd(&now, &interval, &timer->end_time);
+	timer->end_time = getTimeInMillis() + (int64_t)timeout * 1000;
 }
 
 int left_ms(Timer* timer) {
-	struct timeval now, res;
-	gettimeofday(&now, NULL);
-	timersub(&timer->end_time, &now, &res);
-	return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000;
+	int64_t left = timer->end_time - getTimeInMillis();
+	return (left < 0) ? 0 : (int)left;
 }
 
 void InitTimer(Timer* timer) {
-	timer->end_time = (struct timeval ) { 0, 0 };
+	timer->end_time = 0;
 }
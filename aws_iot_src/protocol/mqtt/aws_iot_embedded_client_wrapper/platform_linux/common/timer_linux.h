@@ -19,15 +19,14 @@
 /**
  * @file timer_linux.h
  */
-#include <sys/time.h>
-#include <sys/select.h>
+#include <stdint.h>
 #include "timer_interface.h"
 
 /**
  * definition of the Timer struct. Platform specific
  */
 struct Timer{
-	struct timeval end_time;
+	int64_t end_time;	///< milliseconds on CLOCK_MONOTONIC
 };
 
 
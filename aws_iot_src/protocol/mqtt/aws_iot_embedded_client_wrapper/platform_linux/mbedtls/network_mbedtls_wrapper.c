@@ -14,7 +14,9 @@
  */
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "aws_iot_error.h"
 #include "aws_iot_log.h"
@@ -52,47 +54,332 @@ static int myCertVerify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *
 	return (0);
 }
 
-static int ret = 0, i;
+/**
+ * Parsed root CA, device certificate and private key, shared by every connection.
+ * Each connection holds a reference, so a reload never frees the credentials of an open connection.
+ */
+typedef struct {
+	mbedtls_x509_crt cacert;
+	mbedtls_x509_crt clicert;
+	mbedtls_pk_context pkey;
+	char *pRootCALocation;
+	char *pDeviceCertLocation;
+	char *pDevicePrivateKeyLocation;
+	mbedtls_ssl_session session;	// session of the last clean disconnect, offered to the same endpoint on the next connect
+	bool isSessionStored;
+	char *pSessionURL;
+	int sessionPort;
+	unsigned int refCount;
+} Credentials_t;
+
+/**
+ * TLS state of one connection, pointed to by Network::pTLSContext
+ */
+typedef struct {
+	mbedtls_ssl_context ssl;
+	mbedtls_ssl_config conf;
+	mbedtls_net_context server_fd;
+	Credentials_t *pCredentials;
+	char *pDestinationURL;
+	int destinationPort;
+	unsigned char offeredSessionId[32];
+	size_t offeredSessionIdLen;
+} TLSContext_t;
+
+// the random generator is seeded once and shared by every connection
 static mbedtls_entropy_context entropy;
 static mbedtls_ctr_drbg_context ctr_drbg;
-static mbedtls_ssl_context ssl;
-static mbedtls_ssl_config conf;
-static uint32_t flags;
-static mbedtls_x509_crt cacert;
-static mbedtls_x509_crt clicert;
-static mbedtls_pk_context pkey;
-static mbedtls_net_context server_fd;
+static bool isRandomSeeded = false;
+
+static Credentials_t *pCachedCredentials = NULL;
+static pthread_mutex_t credentialsMutex = PTHREAD_MUTEX_INITIALIZER;
+static TLSHandshakeStats handshakeStats;
+
+static void freeCredentials(Credentials_t *pCredentials) {
+	mbedtls_x509_crt_free(&pCredentials->clicert);
+	mbedtls_x509_crt_free(&pCredentials->cacert);
+	mbedtls_pk_free(&pCredentials->pkey);
+	mbedtls_ssl_session_free(&pCredentials->session);
+	free(pCredentials->pSessionURL);
+	free(pCredentials->pRootCALocation);
+	free(pCredentials->pDeviceCertLocation);
+	free(pCredentials->pDevicePrivateKeyLocation);
+	free(pCredentials);
+}
 
-int iot_tls_init(Network *pNetwork) {
-	IoT_Error_t ret_val = NONE_ERROR;
+// the caller holds credentialsMutex
+static void releaseCredentials(Credentials_t *pCredentials) {
+	if (NULL != pCredentials && 0 == --pCredentials->refCount) {
+		freeCredentials(pCredentials);
+	}
+}
+
+static bool isSameLocation(const char *pCached, const char *pLocation) {
+	if (NULL == pCached || NULL == pLocation) {
+		return pCached == pLocation;
+	}
+	return 0 == strcmp(pCached, pLocation);
+}
+
+static char *copyLocation(const char *pLocation) {
+	return (NULL == pLocation) ? NULL : strdup(pLocation);
+}
+
+static int loadCredentials(const char *pRootCALocation, const char *pDeviceCertLocation,
+		const char *pDevicePrivateKeyLocation, Credentials_t **ppCredentials) {
+	int ret;
+	Credentials_t *pCredentials = (Credentials_t *) calloc(1, sizeof(Credentials_t));
+
+	if (NULL == pCredentials) {
+		ERROR(" failed\n  ! unable to allocate the credentials\n");
+		return SSL_INIT_ERROR;
+	}
+	mbedtls_x509_crt_init(&pCredentials->cacert);
+	mbedtls_x509_crt_init(&pCredentials->clicert);
+	mbedtls_pk_init(&pCredentials->pkey);
+	mbedtls_ssl_session_init(&pCredentials->session);
+
+	DEBUG("  . Loading the CA root certificate ...");
+	ret = mbedtls_x509_crt_parse_file(&pCredentials->cacert, pRootCALocation);
+	if (ret < 0) {
+		ERROR(" failed\n  !  mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
+		freeCredentials(pCredentials);
+		return ret;
+	} DEBUG(" ok (%d skipped)\n", ret);
+
+	DEBUG("  . Loading the client cert. and key...");
+	ret = mbedtls_x509_crt_parse_file(&pCredentials->clicert, pDeviceCertLocation);
+	if (ret != 0) {
+		ERROR(" failed\n  !  mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
+		freeCredentials(pCredentials);
+		return ret;
+	}
+
+	ret = mbedtls_pk_parse_keyfile(&pCredentials->pkey, pDevicePrivateKeyLocation, "");
+	if (ret != 0) {
+		ERROR(" failed\n  !  mbedtls_pk_parse_key returned -0x%x\n\n", -ret);
+		freeCredentials(pCredentials);
+		return ret;
+	} DEBUG(" ok\n");
+
+	pCredentials->pRootCALocation = copyLocation(pRootCALocation);
+	pCredentials->pDeviceCertLocation = copyLocation(pDeviceCertLocation);
+	pCredentials->pDevicePrivateKeyLocation = copyLocation(pDevicePrivateKeyLocation);
+	// the reference of the cache
+	pCredentials->refCount = 1;
+
+	*ppCredentials = pCredentials;
+	return NONE_ERROR;
+}
+
+/**
+ * Takes a reference on the cached credentials.
+ * The files are only parsed on the first connect, or when the connection asks for different files than the ones cached.
+ */
+static int acquireCredentials(TLSConnectParams *pParams, Credentials_t **ppCredentials) {
+	int ret = NONE_ERROR;
+	Credentials_t *pCredentials;
+
+	pthread_mutex_lock(&credentialsMutex);
+
+	if (NULL == pCachedCredentials
+			|| !isSameLocation(pCachedCredentials->pRootCALocation, pParams->pRootCALocation)
+			|| !isSameLocation(pCachedCredentials->pDeviceCertLocation, pParams->pDeviceCertLocation)
+			|| !isSameLocation(pCachedCredentials->pDevicePrivateKeyLocation, pParams->pDevicePrivateKeyLocation)) {
+		ret = loadCredentials(pParams->pRootCALocation, pParams->pDeviceCertLocation,
+				pParams->pDevicePrivateKeyLocation, &pCredentials);
+		if (NONE_ERROR == ret) {
+			releaseCredentials(pCachedCredentials);
+			pCachedCredentials = pCredentials;
+		}
+	}
+
+	if (NONE_ERROR == ret) {
+		pCachedCredentials->refCount++;
+		*ppCredentials = pCachedCredentials;
+	}
+
+	pthread_mutex_unlock(&credentialsMutex);
+
+	return ret;
+}
+
+int iot_tls_reload_credentials(void) {
+	int ret = NONE_ERROR;
+	Credentials_t *pCredentials;
+
+	pthread_mutex_lock(&credentialsMutex);
+
+	// nothing cached yet, the next connect parses the files anyway
+	if (NULL != pCachedCredentials) {
+		ret = loadCredentials(pCachedCredentials->pRootCALocation, pCachedCredentials->pDeviceCertLocation,
+				pCachedCredentials->pDevicePrivateKeyLocation, &pCredentials);
+		// on error the previous credentials stay in use
+		if (NONE_ERROR == ret) {
+			releaseCredentials(pCachedCredentials);
+			pCachedCredentials = pCredentials;
+		}
+	}
+
+	pthread_mutex_unlock(&credentialsMutex);
+
+	return ret;
+}
+
+int iot_tls_get_handshake_stats(TLSHandshakeStats *pStats) {
+	if (NULL == pStats) {
+		return NULL_VALUE_ERROR;
+	}
+
+	pthread_mutex_lock(&credentialsMutex);
+	*pStats = handshakeStats;
+	pthread_mutex_unlock(&credentialsMutex);
+
+	return NONE_ERROR;
+}
+
+// offers the session stored with the credentials when it was negotiated with the same endpoint
+static void offerSession(TLSContext_t *pContext) {
+	Credentials_t *pCredentials = pContext->pCredentials;
+
+	pContext->offeredSessionIdLen = 0;
+
+	pthread_mutex_lock(&credentialsMutex);
+	if (pCredentials->isSessionStored && pContext->destinationPort == pCredentials->sessionPort
+			&& isSameLocation(pCredentials->pSessionURL, pContext->pDestinationURL)
+			&& 0 == mbedtls_ssl_set_session(&pContext->ssl, &pCredentials->session)) {
+		// a resuming server answers with the session id it was offered
+		pContext->offeredSessionIdLen = pCredentials->session.id_len;
+		memcpy(pContext->offeredSessionId, pCredentials->session.id, pCredentials->session.id_len);
+	}
+	pthread_mutex_unlock(&credentialsMutex);
+}
+
+static void countHandshake(TLSContext_t *pContext) {
+	const mbedtls_ssl_session *pSession = pContext->ssl.session;
+	bool isResumed = (0 < pContext->offeredSessionIdLen && NULL != pSession
+			&& pSession->id_len == pContext->offeredSessionIdLen
+			&& 0 == memcmp(pSession->id, pContext->offeredSessionId, pContext->offeredSessionIdLen));
+
+	pthread_mutex_lock(&credentialsMutex);
+	if (isResumed) {
+		handshakeStats.resumedHandshakes++;
+	} else {
+		handshakeStats.fullHandshakes++;
+	}
+	pthread_mutex_unlock(&credentialsMutex);
+}
+
+static void storeSession(TLSContext_t *pContext) {
+	Credentials_t *pCredentials = pContext->pCredentials;
+
+	if (NULL == pCredentials || MBEDTLS_SSL_HANDSHAKE_OVER != pContext->ssl.state) {
+		return;
+	}
+
+	pthread_mutex_lock(&credentialsMutex);
+	mbedtls_ssl_session_free(&pCredentials->session);
+	mbedtls_ssl_session_init(&pCredentials->session);
+	free(pCredentials->pSessionURL);
+	pCredentials->pSessionURL = NULL;
+	pCredentials->isSessionStored = (0 == mbedtls_ssl_get_session(&pContext->ssl, &pCredentials->session));
+	if (pCredentials->isSessionStored) {
+		pCredentials->pSessionURL = copyLocation(pContext->pDestinationURL);
+		pCredentials->sessionPort = pContext->destinationPort;
+	}
+	pthread_mutex_unlock(&credentialsMutex);
+}
+
+static void freeTLSContext(TLSContext_t *pContext) {
+	mbedtls_net_free(&pContext->server_fd);
+
+	mbedtls_ssl_free(&pContext->ssl);
+	mbedtls_ssl_config_free(&pContext->conf);
+
+	pthread_mutex_lock(&credentialsMutex);
+	releaseCredentials(pContext->pCredentials);
+	pthread_mutex_unlock(&credentialsMutex);
+
+	free(pContext);
+}
+
+static TLSContext_t *getTLSContext(Network *pNetwork) {
+	if (NULL == pNetwork) {
+		return NULL;
+	}
+	return (TLSContext_t *) pNetwork->pTLSContext;
+}
+
+static int seedRandom(void) {
+	int ret = 0;
 	const char *pers = "aws_iot_tls_wrapper";
-	unsigned char buf[MBEDTLS_SSL_MAX_CONTENT_LEN + 1];
 
-	mbedtls_net_init(&server_fd);
-	mbedtls_ssl_init(&ssl);
-	mbedtls_ssl_config_init(&conf);
-	mbedtls_ctr_drbg_init(&ctr_drbg);
-	mbedtls_x509_crt_init(&cacert);
-	mbedtls_x509_crt_init(&clicert);
-	mbedtls_pk_init(&pkey);
-
-	DEBUG("\n  . Seeding the random number generator...");
-	mbedtls_entropy_init(&entropy);
-	if ((ret_val = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *) pers,
-			strlen(pers))) != 0) {
-		ERROR(" failed\n  ! mbedtls_ctr_drbg_seed returned -0x%x\n", -ret);
+	pthread_mutex_lock(&credentialsMutex);
+	if (!isRandomSeeded) {
+		DEBUG("\n  . Seeding the random number generator...");
+		mbedtls_entropy_init(&entropy);
+		mbedtls_ctr_drbg_init(&ctr_drbg);
+		if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *) pers,
+				strlen(pers))) != 0) {
+			ERROR(" failed\n  ! mbedtls_ctr_drbg_seed returned -0x%x\n", -ret);
+			mbedtls_ctr_drbg_free(&ctr_drbg);
+			mbedtls_entropy_free(&entropy);
+		} else {
+			isRandomSeeded = true;
+			DEBUG("ok\n");
+		}
+	}
+	pthread_mutex_unlock(&credentialsMutex);
+
+	return ret;
+}
+
+int iot_tls_init(Network *pNetwork) {
+	int ret;
+	TLSContext_t *pContext;
+
+	if (NULL == pNetwork) {
+		return NULL_VALUE_ERROR;
+	}
+
+	if ((ret = seedRandom()) != 0) {
 		return ret;
-	} DEBUG("ok\n");
+	}
+
+	// a connect that failed half way leaves its context behind
+	if (NULL != pNetwork->pTLSContext) {
+		freeTLSContext((TLSContext_t *) pNetwork->pTLSContext);
+		pNetwork->pTLSContext = NULL;
+	}
+
+	pContext = (TLSContext_t *) malloc(sizeof(TLSContext_t));
+	if (NULL == pContext) {
+		ERROR(" failed\n  ! unable to allocate the TLS context\n");
+		return SSL_INIT_ERROR;
+	}
 
+	mbedtls_net_init(&pContext->server_fd);
+	mbedtls_ssl_init(&pContext->ssl);
+	mbedtls_ssl_config_init(&pContext->conf);
+	pContext->pCredentials = NULL;
+	pContext->pDestinationURL = NULL;
+	pContext->destinationPort = 0;
+	pContext->offeredSessionIdLen = 0;
+
+	pNetwork->pTLSContext = pContext;
 	pNetwork->my_socket = 0;
 	pNetwork->connect = iot_tls_connect;
 	pNetwork->mqttread = iot_tls_read;
+	pNetwork->mqttrecv = iot_tls_recv;
 	pNetwork->mqttwrite = iot_tls_write;
+	pNetwork->mqttwritev = iot_tls_writev;
 	pNetwork->disconnect = iot_tls_disconnect;
 	pNetwork->isConnected = iot_tls_is_connected;
+	pNetwork->getPollFd = iot_tls_get_poll_fd;
+	pNetwork->hasPending = iot_tls_has_pending;
 	pNetwork->destroy = iot_tls_destroy;
 
-	return ret_val;
+	return NONE_ERROR;
 }
 
 int iot_tls_is_connected(Network *pNetwork) {
@@ -100,78 +387,93 @@ int iot_tls_is_connected(Network *pNetwork) {
 	return 1;
 }
 
+int iot_tls_get_poll_fd(Network *pNetwork) {
+	/* my_socket holds the TCP socket while connected and 0 otherwise */
+	return (0 < pNetwork->my_socket) ? pNetwork->my_socket : -1;
+}
+
+int iot_tls_has_pending(Network *pNetwork) {
+	TLSContext_t *pContext = getTLSContext(pNetwork);
+
+	if (NULL == pContext) {
+		return 0;
+	}
+	return (0 < mbedtls_ssl_get_bytes_avail(&pContext->ssl)) ? 1 : 0;
+}
+
 int iot_tls_connect(Network *pNetwork, TLSConnectParams params) {
-	const char *pers = "aws_iot_tls_wrapper";
+	int ret;
+	uint32_t flags;
 	unsigned char buf[MBEDTLS_SSL_MAX_CONTENT_LEN + 1];
+	TLSContext_t *pContext = getTLSContext(pNetwork);
 
-	DEBUG("  . Loading the CA root certificate ...");
-	ret = mbedtls_x509_crt_parse_file(&cacert, params.pRootCALocation);
-	if (ret < 0) {
-		ERROR(" failed\n  !  mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-		return ret;
-	} DEBUG(" ok (%d skipped)\n", ret);
-
-	DEBUG("  . Loading the client cert. and key...");
-	ret = mbedtls_x509_crt_parse_file(&clicert, params.pDeviceCertLocation);
-	if (ret != 0) {
-		ERROR(" failed\n  !  mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-		return ret;
+	if (NULL == pContext) {
+		return NULL_VALUE_ERROR;
 	}
 
-	ret = mbedtls_pk_parse_keyfile(&pkey, params.pDevicePrivateKeyLocation, "");
-	if (ret != 0) {
-		ERROR(" failed\n  !  mbedtls_pk_parse_key returned -0x%x\n\n", -ret);
-		return ret;
-	} DEBUG(" ok\n");
+	if (NULL == pContext->pCredentials) {
+		ret = acquireCredentials(&params, &pContext->pCredentials);
+		if (ret != NONE_ERROR) {
+			return ret;
+		}
+	}
 	char portBuffer[6];
 	sprintf(portBuffer, "%d", params.DestinationPort); DEBUG("  . Connecting to %s/%s...", params.pDestinationURL, portBuffer);
-	if ((ret = mbedtls_net_connect(&server_fd, params.pDestinationURL, portBuffer, MBEDTLS_NET_PROTO_TCP)) != 0) {
+	if ((ret = mbedtls_net_connect(&pContext->server_fd, params.pDestinationURL, portBuffer, MBEDTLS_NET_PROTO_TCP)) != 0) {
 		ERROR(" failed\n  ! mbedtls_net_connect returned -0x%x\n\n", -ret);
 		return ret;
 	}
+	pNetwork->my_socket = pContext->server_fd.fd;
 
-	ret = mbedtls_net_set_block(&server_fd);
+	ret = mbedtls_net_set_block(&pContext->server_fd);
 	if (ret != 0) {
 		ERROR(" failed\n  ! net_set_(non)block() returned -0x%x\n\n", -ret);
 		return ret;
 	} DEBUG(" ok\n");
 
 	DEBUG("  . Setting up the SSL/TLS structure...");
-	if ((ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+	if ((ret = mbedtls_ssl_config_defaults(&pContext->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
 			MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
 		ERROR(" failed\n  ! mbedtls_ssl_config_defaults returned -0x%x\n\n", -ret);
 		return ret;
 	}
 
-	mbedtls_ssl_conf_verify(&conf, myCertVerify, NULL);
+	mbedtls_ssl_conf_verify(&pContext->conf, myCertVerify, NULL);
 	if (params.ServerVerificationFlag == true) {
-		mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+		mbedtls_ssl_conf_authmode(&pContext->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
 	} else {
-		mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+		mbedtls_ssl_conf_authmode(&pContext->conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
 	}
-	mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+	mbedtls_ssl_conf_rng(&pContext->conf, mbedtls_ctr_drbg_random, &ctr_drbg);
 
-	mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
-	if ((ret = mbedtls_ssl_conf_own_cert(&conf, &clicert, &pkey)) != 0) {
+	mbedtls_ssl_conf_ca_chain(&pContext->conf, &pContext->pCredentials->cacert, NULL);
+	if ((ret = mbedtls_ssl_conf_own_cert(&pContext->conf, &pContext->pCredentials->clicert,
+			&pContext->pCredentials->pkey)) != 0) {
 		ERROR(" failed\n  ! mbedtls_ssl_conf_own_cert returned %d\n\n", ret);
 		return ret;
 	}
 
-	mbedtls_ssl_conf_read_timeout(&conf, params.timeout_ms);
+	mbedtls_ssl_conf_read_timeout(&pContext->conf, params.timeout_ms);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	mbedtls_ssl_conf_session_tickets(&pContext->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
 
-	if ((ret = mbedtls_ssl_setup(&ssl, &conf)) != 0) {
+	if ((ret = mbedtls_ssl_setup(&pContext->ssl, &pContext->conf)) != 0) {
 		ERROR(" failed\n  ! mbedtls_ssl_setup returned -0x%x\n\n", -ret);
 		return ret;
 	}
-	if ((ret = mbedtls_ssl_set_hostname(&ssl, params.pDestinationURL)) != 0) {
+	if ((ret = mbedtls_ssl_set_hostname(&pContext->ssl, params.pDestinationURL)) != 0) {
 		ERROR(" failed\n  ! mbedtls_ssl_set_hostname returned %d\n\n", ret);
 		return ret;
 	}
-	mbedtls_ssl_set_bio(&ssl, &server_fd, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+	mbedtls_ssl_set_bio(&pContext->ssl, &pContext->server_fd, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+	pContext->pDestinationURL = params.pDestinationURL;
+	pContext->destinationPort = params.DestinationPort;
+	offerSession(pContext);
 	DEBUG(" ok\n");
 
 	DEBUG("  . Performing the SSL/TLS handshake...");
-	while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+	while ((ret = mbedtls_ssl_handshake(&pContext->ssl)) != 0) {
 		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
 			ERROR(" failed\n  ! mbedtls_ssl_handshake returned -0x%x\n", -ret);
 			if (ret == MBEDTLS_ERR_X509_CERT_VERIFY_FAILED) {
@@ -186,8 +488,10 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams params) {
 		}
 	}
 
-	DEBUG(" ok\n    [ Protocol is %s ]\n    [ Ciphersuite is %s ]\n", mbedtls_ssl_get_version(&ssl), mbedtls_ssl_get_ciphersuite(&ssl));
-	if ((ret = mbedtls_ssl_get_record_expansion(&ssl)) >= 0) {
+	countHandshake(pContext);
+
+	DEBUG(" ok\n    [ Protocol is %s ]\n    [ Ciphersuite is %s ]\n", mbedtls_ssl_get_version(&pContext->ssl), mbedtls_ssl_get_ciphersuite(&pContext->ssl));
+	if ((ret = mbedtls_ssl_get_record_expansion(&pContext->ssl)) >= 0) {
 		DEBUG("    [ Record expansion is %d ]\n", ret);
 	} else {
 		DEBUG("    [ Record expansion is unknown (compression) ]\n");
@@ -196,7 +500,7 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams params) {
 	DEBUG("  . Verifying peer X.509 certificate...");
 
 	if (params.ServerVerificationFlag == true) {
-		if ((flags = mbedtls_ssl_get_verify_result(&ssl)) != 0) {
+		if ((flags = mbedtls_ssl_get_verify_result(&pContext->ssl)) != 0) {
 			char vrfy_buf[512];
 			ERROR(" failed\n");
 			mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "  ! ", flags);
@@ -210,24 +514,30 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams params) {
 		ret = NONE_ERROR;
 	}
 
-	if (mbedtls_ssl_get_peer_cert(&ssl) != NULL) {
+	if (mbedtls_ssl_get_peer_cert(&pContext->ssl) != NULL) {
 		DEBUG("  . Peer certificate information    ...\n");
-		mbedtls_x509_crt_info((char *) buf, sizeof(buf) - 1, "      ", mbedtls_ssl_get_peer_cert(&ssl));
+		mbedtls_x509_crt_info((char *) buf, sizeof(buf) - 1, "      ", mbedtls_ssl_get_peer_cert(&pContext->ssl));
 		DEBUG("%s\n", buf);
 	}
 
-	mbedtls_ssl_conf_read_timeout(&conf, 10);
+	mbedtls_ssl_conf_read_timeout(&pContext->conf, 10);
 
 	return ret;
 }
 
 int iot_tls_write(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms) {
 
+	int ret;
 	int written;
 	int frags;
+	TLSContext_t *pContext = getTLSContext(pNetwork);
+
+	if (NULL == pContext) {
+		return NULL_VALUE_ERROR;
+	}
 
 	for (written = 0, frags = 0; written < len; written += ret, frags++) {
-		while ((ret = mbedtls_ssl_write(&ssl, pMsg + written, len - written)) <= 0) {
+		while ((ret = mbedtls_ssl_write(&pContext->ssl, pMsg + written, len - written)) <= 0) {
 			if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
 				ERROR(" failed\n  ! mbedtls_ssl_write returned -0x%x\n\n", -ret);
 				return ret;
@@ -237,15 +547,41 @@ int iot_tls_write(Network *pNetwork, unsigned char *pMsg, int len, int timeout_m
 	return written;
 }
 
+int iot_tls_writev(Network *pNetwork, NetworkIOVector *pVectors, int count, int timeout_ms) {
+
+	int i;
+	int written = 0;
+	int len;
+
+	// mbedtls_ssl_write takes one buffer, so the buffers are written one after the other without being joined
+	for (i = 0; i < count; i++) {
+		len = iot_tls_write(pNetwork, pVectors[i].pBuffer, pVectors[i].len, timeout_ms);
+		if (len < 0) {
+			return len;
+		}
+		written += len;
+		if (len < pVectors[i].len) {
+			break;
+		}
+	}
+	return written;
+}
+
 int iot_tls_read(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms) {
+	int ret;
 	int rxLen = 0;
 	bool isErrorFlag = false;
 	bool isCompleteFlag = false;
+	TLSContext_t *pContext = getTLSContext(pNetwork);
+
+	if (NULL == pContext) {
+		return NULL_VALUE_ERROR;
+	}
 
-//	mbedtls_ssl_conf_read_timeout(&conf, timeout_ms);
+//	mbedtls_ssl_conf_read_timeout(&pContext->conf, timeout_ms);
 
 	do {
-		ret = mbedtls_ssl_read(&ssl, pMsg, len);
+		ret = mbedtls_ssl_read(&pContext->ssl, pMsg, len);
 		if (ret > 0) {
 			rxLen += ret;
 		} else if (ret != MBEDTLS_ERR_SSL_WANT_READ) {
@@ -259,23 +595,69 @@ int iot_tls_read(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms
 	return ret;
 }
 
+int iot_tls_recv(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms) {
+	int ret;
+	int rxLen = 0;
+	TLSContext_t *pContext = getTLSContext(pNetwork);
+
+	if (NULL == pContext) {
+		return NULL_VALUE_ERROR;
+	}
+
+	// a read timeout of 0 would block forever
+	mbedtls_ssl_conf_read_timeout(&pContext->conf, (timeout_ms > 0) ? timeout_ms : 1);
+
+	do {
+		ret = mbedtls_ssl_read(&pContext->ssl, pMsg, len);
+	} while (ret == MBEDTLS_ERR_SSL_WANT_READ);
+
+	mbedtls_ssl_conf_read_timeout(&pContext->conf, 10);
+
+	if (ret == MBEDTLS_ERR_SSL_TIMEOUT) {
+		return 0;
+	} else if (ret <= 0) {
+		return SSL_READ_ERROR;
+	}
+	rxLen = ret;
+
+	// drain the rest of the current record without touching the socket
+	while (rxLen < len && mbedtls_ssl_get_bytes_avail(&pContext->ssl) > 0) {
+		ret = mbedtls_ssl_read(&pContext->ssl, pMsg + rxLen, len - rxLen);
+		if (ret <= 0) {
+			break;
+		}
+		rxLen += ret;
+	}
+
+	return rxLen;
+}
+
 void iot_tls_disconnect(Network *pNetwork) {
+	int ret;
+	TLSContext_t *pContext = getTLSContext(pNetwork);
+
+	if (NULL == pContext) {
+		return;
+	}
+
 	do {
-		ret = mbedtls_ssl_close_notify(&ssl);
+		ret = mbedtls_ssl_close_notify(&pContext->ssl);
 	} while (ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+	// a session closed cleanly can be resumed by the next connect
+	storeSession(pContext);
 }
 
 int iot_tls_destroy(Network *pNetwork) {
+	TLSContext_t *pContext = getTLSContext(pNetwork);
 
-	mbedtls_net_free(&server_fd);
+	if (NULL == pContext) {
+		return NULL_VALUE_ERROR;
+	}
 
-	mbedtls_x509_crt_free(&clicert);
-	mbedtls_x509_crt_free(&cacert);
-	mbedtls_pk_free(&pkey);
-	mbedtls_ssl_free(&ssl);
-	mbedtls_ssl_config_free(&conf);
-	mbedtls_ctr_drbg_free(&ctr_drbg);
-	mbedtls_entropy_free(&entropy);
+	freeTLSContext(pContext);
+	pNetwork->pTLSContext = NULL;
+	pNetwork->my_socket = 0;
 
 	return 0;
 }
@@ -22,54 +22,312 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include "aws_iot_error.h"
 #include "aws_iot_log.h"
 #include "network_interface.h"
+#include "timer_interface.h"
 #include "openssl_hostname_validation.h"
 
-static SSL_CTX *pSSLContext;
-static SSL *pSSLHandle;
-static int server_TCPSocket;
-static char* pDestinationURL;
+/**
+ * TLS state of one connection, pointed to by Network::pTLSContext
+ */
+typedef struct {
+	SSL *pSSLHandle;
+	int server_TCPSocket;
+	char *pDestinationURL;
+	int destinationPort;
+} TLSContext_t;
+
+/**
+ * Root CA, device certificate and private key parsed into one SSL_CTX, shared by every connection.
+ * Each SSL handle holds its own reference on the SSL_CTX, so replacing the cache never affects an open connection.
+ */
+typedef struct {
+	SSL_CTX *pSSLContext;
+	char *pRootCALocation;
+	char *pDeviceCertLocation;
+	char *pDevicePrivateKeyLocation;
+	SSL_SESSION *pSession;	// session of the last clean disconnect, offered to the same endpoint on the next connect
+	char *pSessionURL;
+	int sessionPort;
+} CredentialsCache_t;
+
+static pthread_once_t libraryInitOnce = PTHREAD_ONCE_INIT;
+static bool isLibraryInitialized = false;
+
+static CredentialsCache_t credentialsCache;
+static pthread_mutex_t credentialsCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static TLSHandshakeStats handshakeStats;
 
 static int Create_TCPSocket(void);
 static IoT_Error_t Connect_TCPSocket(int socket_fd, char *pURLString, int port);
 static IoT_Error_t setSocketToNonBlocking(int server_fd);
-static IoT_Error_t ConnectOrTimeoutOrExitOnError(SSL *pSSL, int timeout_ms);
-static IoT_Error_t ReadOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int totalLen, int timeout_ms);
+static IoT_Error_t ConnectOrTimeoutOrExitOnError(TLSContext_t *pContext, int timeout_ms);
+static IoT_Error_t WriteOrTimeoutOrExitOnError(TLSContext_t *pContext, unsigned char *msg, int totalLen, int timeout_ms);
+static IoT_Error_t ReadOrTimeoutOrExitOnError(TLSContext_t *pContext, unsigned char *msg, int totalLen, int timeout_ms);
+static int ReadAvailableOrTimeoutOrExitOnError(TLSContext_t *pContext, unsigned char *msg, int maxLen, int timeout_ms);
+
+enum{
+	POLL_READY = 1,
+	POLL_TIMEOUT = 0,
+	POLL_ERROR = -1
+};
+
+/**
+ * Waits until the socket is ready for the given poll events or the timer expires.
+ * Unlike select() this works for any descriptor number and costs the same for every socket.
+ */
+static int waitForSocket(int server_TCPSocket, short events, Timer *pTimer){
+	struct pollfd pollFd;
+	int rc;
 
-int iot_tls_init(Network *pNetwork) {
+	pollFd.fd = server_TCPSocket;
+	pollFd.events = events;
+	pollFd.revents = 0;
 
-	IoT_Error_t ret_val = NONE_ERROR;
-	const SSL_METHOD *method;
+	do{
+		rc = poll(&pollFd, 1, left_ms(pTimer));
+	}while(0 > rc && EINTR == errno);
 
+	if(0 > rc || 0 != (pollFd.revents & POLLNVAL)){
+		return POLL_ERROR;
+	}
+	// a hang up or socket error is reported by the next SSL call
+	return (0 == rc) ? POLL_TIMEOUT : POLL_READY;
+}
+
+static void initLibrary(void) {
 	OpenSSL_add_all_algorithms();
 	ERR_load_BIO_strings();
 	ERR_load_crypto_strings();
 	SSL_load_error_strings();
 
-	if (SSL_library_init() < 0) {
-		ret_val = SSL_INIT_ERROR;
+	isLibraryInitialized = (SSL_library_init() >= 0);
+}
+
+static void freeTLSContext(TLSContext_t *pContext) {
+	if (NULL != pContext->pSSLHandle) {
+		SSL_free(pContext->pSSLHandle);
 	}
+	free(pContext);
+}
+
+static bool isSameLocation(const char *pCached, const char *pLocation) {
+	if (NULL == pCached || NULL == pLocation) {
+		return pCached == pLocation;
+	}
+	return 0 == strcmp(pCached, pLocation);
+}
 
-	method = TLSv1_2_method();
+static char *copyLocation(const char *pLocation) {
+	return (NULL == pLocation) ? NULL : strdup(pLocation);
+}
+
+static IoT_Error_t loadCredentials(const char *pRootCALocation, const char *pDeviceCertLocation,
+		const char *pDevicePrivateKeyLocation, SSL_CTX **ppSSLContext) {
+	SSL_CTX *pSSLContext = SSL_CTX_new(TLSv1_2_method());
 
-	if ((pSSLContext = SSL_CTX_new(method)) == NULL) {
+	if (NULL == pSSLContext) {
 		ERROR(" SSL INIT Failed - Unable to create SSL Context");
+		return SSL_INIT_ERROR;
+	}
+
+	if (!SSL_CTX_load_verify_locations(pSSLContext, pRootCALocation, NULL)) {
+		ERROR(" Root CA Loading error");
+		SSL_CTX_free(pSSLContext);
+		return SSL_CERT_ERROR;
+	}
+
+	if (!SSL_CTX_use_certificate_file(pSSLContext, pDeviceCertLocation, SSL_FILETYPE_PEM)) {
+		ERROR(" Device Certificate Loading error");
+		SSL_CTX_free(pSSLContext);
+		return SSL_CERT_ERROR;
+	}
+
+	if (1 != SSL_CTX_use_PrivateKey_file(pSSLContext, pDevicePrivateKeyLocation, SSL_FILETYPE_PEM)) {
+		ERROR(" Device Private Key Loading error");
+		SSL_CTX_free(pSSLContext);
+		return SSL_CERT_ERROR;
+	}
+
+	*ppSSLContext = pSSLContext;
+	return NONE_ERROR;
+}
+
+// a session only resumes with the credentials it was negotiated with, the caller holds credentialsCacheMutex
+static void dropSession(void) {
+	if (NULL != credentialsCache.pSession) {
+		SSL_SESSION_free(credentialsCache.pSession);
+		credentialsCache.pSession = NULL;
+	}
+	free(credentialsCache.pSessionURL);
+	credentialsCache.pSessionURL = NULL;
+}
+
+static void storeSession(TLSContext_t *pContext) {
+	SSL_SESSION *pSession;
+
+	if (!SSL_is_init_finished(pContext->pSSLHandle)) {
+		return;
+	}
+
+	pthread_mutex_lock(&credentialsCacheMutex);
+	// a connection still using credentials that were reloaded since keeps its session to itself
+	if (SSL_get_SSL_CTX(pContext->pSSLHandle) == credentialsCache.pSSLContext) {
+		pSession = SSL_get1_session(pContext->pSSLHandle);
+		if (NULL != pSession) {
+			dropSession();
+			credentialsCache.pSession = pSession;
+			credentialsCache.pSessionURL = copyLocation(pContext->pDestinationURL);
+			credentialsCache.sessionPort = pContext->destinationPort;
+		}
+	}
+	pthread_mutex_unlock(&credentialsCacheMutex);
+}
+
+// replaces the cached credentials, the caller holds credentialsCacheMutex
+static void storeCredentials(SSL_CTX *pSSLContext, const char *pRootCALocation, const char *pDeviceCertLocation,
+		const char *pDevicePrivateKeyLocation) {
+	char *pRootCA = copyLocation(pRootCALocation);
+	char *pDeviceCert = copyLocation(pDeviceCertLocation);
+	char *pPrivateKey = copyLocation(pDevicePrivateKeyLocation);
+
+	dropSession();
+	if (NULL != credentialsCache.pSSLContext) {
+		SSL_CTX_free(credentialsCache.pSSLContext);
+	}
+	free(credentialsCache.pRootCALocation);
+	free(credentialsCache.pDeviceCertLocation);
+	free(credentialsCache.pDevicePrivateKeyLocation);
+
+	credentialsCache.pSSLContext = pSSLContext;
+	credentialsCache.pRootCALocation = pRootCA;
+	credentialsCache.pDeviceCertLocation = pDeviceCert;
+	credentialsCache.pDevicePrivateKeyLocation = pPrivateKey;
+}
+
+/**
+ * Creates the SSL handle of a connection from the cached credentials.
+ * The files are only read on the first connect, or when the connection asks for different files than the ones cached.
+ */
+static IoT_Error_t createSSLHandle(TLSConnectParams *pParams, SSL **ppSSLHandle) {
+	IoT_Error_t ret_val = NONE_ERROR;
+	SSL_CTX *pSSLContext;
+
+	pthread_mutex_lock(&credentialsCacheMutex);
+
+	if (NULL == credentialsCache.pSSLContext
+			|| !isSameLocation(credentialsCache.pRootCALocation, pParams->pRootCALocation)
+			|| !isSameLocation(credentialsCache.pDeviceCertLocation, pParams->pDeviceCertLocation)
+			|| !isSameLocation(credentialsCache.pDevicePrivateKeyLocation, pParams->pDevicePrivateKeyLocation)) {
+		ret_val = loadCredentials(pParams->pRootCALocation, pParams->pDeviceCertLocation,
+				pParams->pDevicePrivateKeyLocation, &pSSLContext);
+		if (NONE_ERROR == ret_val) {
+			storeCredentials(pSSLContext, pParams->pRootCALocation, pParams->pDeviceCertLocation,
+					pParams->pDevicePrivateKeyLocation);
+		}
+	}
+
+	if (NONE_ERROR == ret_val) {
+		*ppSSLHandle = SSL_new(credentialsCache.pSSLContext);
+		if (NULL == *ppSSLHandle) {
+			ERROR(" Unable to create the SSL handle");
+			ret_val = SSL_INIT_ERROR;
+		} else if (NULL != credentialsCache.pSession && pParams->DestinationPort == credentialsCache.sessionPort
+				&& isSameLocation(credentialsCache.pSessionURL, pParams->pDestinationURL)) {
+			// offer the stored session, the server falls back to a full handshake if it does not accept it
+			SSL_set_session(*ppSSLHandle, credentialsCache.pSession);
+		}
+	}
+
+	pthread_mutex_unlock(&credentialsCacheMutex);
+
+	return ret_val;
+}
+
+int iot_tls_reload_credentials(void) {
+	IoT_Error_t ret_val = NONE_ERROR;
+	SSL_CTX *pSSLContext;
+
+	pthread_mutex_lock(&credentialsCacheMutex);
+
+	// nothing cached yet, the next connect reads the files anyway
+	if (NULL != credentialsCache.pSSLContext) {
+		ret_val = loadCredentials(credentialsCache.pRootCALocation, credentialsCache.pDeviceCertLocation,
+				credentialsCache.pDevicePrivateKeyLocation, &pSSLContext);
+		// on error the previous credentials stay in use
+		if (NONE_ERROR == ret_val) {
+			dropSession();
+			SSL_CTX_free(credentialsCache.pSSLContext);
+			credentialsCache.pSSLContext = pSSLContext;
+		}
+	}
+
+	pthread_mutex_unlock(&credentialsCacheMutex);
+
+	return ret_val;
+}
+
+int iot_tls_get_handshake_stats(TLSHandshakeStats *pStats) {
+	if (NULL == pStats) {
+		return NULL_VALUE_ERROR;
+	}
+
+	pthread_mutex_lock(&credentialsCacheMutex);
+	*pStats = handshakeStats;
+	pthread_mutex_unlock(&credentialsCacheMutex);
+
+	return NONE_ERROR;
+}
+
+int iot_tls_init(Network *pNetwork) {
+
+	IoT_Error_t ret_val = NONE_ERROR;
+	TLSContext_t *pContext;
+
+	if (NULL == pNetwork) {
+		return NULL_VALUE_ERROR;
+	}
+
+	// the library is shared by every connection of the process, only its setup is global
+	pthread_once(&libraryInitOnce, initLibrary);
+	if (!isLibraryInitialized) {
 		ret_val = SSL_INIT_ERROR;
 	}
 
+	// a connect that failed half way leaves its context behind
+	if (NULL != pNetwork->pTLSContext) {
+		freeTLSContext((TLSContext_t *)pNetwork->pTLSContext);
+		pNetwork->pTLSContext = NULL;
+	}
+
+	pContext = (TLSContext_t *)calloc(1, sizeof(TLSContext_t));
+	if (NULL == pContext) {
+		ERROR(" SSL INIT Failed - Unable to allocate the TLS context");
+		return SSL_INIT_ERROR;
+	}
+	pContext->server_TCPSocket = -1;
+
+	pNetwork->pTLSContext = pContext;
 	pNetwork->my_socket = 0;
 	pNetwork->connect = iot_tls_connect;
 	pNetwork->mqttread = iot_tls_read;
+	pNetwork->mqttrecv = iot_tls_recv;
 	pNetwork->mqttwrite = iot_tls_write;
+	pNetwork->mqttwritev = iot_tls_writev;
 	pNetwork->disconnect = iot_tls_disconnect;
 	pNetwork->isConnected = iot_tls_is_connected;
+	pNetwork->getPollFd = iot_tls_get_poll_fd;
+	pNetwork->hasPending = iot_tls_has_pending;
 	pNetwork->destroy = iot_tls_destroy;
 
 	return ret_val;
@@ -80,6 +338,20 @@ int iot_tls_is_connected(Network *pNetwork) {
 	return 1;
 }
 
+int iot_tls_get_poll_fd(Network *pNetwork) {
+	/* my_socket holds the TCP socket while connected and 0 otherwise */
+	return (0 < pNetwork->my_socket) ? pNetwork->my_socket : -1;
+}
+
+int iot_tls_has_pending(Network *pNetwork) {
+	TLSContext_t *pContext = (TLSContext_t *)pNetwork->pTLSContext;
+
+	if(NULL == pContext || NULL == pContext->pSSLHandle){
+		return 0;
+	}
+	return (0 < SSL_pending(pContext->pSSLHandle)) ? 1 : 0;
+}
+
 int tls_server_certificate_verify(int preverify_ok, X509_STORE_CTX *pX509CTX){
 	// preverify_ok
 	// 0 ==> Fail
@@ -90,8 +362,10 @@ int tls_server_certificate_verify(int preverify_ok, X509_STORE_CTX *pX509CTX){
 	if((X509_STORE_CTX_get_error_depth(pX509CTX) == 0) && (preverify_ok == 1)){
 		X509 *pX509Cert;
 		HostnameValidationResult result;
+		SSL *pSSL = X509_STORE_CTX_get_ex_data(pX509CTX, SSL_get_ex_data_X509_STORE_CTX_idx());
+		TLSContext_t *pContext = (TLSContext_t *)SSL_get_app_data(pSSL);
 		pX509Cert = X509_STORE_CTX_get_current_cert(pX509CTX);
-		result = validate_hostname(pDestinationURL, pX509Cert);
+		result = validate_hostname(pContext->pDestinationURL, pX509Cert);
 		if(MatchFound == result){
 			verification_return = 1;
 		}
@@ -107,61 +381,74 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams params) {
 
 	IoT_Error_t ret_val = NONE_ERROR;
 	int connect_status = 0;
+	TLSContext_t *pContext;
 
-	server_TCPSocket = Create_TCPSocket();
-	if(-1 == server_TCPSocket){
-		ret_val = TCP_SETUP_ERROR;
-		return ret_val;
+	if(NULL == pNetwork || NULL == pNetwork->pTLSContext){
+		return NULL_VALUE_ERROR;
 	}
-
-	if (!SSL_CTX_load_verify_locations(pSSLContext, params.pRootCALocation, NULL)) {
-		ERROR(" Root CA Loading error");
-		ret_val = SSL_CERT_ERROR;
+	pContext = (TLSContext_t *)pNetwork->pTLSContext;
+	if(NULL != pContext->pSSLHandle){
+		SSL_free(pContext->pSSLHandle);
+		pContext->pSSLHandle = NULL;
 	}
 
-	if (!SSL_CTX_use_certificate_file(pSSLContext, params.pDeviceCertLocation, SSL_FILETYPE_PEM)) {
-		ERROR(" Device Certificate Loading error");
-		ret_val = SSL_CERT_ERROR;
+	ret_val = createSSLHandle(&params, &pContext->pSSLHandle);
+	if(NONE_ERROR != ret_val){
+		return ret_val;
 	}
 
-	if(1 != SSL_CTX_use_PrivateKey_file(pSSLContext, params.pDevicePrivateKeyLocation, SSL_FILETYPE_PEM)){
-		ERROR(" Device Private Key Loading error");
-		ret_val = SSL_CERT_ERROR;
+	pContext->server_TCPSocket = Create_TCPSocket();
+	if(-1 == pContext->server_TCPSocket){
+		ret_val = TCP_SETUP_ERROR;
+		return ret_val;
 	}
+	pNetwork->my_socket = pContext->server_TCPSocket;
+
+	// the SSL_CTX is shared, so the verification mode is set on the handle of this connection
 	if(params.ServerVerificationFlag){
-		SSL_CTX_set_verify(pSSLContext, SSL_VERIFY_PEER, tls_server_certificate_verify);
+		SSL_set_verify(pContext->pSSLHandle, SSL_VERIFY_PEER, tls_server_certificate_verify);
 	}
 	else{
-		SSL_CTX_set_verify(pSSLContext, SSL_VERIFY_PEER, NULL);
+		SSL_set_verify(pContext->pSSLHandle, SSL_VERIFY_PEER, NULL);
 	}
+	SSL_set_app_data(pContext->pSSLHandle, pContext);
 
-	pSSLHandle = SSL_new(pSSLContext);
-
-	pDestinationURL = params.pDestinationURL;
-	ret_val = Connect_TCPSocket(server_TCPSocket, params.pDestinationURL, params.DestinationPort);
+	pContext->pDestinationURL = params.pDestinationURL;
+	pContext->destinationPort = params.DestinationPort;
+	ret_val = Connect_TCPSocket(pContext->server_TCPSocket, params.pDestinationURL, params.DestinationPort);
 	if(NONE_ERROR != ret_val){
 		ERROR(" TCP Connection error");
 		return ret_val;
 	}
 
-	SSL_set_fd(pSSLHandle, server_TCPSocket);
+	SSL_set_fd(pContext->pSSLHandle, pContext->server_TCPSocket);
 
 	if(ret_val == NONE_ERROR){
-		ret_val = setSocketToNonBlocking(server_TCPSocket);
+		ret_val = setSocketToNonBlocking(pContext->server_TCPSocket);
 		if(ret_val != NONE_ERROR){
 			ERROR(" Unable to set the socket to Non-Blocking");
 		}
 	}
 
 	if(NONE_ERROR == ret_val){
-		ret_val = ConnectOrTimeoutOrExitOnError(pSSLHandle, params.timeout_ms);
-		if(X509_V_OK != SSL_get_verify_result(pSSLHandle)){
+		ret_val = ConnectOrTimeoutOrExitOnError(pContext, params.timeout_ms);
+		if(NONE_ERROR == ret_val){
+			pthread_mutex_lock(&credentialsCacheMutex);
+			if(SSL_session_reused(pContext->pSSLHandle)){
+				handshakeStats.resumedHandshakes++;
+			}
+			else{
+				handshakeStats.fullHandshakes++;
+			}
+			pthread_mutex_unlock(&credentialsCacheMutex);
+		}
+		if(X509_V_OK != SSL_get_verify_result(pContext->pSSLHandle)){
 			ERROR(" Server Certificate Verification failed");
 			ret_val = SSL_CONNECT_ERROR;
 		}
 		else{
 			// ensure you have a valid certificate returned, otherwise no certificate exchange happened
-			if(NULL == SSL_get_peer_certificate(pSSLHandle)){
+			if(NULL == SSL_get_peer_certificate(pContext->pSSLHandle)){
 				ERROR(" No certificate exchange happened");
 				ret_val = SSL_CONNECT_ERROR;
 			}
@@ -170,23 +457,99 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams params) {
 	return ret_val;
 }
 
+static TLSContext_t *getConnectedContext(Network *pNetwork){
+	if(NULL == pNetwork || NULL == pNetwork->pTLSContext || NULL == ((TLSContext_t *)pNetwork->pTLSContext)->pSSLHandle){
+		return NULL;
+	}
+	return (TLSContext_t *)pNetwork->pTLSContext;
+}
+
 int iot_tls_write(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms){
+	TLSContext_t *pContext = getConnectedContext(pNetwork);
+
+	if(NULL == pContext){
+		return NULL_VALUE_ERROR;
+	}
 
-	return WriteOrTimeoutOrExitOnError(pSSLHandle, pMsg, len, timeout_ms);
+	return WriteOrTimeoutOrExitOnError(pContext, pMsg, len, timeout_ms);
+}
+
+int iot_tls_writev(Network *pNetwork, NetworkIOVector *pVectors, int count, int timeout_ms){
+	int i;
+	int rc;
+	int writtenLength = 0;
+	TLSContext_t *pContext = getConnectedContext(pNetwork);
+
+	if(NULL == pContext){
+		return NULL_VALUE_ERROR;
+	}
+
+	// SSL has no gather write, each buffer goes straight from the caller's memory in turn
+	for(i = 0; i < count; i++){
+		if(0 == pVectors[i].len){
+			continue;
+		}
+		rc = WriteOrTimeoutOrExitOnError(pContext, pVectors[i].pBuffer, pVectors[i].len, timeout_ms);
+		if(0 > rc){
+			return rc;
+		}
+		writtenLength += rc;
+		if(rc < pVectors[i].len){
+			break;
+		}
+	}
+
+	return writtenLength;
 }
 
 int iot_tls_read(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms) {
-	return ReadOrTimeoutOrExitOnError(pSSLHandle, pMsg, len, timeout_ms);
+	TLSContext_t *pContext = getConnectedContext(pNetwork);
+
+	if(NULL == pContext){
+		return NULL_VALUE_ERROR;
+	}
+
+	return ReadOrTimeoutOrExitOnError(pContext, pMsg, len, timeout_ms);
+}
+
+int iot_tls_recv(Network *pNetwork, unsigned char *pMsg, int len, int timeout_ms) {
+	TLSContext_t *pContext = getConnectedContext(pNetwork);
+
+	if(NULL == pContext){
+		return NULL_VALUE_ERROR;
+	}
+
+	return ReadAvailableOrTimeoutOrExitOnError(pContext, pMsg, len, timeout_ms);
 }
 
 void iot_tls_disconnect(Network *pNetwork){
-	SSL_shutdown(pSSLHandle);
-	close(server_TCPSocket);
+	TLSContext_t *pContext;
+
+	if(NULL == pNetwork || NULL == pNetwork->pTLSContext){
+		return;
+	}
+	pContext = (TLSContext_t *)pNetwork->pTLSContext;
+
+	if(NULL != pContext->pSSLHandle){
+		SSL_shutdown(pContext->pSSLHandle);
+		// a session closed cleanly can be resumed by the next connect
+		storeSession(pContext);
+	}
+	if(-1 != pContext->server_TCPSocket){
+		close(pContext->server_TCPSocket);
+		pContext->server_TCPSocket = -1;
+	}
+	// the closed descriptor number may be handed out again, never poll it
+	pNetwork->my_socket = 0;
 }
 
 int iot_tls_destroy(Network *pNetwork) {
-	SSL_free(pSSLHandle);
-	SSL_CTX_free(pSSLContext);
+	if(NULL == pNetwork || NULL == pNetwork->pTLSContext){
+		return NULL_VALUE_ERROR;
+	}
+
+	freeTLSContext((TLSContext_t *)pNetwork->pTLSContext);
+	pNetwork->pTLSContext = NULL;
 	return 0;
 }
 
@@ -219,18 +582,18 @@ IoT_Error_t Connect_TCPSocket(int socket_fd, char *pURLString, int port) {
 	return ret_val;
 }
 
-IoT_Error_t setSocketToNonBlocking( server_fd) {
+IoT_Error_t setSocketToNonBlocking(int server_fd) {
 
 	int flags, status;
 	IoT_Error_t ret_val = NONE_ERROR;
 
-	flags = fcntl(server_TCPSocket, F_GETFL, 0);
+	flags = fcntl(server_fd, F_GETFL, 0);
 	// set underlying socket to non blocking
 	if (flags < 0) {
 		ret_val = TCP_CONNECT_ERROR;
 	}
 
-	status = fcntl(server_TCPSocket, F_SETFL, flags | O_NONBLOCK);
+	status = fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
 	if (status < 0) {
 		ERROR("fcntl - %s", strerror(errno));
 		ret_val = TCP_CONNECT_ERROR;
@@ -239,21 +602,22 @@ IoT_Error_t setSocketToNonBlocking( server_fd) {
 	return ret_val;
 }
 
-IoT_Error_t ConnectOrTimeoutOrExitOnError(SSL *pSSL, int timeout_ms){
+IoT_Error_t ConnectOrTimeoutOrExitOnError(TLSContext_t *pContext, int timeout_ms){
+	SSL *pSSL = pContext->pSSLHandle;
+	int server_TCPSocket = pContext->server_TCPSocket;
 
 	enum{
-		SSL_CONNECTED = 1,
-		SELECT_TIMEOUT = 0,
-		SELECT_ERROR = -1
+		SSL_CONNECTED = 1
 	};
 
 	IoT_Error_t ret_val = NONE_ERROR;
 	int rc = 0;
-	fd_set readFds;
-	fd_set writeFds;
-	struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	Timer timer;
 	int errorCode = 0;
-	int select_retCode = SELECT_TIMEOUT;
+	int poll_retCode = POLL_TIMEOUT;
+
+	InitTimer(&timer);
+	countdown_ms(&timer, timeout_ms);
 
 	do{
 		rc = SSL_connect(pSSL);
@@ -266,27 +630,23 @@ IoT_Error_t ConnectOrTimeoutOrExitOnError(SSL *pSSL, int timeout_ms){
 		errorCode = SSL_get_error(pSSL, rc);
 
 		if(errorCode == SSL_ERROR_WANT_READ){
-			FD_ZERO(&readFds);
-			FD_SET(server_TCPSocket, &readFds);
-			select_retCode = select(server_TCPSocket + 1, (void *) &readFds, NULL, NULL, &timeout);
-			if (SELECT_TIMEOUT == select_retCode) {
+			poll_retCode = waitForSocket(server_TCPSocket, POLLIN, &timer);
+			if (POLL_TIMEOUT == poll_retCode) {
 				ERROR(" SSL Connect time out while waiting for read");
 				ret_val = SSL_CONNECT_TIMEOUT_ERROR;
-			} else if (SELECT_ERROR == select_retCode) {
-				ERROR(" SSL Connect Select error for read %d", select_retCode);
+			} else if (POLL_ERROR == poll_retCode) {
+				ERROR(" SSL Connect Poll error for read %d", poll_retCode);
 				ret_val = SSL_CONNECT_ERROR;
 			}
 		}
 
 		else if(errorCode == SSL_ERROR_WANT_WRITE){
-			FD_ZERO(&writeFds);
-			FD_SET(server_TCPSocket, &writeFds);
-			select_retCode = select(server_TCPSocket + 1, NULL, (void *) &writeFds, NULL, &timeout);
-			if (SELECT_TIMEOUT == select_retCode) {
+			poll_retCode = waitForSocket(server_TCPSocket, POLLOUT, &timer);
+			if (POLL_TIMEOUT == poll_retCode) {
 				ERROR(" SSL Connect time out while waiting for write");
 				ret_val = SSL_CONNECT_TIMEOUT_ERROR;
-			} else if (SELECT_ERROR == select_retCode) {
-				ERROR(" SSL Connect Select error for write %d", select_retCode);
+			} else if (POLL_ERROR == poll_retCode) {
+				ERROR(" SSL Connect Poll error for write %d", poll_retCode);
 				ret_val = SSL_CONNECT_ERROR;
 			}
 		}
@@ -300,22 +660,22 @@ IoT_Error_t ConnectOrTimeoutOrExitOnError(SSL *pSSL, int timeout_ms){
 	return ret_val;
 }
 
-IoT_Error_t WriteOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int totalLen, int timeout_ms){
+IoT_Error_t WriteOrTimeoutOrExitOnError(TLSContext_t *pContext, unsigned char *msg, int totalLen, int timeout_ms){
+	SSL *pSSL = pContext->pSSLHandle;
+	int server_TCPSocket = pContext->server_TCPSocket;
 
 
 	IoT_Error_t errorStatus = NONE_ERROR;
 
-	fd_set writeFds;
-	enum{
-		SELECT_TIMEOUT = 0,
-		SELECT_ERROR = -1
-	};
+	Timer timer;
 	int errorCode = 0;
-	int select_retCode;
+	int poll_retCode;
 	int writtenLength = 0;
 	int rc = 0;
 	int returnCode = 0;
-	struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+	InitTimer(&timer);
+	countdown_ms(&timer, timeout_ms);
 
 	do{
 		rc = SSL_write(pSSL, msg, totalLen);
@@ -327,12 +687,10 @@ IoT_Error_t WriteOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int total
 		}
 
 		else if (errorCode == SSL_ERROR_WANT_WRITE) {
-			FD_ZERO(&writeFds);
-			FD_SET(server_TCPSocket, &writeFds);
-			select_retCode = select(server_TCPSocket + 1, NULL, (void *) &writeFds, NULL, &timeout);
-			if (SELECT_TIMEOUT == select_retCode) {
+			poll_retCode = waitForSocket(server_TCPSocket, POLLOUT, &timer);
+			if (POLL_TIMEOUT == poll_retCode) {
 				errorStatus = SSL_WRITE_TIMEOUT_ERROR;
-			} else if (SELECT_ERROR == select_retCode) {
+			} else if (POLL_ERROR == poll_retCode) {
 				errorStatus = SSL_WRITE_ERROR;
 			}
 		}
@@ -353,25 +711,25 @@ IoT_Error_t WriteOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int total
 	return returnCode;
 }
 
-IoT_Error_t ReadOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int totalLen, int timeout_ms){
+IoT_Error_t ReadOrTimeoutOrExitOnError(TLSContext_t *pContext, unsigned char *msg, int totalLen, int timeout_ms){
+	SSL *pSSL = pContext->pSSLHandle;
+	int server_TCPSocket = pContext->server_TCPSocket;
 
 
 	IoT_Error_t errorStatus = NONE_ERROR;
 
-	fd_set readFds;
-	enum{
-		SELECT_TIMEOUT = 0,
-		SELECT_ERROR = -1
-	};
+	Timer timer;
 	int errorCode = 0;
-	int select_retCode;
+	int poll_retCode;
 	int readLength = 0;
 	int rc = 0;
 	int returnCode = 0;
-	struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+	InitTimer(&timer);
+	countdown_ms(&timer, timeout_ms);
 
 	do{
-		rc = SSL_read(pSSL, msg, totalLen);
+		rc = SSL_read(pSSL, msg + readLength, totalLen - readLength);
 		errorCode = SSL_get_error(pSSL, rc);
 
 		if(0 < rc){
@@ -379,12 +737,10 @@ IoT_Error_t ReadOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int totalL
 		}
 
 		else if (errorCode == SSL_ERROR_WANT_READ) {
-			FD_ZERO(&readFds);
-			FD_SET(server_TCPSocket, &readFds);
-			select_retCode = select(server_TCPSocket + 1, (void *) &readFds, NULL, NULL, &timeout);
-			if (SELECT_TIMEOUT == select_retCode) {
+			poll_retCode = waitForSocket(server_TCPSocket, POLLIN, &timer);
+			if (POLL_TIMEOUT == poll_retCode) {
 				errorStatus = SSL_READ_TIMEOUT_ERROR;
-			} else if (SELECT_ERROR == select_retCode) {
+			} else if (POLL_ERROR == poll_retCode) {
 				errorStatus = SSL_READ_ERROR;
 			}
 		}
@@ -404,3 +760,51 @@ IoT_Error_t ReadOrTimeoutOrExitOnError(SSL *pSSL, unsigned char *msg, int totalL
 
 	return returnCode;
 }
+
+int ReadAvailableOrTimeoutOrExitOnError(TLSContext_t *pContext, unsigned char *msg, int maxLen, int timeout_ms){
+	SSL *pSSL = pContext->pSSLHandle;
+	int server_TCPSocket = pContext->server_TCPSocket;
+
+	Timer timer;
+	int errorCode = 0;
+	int poll_retCode;
+	int readLength = 0;
+	int rc = 0;
+
+	InitTimer(&timer);
+	countdown_ms(&timer, timeout_ms);
+
+	do{
+		rc = SSL_read(pSSL, msg, maxLen);
+		errorCode = SSL_get_error(pSSL, rc);
+
+		if(0 < rc){
+			readLength = rc;
+		}
+
+		else if (errorCode == SSL_ERROR_WANT_READ) {
+			poll_retCode = waitForSocket(server_TCPSocket, POLLIN, &timer);
+			if (POLL_TIMEOUT == poll_retCode) {
+				return 0;
+			} else if (POLL_ERROR == poll_retCode) {
+				return SSL_READ_ERROR;
+			}
+		}
+
+		else{
+			return SSL_READ_ERROR;
+		}
+
+	}while(0 == readLength);
+
+	// drain whatever is left of already decrypted records without touching the socket
+	while(readLength < maxLen && 0 < SSL_pending(pSSL)){
+		rc = SSL_read(pSSL, msg + readLength, maxLen - readLength);
+		if(0 >= rc){
+			break;
+		}
+		readLength += rc;
+	}
+
+	return readLength;
+}
@@ -23,9 +23,14 @@
 
 struct TlsContext {
     Ssock_Handle ssock;
-    TLS_Handle tlsH;
 };
 
+/* TLS context shared by every connection, created on the first connect */
+static TLS_Handle cachedTlsH = NULL;
+
+/* The SimpleLink TLS engine does not expose session resumption */
+static TLSHandshakeStats handshakeStats = {0, 0};
+
 extern uint32_t NetWiFi_isConnected(void);
 
 int iot_tls_init(Network *pNetwork)
@@ -37,9 +42,14 @@ int iot_tls_init(Network *pNetwork)
     pNetwork->my_socket = 0;
     pNetwork->connect = iot_tls_connect;
     pNetwork->mqttread = iot_tls_read;
+    pNetwork->mqttrecv = iot_tls_recv;
     pNetwork->mqttwrite = iot_tls_write;
+    pNetwork->mqttwritev = iot_tls_writev;
     pNetwork->disconnect = iot_tls_disconnect;
     pNetwork->isConnected = iot_tls_is_connected;
+    pNetwork->getPollFd = iot_tls_get_poll_fd;
+    /* Ssock offers no count of the record bytes it still buffers */
+    pNetwork->hasPending = NULL;
     pNetwork->destroy = iot_tls_destroy;
 
     return (NONE_ERROR);
@@ -68,11 +78,13 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams TLSParams)
      *  the "/cert" directory and be named "ca.der", "cert.der" and "key.der".
      *  The ability to change this will be added in a future release.
      */
-    tlsContext->tlsH = TLS_create(TLS_METHOD_CLIENT_TLSV1_2, NULL,
-            IOT_TLS_CERT_PATH);
-    if (tlsContext->tlsH == NULL) {
-        ret = SSL_INIT_ERROR;
-        goto QUIT;
+    if (cachedTlsH == NULL) {
+        cachedTlsH = TLS_create(TLS_METHOD_CLIENT_TLSV1_2, NULL,
+                IOT_TLS_CERT_PATH);
+        if (cachedTlsH == NULL) {
+            ret = SSL_INIT_ERROR;
+            goto QUIT;
+        }
     }
 
     if (gethostbyname((signed char *)TLSParams.pDestinationURL,
@@ -93,7 +105,7 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams TLSParams)
         goto QUIT;
     }
 
-    if (Ssock_startTLS(tlsContext->ssock, tlsContext->tlsH) != 0) {
+    if (Ssock_startTLS(tlsContext->ssock, cachedTlsH) != 0) {
         ret = SSL_CERT_ERROR;
         goto QUIT;
     }
@@ -109,6 +121,7 @@ int iot_tls_connect(Network *pNetwork, TLSConnectParams TLSParams)
 
     /* Use pNetwork to store both the socket and TLS context */
     pNetwork->my_socket = (int)tlsContext;
+    handshakeStats.fullHandshakes++;
 
 QUIT:
 
@@ -117,10 +130,6 @@ QUIT:
             Ssock_delete(&tlsContext->ssock);
         }
 
-        if (tlsContext->tlsH) {
-            TLS_delete((TLS_Handle *)&tlsContext->tlsH);
-        }
-
         if (skt >= 0) {
             close(skt);
         }
@@ -136,6 +145,17 @@ int iot_tls_is_connected(Network *pNetwork)
     return ((int)NetWiFi_isConnected());
 }
 
+int iot_tls_get_poll_fd(Network *pNetwork)
+{
+    /* my_socket holds the TlsContext here, the SimpleLink socket is behind its Ssock */
+    if (pNetwork == NULL || pNetwork->my_socket == 0 ||
+            ((struct TlsContext *)pNetwork->my_socket)->ssock == 0) {
+        return (-1);
+    }
+
+    return (Ssock_getSocket(((struct TlsContext *)pNetwork->my_socket)->ssock));
+}
+
 int iot_tls_write(Network *pNetwork, unsigned char *pMsg, int len,
             int timeout_ms)
 {
@@ -157,6 +177,35 @@ int iot_tls_write(Network *pNetwork, unsigned char *pMsg, int len,
     return (SSL_WRITE_ERROR);
 }
 
+int iot_tls_writev(Network *pNetwork, NetworkIOVector *pVectors, int count,
+            int timeout_ms)
+{
+    int i;
+    int bytes = 0;
+    int written = 0;
+
+    if (pVectors == NULL) {
+        return (NULL_VALUE_ERROR);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pVectors[i].len == 0) {
+            continue;
+        }
+        bytes = iot_tls_write(pNetwork, pVectors[i].pBuffer, pVectors[i].len,
+                timeout_ms);
+        if (bytes < 0) {
+            return (bytes);
+        }
+        written += bytes;
+        if (bytes < pVectors[i].len) {
+            break;
+        }
+    }
+
+    return (written);
+}
+
 int iot_tls_read(Network *pNetwork, unsigned char *pMsg, int len,
         int timeout_ms)
 {
@@ -189,6 +238,39 @@ int iot_tls_read(Network *pNetwork, unsigned char *pMsg, int len,
     return (SSL_READ_ERROR);
 }
 
+int iot_tls_recv(Network *pNetwork, unsigned char *pMsg, int len,
+        int timeout_ms)
+{
+    int bytes = 0;
+    int skt;
+    struct timeval tv;
+    Ssock_Handle ssock = NULL;
+
+    if (pNetwork == NULL || pMsg == NULL || pNetwork->my_socket == 0 ||
+            ((struct TlsContext *)pNetwork->my_socket)->ssock == 0 ||
+            timeout_ms == 0) {
+        return (NULL_VALUE_ERROR);
+    }
+
+    ssock = ((struct TlsContext *)pNetwork->my_socket)->ssock;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    skt = Ssock_getSocket(ssock);
+
+    if (setsockopt(skt, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,
+            sizeof(struct timeval)) == 0) {
+        /* Unlike Ssock_recvall, return with whatever the first record held */
+        bytes = Ssock_recv(ssock, pMsg, len, 0);
+        if (bytes >= 0) {
+            return (bytes);
+        }
+    }
+
+    return (SSL_READ_ERROR);
+}
+
 void iot_tls_disconnect(Network *pNetwork)
 {
     int skt;
@@ -199,7 +281,6 @@ void iot_tls_disconnect(Network *pNetwork)
         return;
     }
 
-    TLS_delete((TLS_Handle *)&((struct TlsContext *)pNetwork->my_socket)->tlsH);
     ssock = ((struct TlsContext *)pNetwork->my_socket)->ssock;
     skt = Ssock_getSocket(ssock);
     Ssock_delete(&ssock);
@@ -207,6 +288,30 @@ void iot_tls_disconnect(Network *pNetwork)
     free((void *)pNetwork->my_socket);
 }
 
+int iot_tls_reload_credentials(void)
+{
+    /*
+     *  The TLS context only names the cert files, the next connect creates
+     *  it again.  Open connections already had the files applied.
+     */
+    if (cachedTlsH != NULL) {
+        TLS_delete(&cachedTlsH);
+    }
+
+    return (NONE_ERROR);
+}
+
+int iot_tls_get_handshake_stats(TLSHandshakeStats *pStats)
+{
+    if (pStats == NULL) {
+        return (NULL_VALUE_ERROR);
+    }
+
+    *pStats = handshakeStats;
+
+    return (NONE_ERROR);
+}
+
 int iot_tls_destroy(Network *pNetwork)
 {
     if (pNetwork == NULL) {
@@ -215,7 +320,10 @@ int iot_tls_destroy(Network *pNetwork)
 
     pNetwork->my_socket = 0;
     pNetwork->mqttread = NULL;
+    pNetwork->mqttrecv = NULL;
     pNetwork->mqttwrite = NULL;
+    pNetwork->mqttwritev = NULL;
+    pNetwork->getPollFd = NULL;
     pNetwork->disconnect = NULL;
 
     return (NONE_ERROR);
@@ -16,55 +16,42 @@
 
 #include "timer_interface.h"
 
-static uint32_t getTimeInMillis(void)
+/* Timers count Clock ticks, which never jump. The deadline is compared through a signed
+ * difference, so the tick counter wrapping around does not matter as long as no timer is
+ * left unchecked for more than half its range */
+static uint32_t ticksFromMillis(uint32_t timeout)
 {
-    return ((Clock_getTicks() * Clock_tickPeriod) / 1000);
+    return (uint32_t)(((uint64_t)timeout * 1000) / Clock_tickPeriod);
+}
+
+static int32_t ticksLeft(Timer *timer)
+{
+    return (int32_t)(timer->end_time - Clock_getTicks());
 }
 
 char expired(Timer *timer)
 {
-    return ((timer->end_time > 0)
-             && ((getTimeInMillis() + timer->offset) > timer->end_time));
+    return (ticksLeft(timer) <= 0);
 }
 
 void countdown_ms(Timer *timer, unsigned int timeout)
 {
-    uint32_t timems = getTimeInMillis();
-
-    timer->end_time = timems + timeout;
-
-    if (timer->end_time < timems) {
-        timer->offset = ~0 - timems + 1;
-        timer->end_time += timer->offset;
-    }
-    else {
-        timer->offset = 0;
-    }
+    timer->end_time = Clock_getTicks() + ticksFromMillis(timeout);
 }
 
 void countdown(Timer *timer, unsigned int timeout)
 {
-    uint32_t timems = getTimeInMillis();
-
-    timer->end_time = timems + (timeout * 1000);
-
-    if (timer->end_time < timems) {
-        timer->offset = ~0 - timems + 1;
-        timer->end_time += timer->offset;
-    }
-    else {
-        timer->offset = 0;
-    }
+    timer->end_time = Clock_getTicks() + ticksFromMillis(timeout * 1000);
 }
 
 int left_ms(Timer *timer)
 {
-    int diff = timer->end_time - (getTimeInMillis() + timer->offset);
-    return (diff > 0 ? diff : 0);
+    int32_t left = ticksLeft(timer);
+    return (left > 0 ? (int)(((uint64_t)left * Clock_tickPeriod) / 1000) : 0);
 }
 
 void InitTimer(Timer *timer)
 {
-    timer->end_time = 0;
-    timer->offset = 0;
+    /* expired right away, as on the other platforms */
+    timer->end_time = Clock_getTicks();
 }
@@ -19,8 +19,7 @@
 #include <stdint.h>
 
 struct Timer {
-    uint32_t end_time;
-    uint32_t offset;
+    uint32_t end_time;  /* Clock tick the timer runs out at */
 };
 
 #endif
@@ -26,6 +26,14 @@
 #include "stdint.h"
 #include "aws_iot_error.h"
 
+/**
+ * @brief MQTT Client Type
+ *
+ * Forward declaration of the client handle every MQTT call operates on.  See MQTTClient_s.
+ *
+ */
+typedef struct MQTTClient_s MQTTClient_t;
+
 /**
  * @brief MQTT Version Type
  *
@@ -42,12 +50,13 @@ typedef enum {
  *
  * Defining a QoS type.
  * @note QoS 2 is \b NOT supported by the AWS IoT Service at the time of this SDK release.
+ * The client implements it for brokers that do.
  *
  */
 typedef enum {
 	QOS_0,	///< QoS 0 = at most once delivery
 	QOS_1,	///< QoS 1 = at least once delivery
-	QOS_2	///< QoS 2 is NOT supported
+	QOS_2	///< QoS 2 = exactly once delivery, NOT supported by the AWS IoT Service
 } QoSLevel;
 
 /**
@@ -71,7 +80,7 @@ extern const MQTTwillOptions MQTTwillOptionsDefault;
  * Defining a TYPE for definition of disconnect callback function pointers.
  *
  */
-typedef void (*iot_disconnect_handler)(void);
+typedef void (*iot_disconnect_handler)(MQTTClient_t *pClient);
 
 /**
  * @brief MQTT Connection Parameters
@@ -114,6 +123,7 @@ typedef struct {
 	uint16_t id;			///< Message sequence identifier.  Handled automatically by the MQTT client.
 	void *pPayload;			///< Pointer to MQTT message payload (bytes).
 	uint32_t PayloadLen;	///< Length of MQTT payload.
+	uint8_t priority;		///< Priority of the message while it waits for a reconnect, see aws_iot_mqtt_set_offline_drop_policy.
 } MQTTMessageParams;
 extern const MQTTMessageParams MQTTMessageParamsDefault;
 /**
@@ -125,7 +135,10 @@ extern const MQTTMessageParams MQTTMessageParamsDefault;
 typedef struct {
 	char *pTopicName;					///< Pointer to the topic string on which the message was delivered.  In the case of a wildcard subscription this is the actual topic, not the wildcard filter.
 	uint16_t TopicNameLen;				///< Length of the topic string.
+	MQTTClient_t *pClient;				///< Client the message was received on.
 	MQTTMessageParams MessageParams;	///< Message parameters structure.
+	uint32_t TotalPayloadLen;			///< Length of the whole payload.  Larger than MessageParams.PayloadLen when a streamed payload is delivered in chunks.
+	uint32_t PayloadOffset;				///< Offset of MessageParams.pPayload within the whole payload.
 } MQTTCallbackParams;
 extern const MQTTCallbackParams MQTTCallbackParamsDefault;
 
@@ -149,6 +162,7 @@ typedef struct {
 	char *pTopic;					///< Pointer to the string defining the desired subscription topic.
 	QoSLevel qos;					///< Quality of service of the subscription.
 	iot_message_handler mHandler;	///< Callback to be invoked upon receipt of a message on the subscribed topic.
+	bool isStreamingEnabled;		///< Deliver payloads larger than the receive buffer in chunks instead of dropping them.  See MQTTCallbackParams::PayloadOffset.
 } MQTTSubscribeParams;
 extern const MQTTSubscribeParams MQTTSubscribeParamsDefault;
 
@@ -164,15 +178,29 @@ typedef struct {
 } MQTTPublishParams;
 extern const MQTTPublishParams MQTTPublishParamsDefault;
 
+/**
+ * @brief MQTT Publish Completion Callback Function
+ *
+ * Defines a type for the function pointer which is invoked once an asynchronous publish has completed.
+ * For QoS 1 this is upon receipt of the matching PUBACK, for QoS 2 upon receipt of the PUBCOMP,
+ * or when all retransmissions went unacknowledged.
+ *
+ * @param id		Packet identifier of the completed publish (0 for QoS 0)
+ * @param status	NONE_ERROR if the message was acknowledged, PUBLISH_ERROR otherwise
+ * @param pContext	The context pointer supplied with the publish
+ */
+typedef void (*iot_publish_complete_handler)(uint16_t id, IoT_Error_t status, void *pContext);
+
 /**
  * @brief MQTT Connection Function
  *
  * Called to establish an MQTT connection with the AWS IoT Service
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @param pParams	Pointer to MQTT connection parameters
  * @return An IoT Error Type defining successful/failed connection
  */
-IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams);
+IoT_Error_t aws_iot_mqtt_connect(MQTTClient_t *pClient, MQTTConnectParams *pParams);
 
 /**
  * @brief Publish an MQTT message on a topic
@@ -180,12 +208,34 @@ IoT_Error_t aws_iot_mqtt_connect(MQTTConnectParams *pParams);
  * Called to publish an MQTT message on a topic.
  * @note Call is blocking.  In the case of a QoS 0 message the function returns
  * after the message was successfully passed to the TLS layer.  In the case of QoS 1
- * the function returns after the receipt of the PUBACK control packet.
+ * the function returns after the receipt of the PUBACK control packet, for QoS 2 after the PUBCOMP.
+ * While auto-reconnect is bringing a lost connection back, up to AWS_IOT_MQTT_OFFLINE_QUEUE_LEN
+ * messages are copied and sent in order after the reconnect.  PUBLISH_STORED_OFFLINE is returned for them,
+ * and for a message published while earlier kept ones are still being sent.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @param pParams	Pointer to MQTT publish parameters
  * @return An IoT Error Type defining successful/failed publish
  */
-IoT_Error_t aws_iot_mqtt_publish(MQTTPublishParams *pParams);
+IoT_Error_t aws_iot_mqtt_publish(MQTTClient_t *pClient, MQTTPublishParams *pParams);
+
+/**
+ * @brief Publish an MQTT message on a topic without waiting for the acknowledgment
+ *
+ * Called to publish an MQTT message on a topic.  Up to AWS_IOT_MQTT_MAX_INFLIGHT_PUBLISHES
+ * QoS 1 and QoS 2 messages can be waiting for their PUBACK or PUBCOMP at the same time.  The acknowledgments
+ * are processed in aws_iot_mqtt_yield and unacknowledged messages are sent again with the DUP flag set.
+ * @note The topic string and the payload are not copied.  They must stay valid until the
+ * completion handler has been called.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param pParams	Pointer to MQTT publish parameters
+ * @param handler	Callback invoked when the publish has completed, can be NULL
+ * @param pContext	Pointer passed back to the completion handler
+ * @return An IoT Error Type defining whether the message was sent
+ */
+IoT_Error_t aws_iot_mqtt_publish_async(MQTTClient_t *pClient, MQTTPublishParams *pParams,
+		iot_publish_complete_handler handler, void *pContext);
 
 /**
  * @brief Subscribe to an MQTT topic.
@@ -194,10 +244,27 @@ IoT_Error_t aws_iot_mqtt_publish(MQTTPublishParams *pParams);
  * to an MQTT topic.
  * @note Call is blocking.  The call returns after the receipt of the SUBACK control packet.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @param pParams	Pointer to MQTT subscribe parameters
  * @return An IoT Error Type defining successful/failed subscription
  */
-IoT_Error_t aws_iot_mqtt_subscribe(MQTTSubscribeParams *pParams);
+IoT_Error_t aws_iot_mqtt_subscribe(MQTTClient_t *pClient, MQTTSubscribeParams *pParams);
+
+/**
+ * @brief Subscribe to several MQTT topics with a single request.
+ *
+ * Called to send one subscribe message carrying every topic filter in pParams
+ * and check the granted QoS of each filter in the returned SUBACK.
+ * Filters accepted by the broker are registered even if another one was
+ * rejected, in which case SUBSCRIBE_ERROR is returned.
+ * @note Call is blocking.  The call returns after the receipt of the SUBACK control packet.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param pParams	Array of MQTT subscribe parameters
+ * @param count		Number of entries in pParams, at most 16
+ * @return An IoT Error Type defining successful/failed subscription
+ */
+IoT_Error_t aws_iot_mqtt_subscribe_many(MQTTClient_t *pClient, MQTTSubscribeParams *pParams, uint32_t count);
 
 /**
  * @brief Unsubscribe to an MQTT topic.
@@ -206,10 +273,11 @@ IoT_Error_t aws_iot_mqtt_subscribe(MQTTSubscribeParams *pParams);
  * to an MQTT topic.
  * @note Call is blocking.  The call returns after the receipt of the UNSUBACK control packet.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @param pTopic Pointer to the requested topic string. Ensure the string is null terminated
  * @return An IoT Error Type defining successful/failed unsubscription
  */
-IoT_Error_t aws_iot_mqtt_unsubscribe(char *pTopic);
+IoT_Error_t aws_iot_mqtt_unsubscribe(MQTTClient_t *pClient, char *pTopic);
 
 /**
  * @brief MQTT Manual Re-Connection Function
@@ -219,18 +287,20 @@ IoT_Error_t aws_iot_mqtt_unsubscribe(char *pTopic);
  * Use after disconnect to start the reconnect process manually
  * Makes only one reconnect attempt
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @return An IoT Error Type defining successful/failed connection
  */
-IoT_Error_t aws_iot_mqtt_attempt_reconnect(void);
+IoT_Error_t aws_iot_mqtt_attempt_reconnect(MQTTClient_t *pClient);
 
 /**
  * @brief Disconnect an MQTT Connection
  *
  * Called to send a disconnect message to the broker.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @return An IoT Error Type defining successful/failed send of the disconnect control packet.
  */
-IoT_Error_t aws_iot_mqtt_disconnect(void);
+IoT_Error_t aws_iot_mqtt_disconnect(MQTTClient_t *pClient);
 
 /**
  * @brief Yield to the MQTT client
@@ -242,12 +312,135 @@ IoT_Error_t aws_iot_mqtt_disconnect(void);
  * at a rate faster than the incoming message rate as this is the only way the client receives
  * processing time to manage incoming messages.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @param timeout Maximum number of milliseconds to pass thread execution to the client.
  * @return An IoT Error Type defining successful/failed client processing.
  *         If this call results in an error it is likely the MQTT connection has dropped.
  *         iot_is_mqtt_connected can be called to confirm.
  */
-IoT_Error_t aws_iot_mqtt_yield(int timeout);
+IoT_Error_t aws_iot_mqtt_yield(MQTTClient_t *pClient, int timeout);
+
+/**
+ * @brief Socket to wait on in a host event loop
+ *
+ * Instead of calling aws_iot_mqtt_yield in a loop, an application running its own
+ * poll/epoll loop waits until this descriptor is readable or the time returned by
+ * aws_iot_mqtt_next_deadline_ms has passed, and then calls aws_iot_mqtt_process.
+ * The descriptor comes from the getPollFd function of the network port.
+ * Bytes the TLS layer already decrypted do not make the descriptor readable, aws_iot_mqtt_next_deadline_ms
+ * returns 0 for them on ports that report them through the hasPending function of the Network.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @return the descriptor, or -1 while the client is not connected or the port has no descriptor to offer
+ */
+int aws_iot_mqtt_get_poll_fd(MQTTClient_t *pClient);
+
+/**
+ * @brief Time until the client has timed work to do
+ *
+ * Covers the keepalive ping, publish retries and the next reconnect attempt.
+ * Must be asked again after every call into the client, as any call may move it.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @return milliseconds until aws_iot_mqtt_process must be called, 0 if it is due now,
+ *         -1 if nothing is scheduled
+ */
+int32_t aws_iot_mqtt_next_deadline_ms(MQTTClient_t *pClient);
+
+/**
+ * @brief Do the work that is ready without waiting
+ *
+ * Reads and handles the packets that have arrived, sends a due ping, retries unacknowledged
+ * publishes and attempts a due reconnect. Returns as soon as that is done.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param isReadable true if the descriptor of aws_iot_mqtt_get_poll_fd was reported readable
+ * @return An IoT Error Type, the same as aws_iot_mqtt_yield
+ */
+IoT_Error_t aws_iot_mqtt_process(MQTTClient_t *pClient, bool isReadable);
+
+#if defined(MQTT_TASK)
+/**
+ * @brief Publish from a thread other than the MQTT I/O thread
+ *
+ * Queues the publish for the thread that calls aws_iot_mqtt_yield or aws_iot_mqtt_process
+ * and returns at once. Safe to call from any number of threads.
+ * @note The topic string and the payload are not copied.  They must stay valid until the
+ * completion handler has been called.  When aws_iot_mqtt_publish would keep the message for the
+ * reconnect, it is copied to the offline queue and the handler is called with PUBLISH_STORED_OFFLINE.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param pParams	Pointer to MQTT publish parameters
+ * @param handler	Called on the I/O thread once the publish has completed, can be NULL
+ * @param pContext	Pointer passed back to the completion handler
+ * @return NONE_ERROR if the publish was queued, MQTT_COMMAND_QUEUE_FULL otherwise
+ */
+IoT_Error_t aws_iot_mqtt_publish_queued(MQTTClient_t *pClient, MQTTPublishParams *pParams,
+		iot_publish_complete_handler handler, void *pContext);
+
+/**
+ * @brief Subscribe from a thread other than the MQTT I/O thread
+ *
+ * Queues the subscribe like aws_iot_mqtt_publish_queued. The completion handler is called
+ * with an id of 0 once the SUBACK has arrived.
+ * @note The topic string must stay valid as long as the subscription.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param pParams	Pointer to MQTT subscribe parameters
+ * @param handler	Called on the I/O thread once the subscribe has completed, can be NULL
+ * @param pContext	Pointer passed back to the completion handler
+ * @return NONE_ERROR if the subscribe was queued, MQTT_COMMAND_QUEUE_FULL otherwise
+ */
+IoT_Error_t aws_iot_mqtt_subscribe_queued(MQTTClient_t *pClient, MQTTSubscribeParams *pParams,
+		iot_publish_complete_handler handler, void *pContext);
+
+/**
+ * @brief Wake up callback of a dispatch worker
+ *
+ * Called on the MQTT I/O thread when a received message has been queued for a worker.
+ *
+ * @param pContext	Pointer given to aws_iot_mqtt_set_dispatch_wake_handler
+ * @param worker	Index of the worker, below AWS_IOT_MQTT_DISPATCH_WORKERS
+ */
+typedef void (*iot_dispatch_wake_handler)(void *pContext, uint32_t worker);
+
+/**
+ * @brief Call the message handlers of the messages queued for one dispatch worker
+ *
+ * Received messages are handed to AWS_IOT_MQTT_DISPATCH_WORKERS workers so that slow message
+ * handlers do not hold up the I/O thread.  Messages on the same topic always go to the same worker
+ * and are handled in the order they arrived.  Each worker must be served by one thread only.
+ * A message that finds its worker queue full is dropped, see aws_iot_mqtt_get_dispatch_dropped_count.
+ * It is acknowledged all the same, so the broker does not send a QoS 1 or QoS 2 message again.
+ * Subscriptions with streaming enabled, like the Thing Shadow ones, are not dispatched: their handlers
+ * run on the I/O thread, which keeps the shared Thing Shadow state on a single thread.
+ * @note Message handlers running here must use the queued publish and subscribe calls.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param worker	Index of the worker, below AWS_IOT_MQTT_DISPATCH_WORKERS
+ * @return An IoT Error Type, NONE_ERROR once the queue of the worker is empty
+ */
+IoT_Error_t aws_iot_mqtt_run_dispatch_worker(MQTTClient_t *pClient, uint32_t worker);
+
+/**
+ * @brief Set the callback used to wake up the thread of a dispatch worker
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param handler	Callback, can be NULL when the workers poll
+ * @param pContext	Pointer passed back to the callback
+ * @return An IoT Error Type defining successful/failed setting
+ */
+IoT_Error_t aws_iot_mqtt_set_dispatch_wake_handler(MQTTClient_t *pClient, iot_dispatch_wake_handler handler,
+		void *pContext);
+
+/**
+ * @brief Number of received messages dropped because their dispatch worker queue was full
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @return the count since aws_iot_mqtt_init
+ */
+uint32_t aws_iot_mqtt_get_dispatch_dropped_count(MQTTClient_t *pClient);
+#endif
 
 /**
  * @brief Is the MQTT client currently connected?
@@ -255,9 +448,10 @@ IoT_Error_t aws_iot_mqtt_yield(int timeout);
  * Called to determine if the MQTT client is currently connected.  Used to support logic
  * in the device application around reconnecting and managing offline state.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @return true = connected, false = not currently connected
  */
-bool aws_iot_is_mqtt_connected(void);
+bool aws_iot_is_mqtt_connected(MQTTClient_t *pClient);
 
 /**
  * @brief Is the MQTT client set to reconnect automatically?
@@ -265,51 +459,97 @@ bool aws_iot_is_mqtt_connected(void);
  * Called to determine if the MQTT client is set to reconnect automatically.
  * Used to support logic in the device application around reconnecting
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @return true = enabled, false = disabled
  */
-bool aws_iot_is_autoreconnect_enabled(void);
+bool aws_iot_is_autoreconnect_enabled(MQTTClient_t *pClient);
 
 /**
  * @brief Enable or Disable AutoReconnect on Network Disconnect
  *
  * Called to enable or disabled the auto reconnect features provided with the SDK
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  * @param value set to true for enabling and false for disabling
  *
  * @return IoT_Error_t Type defining successful/failed API call
  */
-IoT_Error_t aws_iot_mqtt_autoreconnect_set_status(bool value);
+IoT_Error_t aws_iot_mqtt_autoreconnect_set_status(MQTTClient_t *pClient, bool value);
+
+/**
+ * @brief Offline Queue Drop Policy
+ *
+ * Selects the message that is dropped when a publish is made while disconnected and
+ * AWS_IOT_MQTT_OFFLINE_QUEUE_LEN messages are already waiting for the reconnect.
+ */
+typedef enum {
+	OFFLINE_DROP_OLDEST,			///< Drop the oldest waiting message.  The default
+	OFFLINE_DROP_LOWEST_PRIORITY	///< Drop the oldest message of the lowest MQTTMessageParams::priority, or the new message if its priority is lower still
+} OfflineDropPolicy_t;
+
+/**
+ * @brief Set the drop policy of the offline queue
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @param policy	The policy used from now on
+ * @return IoT_Error_t Type defining successful/failed API call
+ */
+IoT_Error_t aws_iot_mqtt_set_offline_drop_policy(MQTTClient_t *pClient, OfflineDropPolicy_t policy);
 
-typedef IoT_Error_t (*pConnectFunc_t)(MQTTConnectParams *pParams);
-typedef IoT_Error_t (*pPublishFunc_t)(MQTTPublishParams *pParams);
-typedef IoT_Error_t (*pSubscribeFunc_t)(MQTTSubscribeParams *pParams);
-typedef IoT_Error_t (*pUnsubscribeFunc_t)(char *pTopic);
-typedef IoT_Error_t (*pDisconnectFunc_t)(void);
-typedef IoT_Error_t (*pYieldFunc_t)(int timeout);
-typedef bool (*pIsConnectedFunc_t)(void);
-typedef bool (*pIsAutoReconnectEnabledFunc_t)(void);
-typedef IoT_Error_t (*pReconnectFunc_t)();
-typedef IoT_Error_t (*pSetAutoReconnectStatusFunc_t)(bool);
+/**
+ * @brief Number of messages dropped from the offline queue
+ *
+ * Counts messages given way by the drop policy and kept messages that failed after the reconnect.
+ *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
+ * @return the count since aws_iot_mqtt_init
+ */
+uint32_t aws_iot_mqtt_get_offline_dropped_count(MQTTClient_t *pClient);
+
+typedef IoT_Error_t (*pConnectFunc_t)(MQTTClient_t *pClient, MQTTConnectParams *pParams);
+typedef IoT_Error_t (*pPublishFunc_t)(MQTTClient_t *pClient, MQTTPublishParams *pParams);
+typedef IoT_Error_t (*pPublishAsyncFunc_t)(MQTTClient_t *pClient, MQTTPublishParams *pParams,
+		iot_publish_complete_handler handler, void *pContext);
+typedef IoT_Error_t (*pSubscribeFunc_t)(MQTTClient_t *pClient, MQTTSubscribeParams *pParams);
+typedef IoT_Error_t (*pSubscribeManyFunc_t)(MQTTClient_t *pClient, MQTTSubscribeParams *pParams, uint32_t count);
+typedef IoT_Error_t (*pUnsubscribeFunc_t)(MQTTClient_t *pClient, char *pTopic);
+typedef IoT_Error_t (*pDisconnectFunc_t)(MQTTClient_t *pClient);
+typedef IoT_Error_t (*pYieldFunc_t)(MQTTClient_t *pClient, int timeout);
+typedef int (*pGetPollFdFunc_t)(MQTTClient_t *pClient);
+typedef int32_t (*pNextDeadlineMsFunc_t)(MQTTClient_t *pClient);
+typedef IoT_Error_t (*pProcessFunc_t)(MQTTClient_t *pClient, bool isReadable);
+typedef bool (*pIsConnectedFunc_t)(MQTTClient_t *pClient);
+typedef bool (*pIsAutoReconnectEnabledFunc_t)(MQTTClient_t *pClient);
+typedef IoT_Error_t (*pReconnectFunc_t)(MQTTClient_t *pClient);
+typedef IoT_Error_t (*pSetAutoReconnectStatusFunc_t)(MQTTClient_t *pClient, bool);
 /**
  * @brief MQTT Client Type Definition
  *
  * Defines a structure of function pointers, each implementing a corresponding iot_mqtt_*
  * function.  In this way any MQTT client which implements the iot_mqtt_* interface
  * can be swapped in under the MQTT/Shadow layer.
+ * Every function takes the client it was called through, so any number of independent
+ * clients can be used side by side.  Each one carries its own connection in pContext.
  *
  */
-typedef struct{
+struct MQTTClient_s{
 	pConnectFunc_t connect;				///< function implementing the iot_mqtt_connect function
 	pPublishFunc_t publish;				///< function implementing the iot_mqtt_publish function
+	pPublishAsyncFunc_t publishAsync;	///< function implementing the iot_mqtt_publish_async function
 	pSubscribeFunc_t subscribe;			///< function implementing the iot_mqtt_subscribe function
+	pSubscribeManyFunc_t subscribeMany;	///< function implementing the iot_mqtt_subscribe_many function
 	pUnsubscribeFunc_t unsubscribe;		///< function implementing the iot_mqtt_unsubscribe function
 	pDisconnectFunc_t disconnect;		///< function implementing the iot_mqtt_disconnect function
 	pYieldFunc_t yield;					///< function implementing the iot_mqtt_yield function
+	pGetPollFdFunc_t getPollFd;			///< function implementing the iot_mqtt_get_poll_fd function
+	pNextDeadlineMsFunc_t nextDeadlineMs;	///< function implementing the iot_mqtt_next_deadline_ms function
+	pProcessFunc_t process;				///< function implementing the iot_mqtt_process function
 	pIsConnectedFunc_t isConnected;		///< function implementing the iot_is_mqtt_connected function
 	pReconnectFunc_t reconnect;			///< function implementing the iot_mqtt_reconnect function
 	pIsAutoReconnectEnabledFunc_t isAutoReconnectEnabled;	///< function implementing the iot_is_autoreconnect_enabled function
 	pSetAutoReconnectStatusFunc_t setAutoReconnectStatus;	///< function implementing the iot_mqtt_autoreconnect_set_status function
-}MQTTClient_t;
+	void *pContext;						///< connection state of this client, owned by the MQTT client implementation
+};
 
 
 /**
@@ -318,9 +558,23 @@ typedef struct{
  * This function provides a way to pass in an MQTT client implementation to the
  * AWS IoT MQTT wrapper layer.  This is done through function pointers to the
  * interface functions.
+ * The client is also given its own buffers and MQTT state out of a pool of
+ * AWS_IOT_MQTT_MAX_CLIENTS contexts.
+ *
+ * @param pClient	Client to set up
+ * @return NONE_ERROR, or MQTT_CLIENT_POOL_FULL if every context is in use
+ */
+IoT_Error_t aws_iot_mqtt_init(MQTTClient_t *pClient);
+
+/**
+ * @brief Release an MQTT client
+ *
+ * Disconnects the client if needed and returns its context to the pool.
+ * The client must be set up with aws_iot_mqtt_init again before it is used.
  *
+ * @param pClient	Client handle set up with aws_iot_mqtt_init
  */
-void aws_iot_mqtt_init(MQTTClient_t *pClient);
+void aws_iot_mqtt_free(MQTTClient_t *pClient);
 
 
 #endif /* AWS_IOT_SDK_SRC_IOT_MQTT_INTERFACE_H_ */
@@ -27,8 +27,8 @@ IoT_Error_t iot_shadow_action(MQTTClient_t *pClient, const char *pThingName, Sha
 	IoT_Error_t ret_val = NONE_ERROR;
 	bool isCallbackPresent = false;
 	bool isClientTokenPresent = false;
-	bool isAckWaitListFree = false;
-	uint8_t indexAckWaitList;
+	int16_t ackRecord = -1;
+	int16_t thingIndex;
 
 	if(pClient == NULL || pThingName == NULL || pJsonDocumentToBeSent == NULL){
 		return NULL_VALUE_ERROR;
@@ -38,34 +38,43 @@ IoT_Error_t iot_shadow_action(MQTTClient_t *pClient, const char *pThingName, Sha
 		isCallbackPresent = true;
 	}
 
+	thingIndex = findOrAddThingTopics(pThingName);
+	if (thingIndex < 0) {
+		return GENERIC_ERROR;
+	}
+
 	char extractedClientToken[MAX_SIZE_CLIENT_ID_WITH_SEQUENCE];
 	isClientTokenPresent = extractClientToken(pJsonDocumentToBeSent, extractedClientToken);
 
 	if (isClientTokenPresent && isCallbackPresent) {
-		if (getNextFreeIndexOfAckWaitList(&indexAckWaitList)) {
-			isAckWaitListFree = true;
-		}
-
-		if(isAckWaitListFree) {
-			if (!isSubscriptionPresent(pThingName, action)) {
-				ret_val = subscribeToShadowActionAcks(pThingName, action, isSticky);
-			} else {
-				incrementSubscriptionCnt(pThingName, action, isSticky);
-			}
-		}
-		else {
+		// reserved before subscribing, once the document is out there is always a record to wait with
+		ackRecord = reserveAckWaitRecord(thingIndex);
+		if (ackRecord < 0) {
 			ret_val = GENERIC_ERROR;
+		} else if (!isSubscriptionPresent(thingIndex, action)) {
+			ret_val = subscribeToShadowActionAcks(thingIndex, action, isSticky);
+		} else {
+			incrementSubscriptionCnt(thingIndex, action, isSticky);
 		}
 	}
 
-
 	if (ret_val == NONE_ERROR) {
-		ret_val = publishToShadowAction(pThingName, action, pJsonDocumentToBeSent);
+		ret_val = publishToShadowAction(thingIndex, action, pJsonDocumentToBeSent);
+		if (ackRecord >= 0 && ret_val != NONE_ERROR && ret_val != PUBLISH_STORED_OFFLINE) {
+			// nothing will answer, give back the subscription taken for the response
+			unsubscribeFromAcceptedAndRejected((uint8_t) thingIndex, action);
+		}
 	}
 
-	if (isClientTokenPresent && isCallbackPresent && ret_val == NONE_ERROR && isAckWaitListFree) {
-		addToAckWaitList(indexAckWaitList, pThingName, action, extractedClientToken, callback, pCallbackContext,
-				timeout_seconds);
+	if (ackRecord >= 0) {
+		// a document kept for the reconnect is answered once it went out, wait for it the same way
+		if (ret_val == NONE_ERROR || ret_val == PUBLISH_STORED_OFFLINE) {
+			addToAckWaitList(ackRecord, action, extractedClientToken, callback, pCallbackContext, timeout_seconds);
+		} else {
+			cancelAckWaitRecord(ackRecord);
+		}
 	}
+
+	releaseThingTopicsIfUnused(thingIndex);
 	return ret_val;
 }
@@ -95,6 +95,27 @@ IoT_Error_t aws_iot_shadow_connect(MQTTClient_t *pClient, ShadowParameters_t *pP
  * @return An IoT Error Type defining successful/failed Yield
  */
 IoT_Error_t aws_iot_shadow_yield(MQTTClient_t *pClient, int timeout);
+/**
+ * @brief Time until the MQTT client or a Shadow action has timed work to do
+ *
+ * Event loop counterpart of aws_iot_shadow_yield, see aws_iot_mqtt_next_deadline_ms.
+ * Also covers the timeout of the Shadow actions waiting for their response.
+ *
+ * @param pClient	MQTT Client used as the protocol layer
+ * @return milliseconds until aws_iot_shadow_process must be called, 0 if it is due now, -1 if nothing is scheduled
+ */
+int32_t aws_iot_shadow_next_deadline_ms(MQTTClient_t *pClient);
+/**
+ * @brief Do the MQTT and Shadow work that is ready without waiting
+ *
+ * Event loop counterpart of aws_iot_shadow_yield, see aws_iot_mqtt_process.
+ * Expired Shadow actions get their timeout callback here.
+ *
+ * @param pClient	MQTT Client used as the protocol layer
+ * @param isReadable true if the descriptor of aws_iot_mqtt_get_poll_fd was reported readable
+ * @return An IoT Error Type defining successful/failed processing
+ */
+IoT_Error_t aws_iot_shadow_process(MQTTClient_t *pClient, bool isReadable);
 /**
  * @brief Disconnect from the AWS IoT Thing Shadow service over MQTT
  *
@@ -147,10 +168,10 @@ typedef void (*fpActionCallback_t)(const char *pThingName, ShadowActions_t actio
  * update is one of the most frequently used functionality by a device. In most cases the device may be just reporting few params to update the thing shadow in the cloud
  * Update Action if no callback or if the JSON document does not have a client token then will just publish the update and not track it.
  *
- * @note The update has to subscribe to two topics update/accepted and update/rejected. This function waits 2 seconds to ensure the subscriptions are registered before publishing the update message.
+ * @note The update has to subscribe to two topics update/accepted and update/rejected. The first action on a thing waits for the SUBACK of these subscriptions, a single round trip, before publishing the update message.
  * The following steps are performed on using this function:
  * 1. Subscribe to Shadow topics - $aws/things/{thingName}/shadow/update/accepted and $aws/things/{thingName}/shadow/update/rejected
- * 2. wait for 2 seconds for the subscription to take effect
+ * 2. wait for the SUBACK of both subscriptions
  * 3. Publish on the update topic - $aws/things/{thingName}/shadow/update
  * 4. In the \c aws_iot_shadow_yield() function the response will be handled. In case of timeout or if the response is received, the subscription to shadow response topics are un-subscribed from.
  *    On the contrary if the persistent subscription is set to true then the un-subscribe will not be done. The topics will always be listened to.
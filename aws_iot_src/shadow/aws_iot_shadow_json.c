@@ -375,31 +375,6 @@ static IoT_Error_t convertDataToString(char *pStringBuffer, size_t maxSizoString
 static jsmn_parser shadowJsonParser;
 static jsmntok_t jsonTokenStruct[MAX_JSON_TOKEN_EXPECTED];
 
-bool isJsonValidAndParse(const char *pJsonDocument, void *pJsonHandler, int32_t *pTokenCount) {
-	int32_t tokenCount;
-
-	jsmn_init(&shadowJsonParser);
-
-	tokenCount = jsmn_parse(&shadowJsonParser, pJsonDocument, strlen(pJsonDocument), jsonTokenStruct,
-			sizeof(jsonTokenStruct) / sizeof(jsonTokenStruct[0]));
-
-	if (tokenCount < 0) {
-		WARN("Failed to parse JSON: %d\n", tokenCount);
-		return false;
-	}
-
-	/* Assume the top-level element is an object */
-	if (tokenCount < 1 || jsonTokenStruct[0].type != JSMN_OBJECT) {
-		WARN("Top Level is not an object\n");
-		return false;
-	}
-
-	pJsonHandler = (void *) jsonTokenStruct;
-	*pTokenCount = tokenCount;
-
-	return true;
-}
-
 static IoT_Error_t UpdateValueIfNoObject(const char *pJsonString, jsonStruct_t *pDataStruct, jsmntok_t token) {
 	IoT_Error_t ret_val = NONE_ERROR;
 	if (pDataStruct->type == SHADOW_JSON_BOOL) {
@@ -425,27 +400,8 @@ static IoT_Error_t UpdateValueIfNoObject(const char *pJsonString, jsonStruct_t *
 	return ret_val;
 }
 
-bool isJsonKeyMatchingAndUpdateValue(const char *pJsonDocument, void *pJsonHandler, int32_t tokenCount,
-		jsonStruct_t *pDataStruct, uint32_t *pDataLength, int32_t *pDataPosition) {
-	int32_t i;
-
-	jsmntok_t *pJsonTokenStruct;
-
-	pJsonTokenStruct = (jsmntok_t *) pJsonHandler;
-	for (i = 1; i < tokenCount; i++) {
-		if (jsoneq(pJsonDocument, &(jsonTokenStruct[i]), pDataStruct->pKey) == 0) {
-			jsmntok_t dataToken = jsonTokenStruct[i + 1];
-			uint32_t dataLength = dataToken.end - dataToken.start;
-			UpdateValueIfNoObject(pJsonDocument, pDataStruct, dataToken);
-			*pDataPosition = dataToken.start;
-			*pDataLength = dataLength;
-			return true;
-		}
-	}
-	return false;
-}
-
-bool isReceivedJsonValid(const char *pJsonDocument) {
+// Parses into jsonTokenStruct, returns the token count or -1 unless the top-level element is an object
+static int32_t parseJsonTokens(const char *pJsonDocument) {
 	int32_t tokenCount;
 
 	jsmn_init(&shadowJsonParser);
@@ -455,65 +411,95 @@ bool isReceivedJsonValid(const char *pJsonDocument) {
 
 	if (tokenCount < 0) {
 		WARN("Failed to parse JSON: %d\n", tokenCount);
-		return false;
+		return -1;
 	}
 
 	/* Assume the top-level element is an object */
 	if (tokenCount < 1 || jsonTokenStruct[0].type != JSMN_OBJECT) {
-		return false;
+		return -1;
 	}
 
-	return true;
+	return tokenCount;
 }
 
-bool extractClientToken(const char *pJsonDocument, char *pExtractedClientToken) {
-	bool ret_val = false;
-	jsmn_init(&shadowJsonParser);
-	int32_t tokenCount, i;
-	jsmntok_t ClientJsonToken;
+bool isReceivedJsonValid(const char *pJsonDocument) {
+	return parseJsonTokens(pJsonDocument) > 0;
+}
 
-	tokenCount = jsmn_parse(&shadowJsonParser, pJsonDocument, strlen(pJsonDocument), jsonTokenStruct,
-			sizeof(jsonTokenStruct) / sizeof(jsonTokenStruct[0]));
+// keys of the last parsed document found by findKey, applied by updateMatchedJsonKeys
+static jsonStruct_t *matchedKeyStruct[MAX_JSON_TOKEN_EXPECTED / 2];
+static int32_t matchedValueToken[MAX_JSON_TOKEN_EXPECTED / 2];
+static uint32_t matchedKeyCount = 0;
 
-	if (tokenCount < 0) {
-		WARN("Failed to parse JSON: %d\n", tokenCount);
-		return false;
-	}
+bool parseShadowJson(const char *pJsonDocument, ShadowJsonFields_t *pFields, fpFindJsonKey_t findKey) {
+	int32_t tokenCount;
+	int32_t i;
+	uint32_t length;
+	jsonStruct_t *pStruct;
 
-	/* Assume the top-level element is an object */
-	if (tokenCount < 1 || jsonTokenStruct[0].type != JSMN_OBJECT) {
+	pFields->isVersionPresent = false;
+	pFields->isClientTokenPresent = false;
+	matchedKeyCount = 0;
+
+	tokenCount = parseJsonTokens(pJsonDocument);
+	if (tokenCount < 0) {
 		return false;
 	}
 
-	for (i = 1; i < tokenCount; i++) {
-		if (jsoneq(pJsonDocument, &jsonTokenStruct[i], SHADOW_CLIENT_TOKEN_STRING) == 0) {
-			ClientJsonToken = jsonTokenStruct[i + 1];
-			uint8_t length = ClientJsonToken.end - ClientJsonToken.start;
-			strncpy(pExtractedClientToken, pJsonDocument + ClientJsonToken.start, length);
-			pExtractedClientToken[length] = '\0';
-			return true;
+	// one walk over the tokens, a string followed by another token may be a key and its value
+	for (i = 1; i + 1 < tokenCount; i++) {
+		if (jsonTokenStruct[i].type != JSMN_STRING) {
+			continue;
+		}
+		if (!pFields->isVersionPresent && jsoneq(pJsonDocument, &jsonTokenStruct[i], SHADOW_VERSION_STRING) == 0) {
+			if (parseUnsignedInteger32Value(&pFields->version, pJsonDocument, &jsonTokenStruct[i + 1]) == NONE_ERROR) {
+				pFields->isVersionPresent = true;
+				i++;
+			}
+		} else if (!pFields->isClientTokenPresent
+				&& jsoneq(pJsonDocument, &jsonTokenStruct[i], SHADOW_CLIENT_TOKEN_STRING) == 0) {
+			length = jsonTokenStruct[i + 1].end - jsonTokenStruct[i + 1].start;
+			if (length < MAX_SIZE_CLIENT_ID_WITH_SEQUENCE) {
+				memcpy(pFields->clientToken, pJsonDocument + jsonTokenStruct[i + 1].start, length);
+				pFields->clientToken[length] = '\0';
+				pFields->isClientTokenPresent = true;
+				i++;
+			}
+		} else if (findKey != NULL) {
+			pStruct = findKey(pJsonDocument + jsonTokenStruct[i].start, jsonTokenStruct[i].end - jsonTokenStruct[i].start);
+			if (pStruct != NULL && matchedKeyCount < sizeof(matchedKeyStruct) / sizeof(matchedKeyStruct[0])) {
+				matchedKeyStruct[matchedKeyCount] = pStruct;
+				matchedValueToken[matchedKeyCount] = i + 1;
+				matchedKeyCount++;
+				i++;
+			}
 		}
 	}
 
-	return false;
+	return true;
 }
 
-bool extractVersionNumber(const char *pJsonDocument, void *pJsonHandler, int32_t tokenCount, uint32_t *pVersionNumber) {
-	int32_t i;
-	jsmntok_t *pJsonTokenStruct;
-	IoT_Error_t ret_val = NONE_ERROR;
+void updateMatchedJsonKeys(const char *pJsonDocument) {
+	uint32_t i;
+	jsmntok_t *pToken;
 
-	pJsonTokenStruct = (jsmntok_t *) pJsonHandler;
-	for (i = 1; i < tokenCount; i++) {
-		if (jsoneq(pJsonDocument, &(jsonTokenStruct[i]), SHADOW_VERSION_STRING) == 0) {
-			jsmntok_t dataToken = jsonTokenStruct[i + 1];
-			uint32_t dataLength = dataToken.end - dataToken.start;
-			ret_val = parseUnsignedInteger32Value(pVersionNumber, pJsonDocument, &dataToken);
-			if (ret_val == NONE_ERROR) {
-				return true;
-			}
+	for (i = 0; i < matchedKeyCount; i++) {
+		pToken = &jsonTokenStruct[matchedValueToken[i]];
+		UpdateValueIfNoObject(pJsonDocument, matchedKeyStruct[i], *pToken);
+		if (matchedKeyStruct[i]->cb != NULL) {
+			matchedKeyStruct[i]->cb(pJsonDocument + pToken->start, pToken->end - pToken->start, matchedKeyStruct[i]);
 		}
 	}
-	return false;
+	matchedKeyCount = 0;
+}
+
+bool extractClientToken(const char *pJsonDocument, char *pExtractedClientToken) {
+	ShadowJsonFields_t fields;
+
+	if (!parseShadowJson(pJsonDocument, &fields, NULL) || !fields.isClientTokenPresent) {
+		return false;
+	}
+	strcpy(pExtractedClientToken, fields.clientToken);
+	return true;
 }
 
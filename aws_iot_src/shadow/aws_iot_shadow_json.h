@@ -20,11 +20,22 @@
 #include <stdarg.h>
 
 #include "aws_iot_error.h"
+#include "aws_iot_config.h"
 #include "aws_iot_shadow_json_data.h"
 
-bool isJsonValidAndParse(const char *pJsonDocument, void *pJsonHandler, int32_t *pTokenCount);
-bool isJsonKeyMatchingAndUpdateValue(const char *pJsonDocument, void *pJsonHandler, int32_t tokenCount,
-		jsonStruct_t *pDataStruct, uint32_t *pDataLength, int32_t *pDataPosition);
+// Shadow keys of a received document, filled by parseShadowJson
+typedef struct {
+	bool isVersionPresent;
+	uint32_t version;
+	bool isClientTokenPresent;
+	char clientToken[MAX_SIZE_CLIENT_ID_WITH_SEQUENCE];
+} ShadowJsonFields_t;
+
+// Returns the registered struct of a key, or NULL. The key is not NUL terminated
+typedef jsonStruct_t *(*fpFindJsonKey_t)(const char *pKey, uint32_t keyLength);
+
+bool parseShadowJson(const char *pJsonDocument, ShadowJsonFields_t *pFields, fpFindJsonKey_t findKey);
+void updateMatchedJsonKeys(const char *pJsonDocument);
 
 void iot_shadow_get_request_json(char *pJsonDocument);
 void iot_shadow_delete_request_json(char *pJsonDocument);
@@ -34,5 +45,4 @@ void resetClientTokenSequenceNum(void);
 bool isReceivedJsonValid(const char *pJsonDocument);
 void FillWithClientToken(char *pStringToUpdateClientToken);
 bool extractClientToken(const char *pJsonDocumentToBeSent, char *pExtractedClientToken);
-bool extractVersionNumber(const char *pJsonDocument, void *pJsonHandler, int32_t tokenCount, uint32_t *pVersionNumber);
 #endif // AWS_IOT_SDK_SRC_IOT_SHADOW_JSON_H_
@@ -17,6 +17,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "timer_interface.h"
 #include "aws_iot_json_utils.h"
@@ -26,34 +27,70 @@
 
 typedef struct {
 	char clientTokenID[MAX_SIZE_CLIENT_ID_WITH_SEQUENCE];
-	char thingName[MAX_SIZE_OF_THING_NAME];
+	uint8_t thingIndex;	// entry of the thing in ThingTopicList
 	ShadowActions_t action;
 	fpActionCallback_t callback;
 	void *pCallbackContext;
 	bool isFree;
 	Timer timer;
+	uint8_t nextInList;	// next free record, or next record in the same client token bucket
+	uint8_t heapPos;	// position in responseTimeoutHeap
 } ToBeReceivedAckRecord_t;
 
+#define ACK_RECORD_NONE 0xFF
+
+#if (MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME >= ACK_RECORD_NONE)
+#error "MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME must be below 255"
+#endif
+
 typedef struct {
 	const char *pKey;
 	void *pStruct;
 	jsonStructCallback_t callback;
 	bool isFree;
+	uint8_t nextInBucket;	// next key with the same hash in deltaKeyBuckets
+	uint32_t matchedSeq;	// delta message the key was last found in, only its first occurrence counts
 } JsonTokenTable_t;
 
-typedef struct {
-	char Topic[MAX_SHADOW_TOPIC_LENGTH_BYTES];
-	uint8_t count;
-	bool isFree;
-	bool isSticky;
-} SubscriptionRecord_t;
+#define DELTA_KEY_NONE 0xFF
+
+#if (MAX_JSON_TOKEN_EXPECTED >= DELTA_KEY_NONE)
+#error "MAX_JSON_TOKEN_EXPECTED must be below 255"
+#endif
 
 typedef enum {
 	SHADOW_ACCEPTED, SHADOW_REJECTED, SHADOW_ACTION
 } ShadowAckTopicTypes_t;
 
+#define SHADOW_ACTION_COUNT 3		// get, update and delete
+#define SHADOW_ACK_TOPIC_COUNT 2	// accepted and rejected, the first values of ShadowAckTopicTypes_t
+#define MAX_SHADOW_TOPIC_LENGTH_OF_THING (sizeof("$aws/things//shadow/update/accepted") + MAX_SIZE_OF_THING_NAME)
+
+// Topics of one thing, built once when the thing is first acted on. The ack topics double as the
+// subscribed topic filters, so they stay put while subscribed
+typedef struct {
+	char thingName[MAX_SIZE_OF_THING_NAME];
+	char Topic[SHADOW_ACTION_COUNT][SHADOW_ACK_TOPIC_COUNT + 1][MAX_SHADOW_TOPIC_LENGTH_OF_THING];
+	uint16_t TopicLen[SHADOW_ACTION_COUNT][SHADOW_ACK_TOPIC_COUNT + 1];
+	uint16_t prefixLen;	// length of "$aws/things/{thingName}/shadow/" all topics start with
+	uint8_t count[SHADOW_ACTION_COUNT][SHADOW_ACK_TOPIC_COUNT];
+	bool isSticky[SHADOW_ACTION_COUNT][SHADOW_ACK_TOPIC_COUNT];
+	uint8_t pendingAcks;	// records in AckWaitList for this thing
+	bool isFree;
+} ThingTopicRecord_t;
+
 ToBeReceivedAckRecord_t AckWaitList[MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME];
 
+// Free records are chained through nextInList, taken records hang off the bucket of the sequence number
+// ending their client token, so an ack is matched against the few records of its bucket only
+static uint8_t freeAckRecord = ACK_RECORD_NONE;
+static uint8_t ackRecordBuckets[MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME];
+
+// Min-heap of the taken records by response timeout. All timers count down together, so the order
+// set up when a record is added stays valid
+static uint8_t responseTimeoutHeap[MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME];
+static uint8_t responseTimeoutCount = 0;
+
 MQTTClient_t *pMqttClient;
 
 char myThingName[MAX_SIZE_OF_THING_NAME];
@@ -61,14 +98,14 @@ char mqttClientID[MAX_SIZE_OF_UNIQUE_CLIENT_ID_BYTES];
 
 char shadowDeltaTopic[MAX_SHADOW_TOPIC_LENGTH_BYTES];
 
-#define MAX_TOPICS_AT_ANY_GIVEN_TIME 2*MAX_THINGNAME_HANDLED_AT_ANY_GIVEN_TIME
-SubscriptionRecord_t SubscriptionList[MAX_TOPICS_AT_ANY_GIVEN_TIME];
+ThingTopicRecord_t ThingTopicList[MAX_THINGNAME_HANDLED_AT_ANY_GIVEN_TIME];
 
-#define SUBSCRIBE_SETTLING_TIME 2
 char shadowRxBuf[SHADOW_MAX_SIZE_OF_RX_BUFFER];
 
 static JsonTokenTable_t tokenTable[MAX_JSON_TOKEN_EXPECTED];
 static uint32_t tokenTableIndex = 0;
+static uint8_t deltaKeyBuckets[MAX_JSON_TOKEN_EXPECTED];	// first tokenTable entry of each key hash
+static uint32_t deltaMessageSeq = 0;
 static bool deltaTopicSubscribedFlag = false;
 uint32_t shadowJsonVersionNum = 0;
 bool shadowDiscardOldDeltaFlag = true;
@@ -76,15 +113,39 @@ bool shadowDiscardOldDeltaFlag = true;
 // local helper functions
 static int AckStatusCallback(MQTTCallbackParams params);
 static int shadow_delta_callback(MQTTCallbackParams params);
-static void topicNameFromThingAndAction(char *pTopic, const char *pThingName, ShadowActions_t action,
-		ShadowAckTopicTypes_t ackType);
-static int16_t getNextFreeIndexOfSubscriptionList(void);
-static void unsubscribeFromAcceptedAndRejected(uint8_t index);
+static void releaseAckRecord(uint8_t index);
+static uint8_t findAckRecord(const char *pClientToken);
+static bool collectShadowPayload(MQTTCallbackParams *pParams);
+
+// FNV-1a, spreads the registered delta keys over deltaKeyBuckets
+static uint8_t bucketOfDeltaKey(const char *pKey, uint32_t keyLength) {
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+
+	for (i = 0; i < keyLength; i++) {
+		hash = (hash ^ (uint8_t) pKey[i]) * 16777619u;
+	}
+	return (uint8_t) (hash % MAX_JSON_TOKEN_EXPECTED);
+}
+
+static jsonStruct_t *findDeltaKey(const char *pKey, uint32_t keyLength) {
+	uint8_t i;
+
+	for (i = deltaKeyBuckets[bucketOfDeltaKey(pKey, keyLength)]; i != DELTA_KEY_NONE; i = tokenTable[i].nextInBucket) {
+		if (tokenTable[i].matchedSeq != deltaMessageSeq && strlen(tokenTable[i].pKey) == keyLength
+				&& strncmp(tokenTable[i].pKey, pKey, keyLength) == 0) {
+			tokenTable[i].matchedSeq = deltaMessageSeq;
+			return tokenTable[i].pStruct;
+		}
+	}
+	return NULL;
+}
 
 void initDeltaTokens(void) {
 	uint32_t i;
 	for (i = 0; i < MAX_JSON_TOKEN_EXPECTED; i++) {
 		tokenTable[i].isFree = true;
+		deltaKeyBuckets[i] = DELTA_KEY_NONE;
 	}
 	tokenTableIndex = 0;
 	deltaTopicSubscribedFlag = false;
@@ -93,14 +154,16 @@ void initDeltaTokens(void) {
 IoT_Error_t registerJsonTokenOnDelta(jsonStruct_t *pStruct) {
 
 	IoT_Error_t rc = NONE_ERROR;
+	uint8_t bucket;
 
 	if (!deltaTopicSubscribedFlag) {
-		MQTTSubscribeParams subParams;
+		MQTTSubscribeParams subParams = MQTTSubscribeParamsDefault;
 		subParams.mHandler = shadow_delta_callback;
 		snprintf(shadowDeltaTopic,MAX_SHADOW_TOPIC_LENGTH_BYTES, "$aws/things/%s/shadow/update/delta", myThingName);
 		subParams.pTopic = shadowDeltaTopic;
 		subParams.qos = QOS_0;
-		rc = pMqttClient->subscribe(&subParams);
+		subParams.isStreamingEnabled = true;
+		rc = pMqttClient->subscribe(pMqttClient, &subParams);
 		DEBUG("delta topic %s", shadowDeltaTopic);
 		deltaTopicSubscribedFlag = true;
 	}
@@ -113,156 +176,195 @@ IoT_Error_t registerJsonTokenOnDelta(jsonStruct_t *pStruct) {
 	tokenTable[tokenTableIndex].callback = pStruct->cb;
 	tokenTable[tokenTableIndex].pStruct = pStruct;
 	tokenTable[tokenTableIndex].isFree = false;
+	tokenTable[tokenTableIndex].matchedSeq = deltaMessageSeq;
+	bucket = bucketOfDeltaKey(pStruct->pKey, strlen(pStruct->pKey));
+	tokenTable[tokenTableIndex].nextInBucket = deltaKeyBuckets[bucket];
+	deltaKeyBuckets[bucket] = (uint8_t) tokenTableIndex;
 	tokenTableIndex++;
 
 	return rc;
 }
 
-static int16_t getNextFreeIndexOfSubscriptionList(void) {
+static const char *actionTopicNames[SHADOW_ACTION_COUNT] = { "get", "update", "delete" };
+static const char *ackTopicNames[SHADOW_ACK_TOPIC_COUNT] = { "accepted", "rejected" };
+
+int16_t findOrAddThingTopics(const char *pThingName) {
+	int16_t freeIndex = -1;
 	uint8_t i;
-	for (i = 0; i < MAX_TOPICS_AT_ANY_GIVEN_TIME; i++) {
-		if (SubscriptionList[i].isFree) {
-			SubscriptionList[i].isFree = false;
-			return i;
-		}
-	}
-	return -1;
-}
+	uint8_t action;
+	uint8_t ackType;
+	ThingTopicRecord_t *pThing;
 
-static void topicNameFromThingAndAction(char *pTopic, const char *pThingName, ShadowActions_t action,
-		ShadowAckTopicTypes_t ackType) {
+	if (strlen(pThingName) >= MAX_SIZE_OF_THING_NAME) {
+		return -1;
+	}
 
-	char actionBuf[10];
-	char ackTypeBuf[10];
+	for (i = 0; i < MAX_THINGNAME_HANDLED_AT_ANY_GIVEN_TIME; i++) {
+		if (!ThingTopicList[i].isFree) {
+			if (strcmp(ThingTopicList[i].thingName, pThingName) == 0) {
+				return i;
+			}
+		} else if (freeIndex < 0) {
+			freeIndex = i;
+		}
+	}
 
-	if (action == SHADOW_GET) {
-		strcpy(actionBuf, "get");
-	} else if (action == SHADOW_UPDATE) {
-		strcpy(actionBuf, "update");
-	} else if (action == SHADOW_DELETE) {
-		strcpy(actionBuf, "delete");
+	if (freeIndex < 0) {
+		return -1;
 	}
 
-	if (ackType == SHADOW_ACCEPTED) {
-		strcpy(ackTypeBuf, "accepted");
-	} else if (ackType == SHADOW_REJECTED) {
-		strcpy(ackTypeBuf, "rejected");
+	pThing = &ThingTopicList[freeIndex];
+	strcpy(pThing->thingName, pThingName);
+	pThing->prefixLen = (uint16_t) sprintf(pThing->Topic[0][SHADOW_ACTION], "$aws/things/%s/shadow/", pThingName);
+	for (action = 0; action < SHADOW_ACTION_COUNT; action++) {
+		for (ackType = 0; ackType < SHADOW_ACK_TOPIC_COUNT; ackType++) {
+			pThing->TopicLen[action][ackType] = (uint16_t) sprintf(pThing->Topic[action][ackType],
+					"$aws/things/%s/shadow/%s/%s", pThingName, actionTopicNames[action], ackTopicNames[ackType]);
+			pThing->count[action][ackType] = 0;
+			pThing->isSticky[action][ackType] = false;
+		}
+		pThing->TopicLen[action][SHADOW_ACTION] = (uint16_t) sprintf(pThing->Topic[action][SHADOW_ACTION],
+				"$aws/things/%s/shadow/%s", pThingName, actionTopicNames[action]);
 	}
+	pThing->pendingAcks = 0;
+	pThing->isFree = false;
 
-	if (ackType == SHADOW_ACTION) {
-		sprintf(pTopic, "$aws/things/%s/shadow/%s", pThingName, actionBuf);
-	} else {
-		sprintf(pTopic, "$aws/things/%s/shadow/%s/%s", pThingName, actionBuf, ackTypeBuf);
+	return freeIndex;
+}
+
+void releaseThingTopicsIfUnused(int16_t thingIndex) {
+	uint8_t action;
+	uint8_t ackType;
+
+	if (thingIndex < 0 || ThingTopicList[thingIndex].isFree || 0 < ThingTopicList[thingIndex].pendingAcks) {
+		return;
 	}
+	for (action = 0; action < SHADOW_ACTION_COUNT; action++) {
+		for (ackType = 0; ackType < SHADOW_ACK_TOPIC_COUNT; ackType++) {
+			if (0 < ThingTopicList[thingIndex].count[action][ackType]) {
+				return;
+			}
+		}
+	}
+	ThingTopicList[thingIndex].isFree = true;
 }
 
-static bool isAckForMyThingName(const char *pTopicName) {
-	if (strstr(pTopicName, myThingName) != NULL && ((strstr(pTopicName, "get/accepted") != NULL) || (strstr(pTopicName, "delta") != NULL))) {
-		return true;
+// Finds the thing, action and accepted/rejected of a received ack topic through the prebuilt topics
+static bool classifyAckTopic(const char *pTopic, uint16_t topicLen, uint8_t *pThingIndex, ShadowActions_t *pAction,
+		ShadowAckTopicTypes_t *pAckType) {
+	uint8_t i;
+	uint8_t action;
+	uint8_t ackType;
+	ThingTopicRecord_t *pThing;
+
+	for (i = 0; i < MAX_THINGNAME_HANDLED_AT_ANY_GIVEN_TIME; i++) {
+		pThing = &ThingTopicList[i];
+		if (pThing->isFree || topicLen <= pThing->prefixLen
+				|| memcmp(pTopic, pThing->Topic[0][SHADOW_ACTION], pThing->prefixLen) != 0) {
+			continue;
+		}
+		for (action = 0; action < SHADOW_ACTION_COUNT; action++) {
+			for (ackType = 0; ackType < SHADOW_ACK_TOPIC_COUNT; ackType++) {
+				if (pThing->TopicLen[action][ackType] == topicLen
+						&& memcmp(pTopic + pThing->prefixLen, pThing->Topic[action][ackType] + pThing->prefixLen,
+								topicLen - pThing->prefixLen) == 0) {
+					*pThingIndex = i;
+					*pAction = (ShadowActions_t) action;
+					*pAckType = (ShadowAckTopicTypes_t) ackType;
+					return true;
+				}
+			}
+		}
 	}
 	return false;
 }
 
+/**
+ * Copies a received payload, or one chunk of a streamed payload, into shadowRxBuf.
+ * Returns true once the whole document is in the buffer and terminated.
+ * The caller makes sure the total length fits in shadowRxBuf.
+ */
+static bool collectShadowPayload(MQTTCallbackParams *pParams) {
+	uint32_t offset = pParams->PayloadOffset;
+	uint32_t len = pParams->MessageParams.PayloadLen;
+
+	if (offset + len > pParams->TotalPayloadLen) {
+		return false;
+	}
+
+	memcpy(shadowRxBuf + offset, pParams->MessageParams.pPayload, len);
+	if (offset + len < pParams->TotalPayloadLen) {
+		return false;
+	}
+
+	shadowRxBuf[pParams->TotalPayloadLen] = '\0';	// jsmn_parse relies on a string
+	return true;
+}
+
 static int AckStatusCallback(MQTTCallbackParams params) {
-	int32_t tokenCount;
-	int32_t i;
-	void *pJsonHandler;
-	char temporaryClientToken[MAX_SIZE_CLIENT_ID_WITH_SEQUENCE];
+	uint8_t i;
+	ShadowJsonFields_t fields;
+	uint8_t thingIndex;
+	ShadowActions_t action;
+	ShadowAckTopicTypes_t ackType;
 
-	if (params.MessageParams.PayloadLen > SHADOW_MAX_SIZE_OF_RX_BUFFER) {
+	if (params.TotalPayloadLen >= SHADOW_MAX_SIZE_OF_RX_BUFFER) {
 		return GENERIC_ERROR;
 	}
 
-	memcpy(shadowRxBuf, params.MessageParams.pPayload, params.MessageParams.PayloadLen);
-	shadowRxBuf[params.MessageParams.PayloadLen] = '\0';	// jsmn_parse relies on a string
+	if (!collectShadowPayload(&params)) {
+		return NONE_ERROR;	// wait for the rest of a streamed document
+	}
 
-	if (!isJsonValidAndParse(shadowRxBuf, pJsonHandler, &tokenCount)) {
+	if (!classifyAckTopic(params.pTopicName, params.TopicNameLen, &thingIndex, &action, &ackType)) {
+		return GENERIC_ERROR;
+	}
+
+	if (!parseShadowJson(shadowRxBuf, &fields, NULL)) {
 		WARN("Received JSON is not valid");
 		return GENERIC_ERROR;
 	}
 
-	if (isAckForMyThingName(params.pTopicName)) {
-		uint32_t tempVersionNumber = 0;
-		if (extractVersionNumber(shadowRxBuf, pJsonHandler, tokenCount, &tempVersionNumber)) {
-			if (tempVersionNumber > shadowJsonVersionNum) {
-				shadowJsonVersionNum = tempVersionNumber;
-			}
+	if (SHADOW_GET == action && SHADOW_ACCEPTED == ackType && strcmp(ThingTopicList[thingIndex].thingName, myThingName) == 0) {
+		if (fields.isVersionPresent && fields.version > shadowJsonVersionNum) {
+			shadowJsonVersionNum = fields.version;
 		}
 	}
 
-	if (extractClientToken(shadowRxBuf, temporaryClientToken)) {
-		for (i = 0; i < MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME; i++) {
-			if (!AckWaitList[i].isFree) {
-				if (strcmp(AckWaitList[i].clientTokenID, temporaryClientToken) == 0) {
-					Shadow_Ack_Status_t status;
-					if (strstr(params.pTopicName, "accepted") != NULL) {
-						status = SHADOW_ACK_ACCEPTED;
-					} else if (strstr(params.pTopicName, "rejected") != NULL) {
-						status = SHADOW_ACK_REJECTED;
-					}
-					if (status == SHADOW_ACK_ACCEPTED || status == SHADOW_ACK_REJECTED) {
-						if (AckWaitList[i].callback != NULL) {
-							AckWaitList[i].callback(AckWaitList[i].thingName, AckWaitList[i].action, status,
-									shadowRxBuf, AckWaitList[i].pCallbackContext);
-						}
-						unsubscribeFromAcceptedAndRejected(i);
-						AckWaitList[i].isFree = true;
-						return NONE_ERROR;
-					}
-				}
+	if (fields.isClientTokenPresent) {
+		i = findAckRecord(fields.clientToken);
+		if (ACK_RECORD_NONE != i) {
+			Shadow_Ack_Status_t status = (SHADOW_ACCEPTED == ackType) ? SHADOW_ACK_ACCEPTED : SHADOW_ACK_REJECTED;
+			thingIndex = AckWaitList[i].thingIndex;
+			action = AckWaitList[i].action;
+			if (AckWaitList[i].callback != NULL) {
+				AckWaitList[i].callback(ThingTopicList[thingIndex].thingName, action, status, shadowRxBuf,
+						AckWaitList[i].pCallbackContext);
 			}
+			// released first, a response processed while unsubscribing cannot match it again
+			releaseAckRecord(i);
+			unsubscribeFromAcceptedAndRejected(thingIndex, action);
+			releaseThingTopicsIfUnused(thingIndex);
+			return NONE_ERROR;
 		}
 	}
 
 	return GENERIC_ERROR;
 }
 
-static int16_t findIndexOfSubscriptionList(const char *pTopic) {
-	uint8_t i;
-	for (i = 0; i < MAX_TOPICS_AT_ANY_GIVEN_TIME; i++) {
-		if (!SubscriptionList[i].isFree) {
-			if ((strcmp(pTopic, SubscriptionList[i].Topic) == 0)) {
-				return i;
-			}
-		}
-	}
-	return -1;
-}
-
-static void unsubscribeFromAcceptedAndRejected(uint8_t index) {
-
-	char TemporaryTopicNameAccepted[MAX_SHADOW_TOPIC_LENGTH_BYTES];
-	char TemporaryTopicNameRejected[MAX_SHADOW_TOPIC_LENGTH_BYTES];
+void unsubscribeFromAcceptedAndRejected(uint8_t thingIndex, ShadowActions_t action) {
+	ThingTopicRecord_t *pThing = &ThingTopicList[thingIndex];
 	IoT_Error_t ret_val = NONE_ERROR;
+	uint8_t ackType;
 
-	topicNameFromThingAndAction(TemporaryTopicNameAccepted, AckWaitList[index].thingName, AckWaitList[index].action,
-			SHADOW_ACCEPTED);
-	topicNameFromThingAndAction(TemporaryTopicNameRejected, AckWaitList[index].thingName, AckWaitList[index].action,
-			SHADOW_REJECTED);
-
-	int16_t indexSubList;
-
-	indexSubList = findIndexOfSubscriptionList(TemporaryTopicNameAccepted);
-	if ((indexSubList >= 0)) {
-		if (!SubscriptionList[indexSubList].isSticky && (SubscriptionList[indexSubList].count == 1)) {
-			ret_val = pMqttClient->unsubscribe(TemporaryTopicNameAccepted);
+	for (ackType = 0; ackType < SHADOW_ACK_TOPIC_COUNT; ackType++) {
+		if (!pThing->isSticky[action][ackType] && (pThing->count[action][ackType] == 1)) {
+			ret_val = pMqttClient->unsubscribe(pMqttClient, pThing->Topic[action][ackType]);
 			if (ret_val == NONE_ERROR) {
-				SubscriptionList[indexSubList].isFree = true;
+				pThing->count[action][ackType] = 0;
 			}
-		} else if (SubscriptionList[indexSubList].count > 1) {
-			SubscriptionList[indexSubList].count--;
-		}
-	}
-
-	indexSubList = findIndexOfSubscriptionList(TemporaryTopicNameRejected);
-	if ((indexSubList >= 0)) {
-		if (!SubscriptionList[indexSubList].isSticky && (SubscriptionList[indexSubList].count == 1)) {
-			ret_val = pMqttClient->unsubscribe(TemporaryTopicNameRejected);
-			if (ret_val == NONE_ERROR) {
-				SubscriptionList[indexSubList].isFree = true;
-			}
-		} else if (SubscriptionList[indexSubList].count > 1) {
-			SubscriptionList[indexSubList].count--;
+		} else if (pThing->count[action][ackType] > 1) {
+			pThing->count[action][ackType]--;
 		}
 	}
 }
@@ -271,215 +373,256 @@ void initializeRecords(MQTTClient_t *pClient) {
 	uint8_t i;
 	for (i = 0; i < MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME; i++) {
 		AckWaitList[i].isFree = true;
+		AckWaitList[i].nextInList = (i + 1 < MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME) ? (i + 1) : ACK_RECORD_NONE;
+		ackRecordBuckets[i] = ACK_RECORD_NONE;
 	}
-	for (i = 0; i < MAX_TOPICS_AT_ANY_GIVEN_TIME; i++) {
-		SubscriptionList[i].isFree = true;
-		SubscriptionList[i].count = 0;
-		SubscriptionList[i].isSticky = false;
+	freeAckRecord = 0;
+	responseTimeoutCount = 0;
+	for (i = 0; i < MAX_THINGNAME_HANDLED_AT_ANY_GIVEN_TIME; i++) {
+		ThingTopicList[i].isFree = true;
 	}
 	pMqttClient = pClient;
 }
 
-bool isSubscriptionPresent(const char *pThingName, ShadowActions_t action) {
+bool isSubscriptionPresent(int16_t thingIndex, ShadowActions_t action) {
+	return (ThingTopicList[thingIndex].count[action][SHADOW_ACCEPTED] > 0
+			&& ThingTopicList[thingIndex].count[action][SHADOW_REJECTED] > 0);
+}
 
-	uint8_t i = 0;
-	bool isAcceptedPresent = false;
-	bool isRejectedPresent = false;
-	char TemporaryTopicNameAccepted[MAX_SHADOW_TOPIC_LENGTH_BYTES];
-	char TemporaryTopicNameRejected[MAX_SHADOW_TOPIC_LENGTH_BYTES];
+IoT_Error_t subscribeToShadowActionAcks(int16_t thingIndex, ShadowActions_t action, bool isSticky) {
+	IoT_Error_t ret_val = NONE_ERROR;
+	MQTTSubscribeParams subParams[2];
+	ThingTopicRecord_t *pThing = &ThingTopicList[thingIndex];
+
+	subParams[0] = MQTTSubscribeParamsDefault;
+	subParams[0].mHandler = AckStatusCallback;
+	subParams[0].qos = QOS_0;
+	subParams[0].isStreamingEnabled = true;
+	subParams[0].pTopic = pThing->Topic[action][SHADOW_ACCEPTED];
+	subParams[1] = subParams[0];
+	subParams[1].pTopic = pThing->Topic[action][SHADOW_REJECTED];
+
+	// both ack topics go out in one SUBSCRIBE and are confirmed by one SUBACK
+	ret_val = pMqttClient->subscribeMany(pMqttClient, subParams, 2);
+	if (ret_val == NONE_ERROR) {
+		pThing->count[action][SHADOW_ACCEPTED] = 1;
+		pThing->isSticky[action][SHADOW_ACCEPTED] = isSticky;
+		pThing->count[action][SHADOW_REJECTED] = 1;
+		pThing->isSticky[action][SHADOW_REJECTED] = isSticky;
+		// subscribeMany returns once the SUBACK is in, the broker routes the responses from now on
+	} else {
+		// the broker may have granted one of the two filters, drop both
+		pMqttClient->unsubscribe(pMqttClient, pThing->Topic[action][SHADOW_ACCEPTED]);
+		pMqttClient->unsubscribe(pMqttClient, pThing->Topic[action][SHADOW_REJECTED]);
+	}
 
-	topicNameFromThingAndAction(TemporaryTopicNameAccepted, pThingName, action, SHADOW_ACCEPTED);
-	topicNameFromThingAndAction(TemporaryTopicNameRejected, pThingName, action, SHADOW_REJECTED);
+	return ret_val;
+}
 
-	for (i = 0; i < MAX_TOPICS_AT_ANY_GIVEN_TIME; i++) {
-		if (!SubscriptionList[i].isFree) {
-			if ((strcmp(TemporaryTopicNameAccepted, SubscriptionList[i].Topic) == 0)) {
-				isAcceptedPresent = true;
-			} else if ((strcmp(TemporaryTopicNameRejected, SubscriptionList[i].Topic) == 0)) {
-				isRejectedPresent = true;
-			}
-		}
-	}
+void incrementSubscriptionCnt(int16_t thingIndex, ShadowActions_t action, bool isSticky) {
+	uint8_t ackType;
 
-	if (isRejectedPresent && isAcceptedPresent) {
-		return true;
+	for (ackType = 0; ackType < SHADOW_ACK_TOPIC_COUNT; ackType++) {
+		ThingTopicList[thingIndex].count[action][ackType]++;
+		ThingTopicList[thingIndex].isSticky[action][ackType] = isSticky;
 	}
-
-	return false;
 }
 
-IoT_Error_t subscribeToShadowActionAcks(const char *pThingName, ShadowActions_t action, bool isSticky) {
+IoT_Error_t publishToShadowAction(int16_t thingIndex, ShadowActions_t action, const char *pJsonDocumentToBeSent) {
 	IoT_Error_t ret_val = NONE_ERROR;
-	MQTTSubscribeParams subParams = MQTTSubscribeParamsDefault;
 
-	bool clearBothEntriesFromList = true;
-	int16_t indexAcceptedSubList = 0;
-	int16_t indexRejectedSubList = 0;
-	indexAcceptedSubList = getNextFreeIndexOfSubscriptionList();
-	indexRejectedSubList = getNextFreeIndexOfSubscriptionList();
+	MQTTPublishParams pubParams = MQTTPublishParamsDefault;
+	pubParams.pTopic = ThingTopicList[thingIndex].Topic[action][SHADOW_ACTION];
+	MQTTMessageParams msgParams = MQTTMessageParamsDefault;
+	msgParams.qos = QOS_0;
+	msgParams.PayloadLen = strlen(pJsonDocumentToBeSent) + 1;
+	msgParams.pPayload = (char *) pJsonDocumentToBeSent;
+	pubParams.MessageParams = msgParams;
+	ret_val = pMqttClient->publish(pMqttClient, &pubParams);
 
-	if (indexAcceptedSubList >= 0 && indexRejectedSubList >= 0) {
-		topicNameFromThingAndAction(SubscriptionList[indexAcceptedSubList].Topic, pThingName, action, SHADOW_ACCEPTED);
-		subParams.mHandler = AckStatusCallback;
-		subParams.qos = QOS_0;
-		subParams.pTopic = SubscriptionList[indexAcceptedSubList].Topic;
-		ret_val = pMqttClient->subscribe(&subParams);
-		if (ret_val == NONE_ERROR) {
-			SubscriptionList[indexAcceptedSubList].count = 1;
-			SubscriptionList[indexAcceptedSubList].isSticky = isSticky;
-			topicNameFromThingAndAction(SubscriptionList[indexRejectedSubList].Topic, pThingName, action,
-					SHADOW_REJECTED);
-			subParams.pTopic = SubscriptionList[indexRejectedSubList].Topic;
-			ret_val = pMqttClient->subscribe(&subParams);
-			if (ret_val == NONE_ERROR) {
-				SubscriptionList[indexRejectedSubList].count = 1;
-				SubscriptionList[indexRejectedSubList].isSticky = isSticky;
-				clearBothEntriesFromList = false;
+	return ret_val;
+}
 
-				// wait for SUBSCRIBE_SETTLING_TIME seconds to let the subscription take effect
-				Timer subSettlingtimer;
-				InitTimer(&subSettlingtimer);
-				countdown(&subSettlingtimer, SUBSCRIBE_SETTLING_TIME);
-				while(!expired(&subSettlingtimer));
+// Sequence number FillWithClientToken put at the end of the token, tokens made up by the application may have none
+static uint8_t bucketOfClientToken(const char *pClientToken) {
+	const char *pSequence = strrchr(pClientToken, '-');
+	unsigned long sequence = 0;
 
-			}
-		}
+	if (NULL != pSequence) {
+		sequence = strtoul(pSequence + 1, NULL, 10);
 	}
+	return (uint8_t) (sequence % MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME);
+}
 
-	if (clearBothEntriesFromList) {
-		if (indexAcceptedSubList >= 0) {
-			SubscriptionList[indexAcceptedSubList].isFree = true;
-		} else if (indexRejectedSubList >= 0) {
-			SubscriptionList[indexRejectedSubList].isFree = true;
-		}
-		if (SubscriptionList[indexAcceptedSubList].count == 1) {
-			pMqttClient->unsubscribe(SubscriptionList[indexAcceptedSubList].Topic);
-		}
+static uint8_t findAckRecord(const char *pClientToken) {
+	uint8_t i = ackRecordBuckets[bucketOfClientToken(pClientToken)];
+
+	while (ACK_RECORD_NONE != i && strcmp(AckWaitList[i].clientTokenID, pClientToken) != 0) {
+		i = AckWaitList[i].nextInList;
 	}
+	return i;
+}
 
-	return ret_val;
+static bool isResponseDueBefore(uint8_t heapPosA, uint8_t heapPosB) {
+	return left_ms(&(AckWaitList[responseTimeoutHeap[heapPosA]].timer))
+			< left_ms(&(AckWaitList[responseTimeoutHeap[heapPosB]].timer));
 }
 
-void incrementSubscriptionCnt(const char *pThingName, ShadowActions_t action, bool isSticky) {
-	char TemporaryTopicNameAccepted[MAX_SHADOW_TOPIC_LENGTH_BYTES];
-	char TemporaryTopicNameRejected[MAX_SHADOW_TOPIC_LENGTH_BYTES];
-	uint8_t i;
-	topicNameFromThingAndAction(TemporaryTopicNameAccepted, pThingName, action, SHADOW_ACCEPTED);
-	topicNameFromThingAndAction(TemporaryTopicNameRejected, pThingName, action, SHADOW_REJECTED);
-
-	for (i = 0; i < MAX_TOPICS_AT_ANY_GIVEN_TIME; i++) {
-		if (!SubscriptionList[i].isFree) {
-			if ((strcmp(TemporaryTopicNameAccepted, SubscriptionList[i].Topic) == 0)
-					|| (strcmp(TemporaryTopicNameRejected, SubscriptionList[i].Topic) == 0)) {
-				SubscriptionList[i].count++;
-				SubscriptionList[i].isSticky = isSticky;
-			}
+static void swapResponseTimeouts(uint8_t heapPosA, uint8_t heapPosB) {
+	uint8_t index = responseTimeoutHeap[heapPosA];
+
+	responseTimeoutHeap[heapPosA] = responseTimeoutHeap[heapPosB];
+	responseTimeoutHeap[heapPosB] = index;
+	AckWaitList[responseTimeoutHeap[heapPosA]].heapPos = heapPosA;
+	AckWaitList[responseTimeoutHeap[heapPosB]].heapPos = heapPosB;
+}
+
+static void siftResponseTimeoutUp(uint8_t heapPos) {
+	while (heapPos > 0 && isResponseDueBefore(heapPos, (heapPos - 1) / 2)) {
+		swapResponseTimeouts(heapPos, (heapPos - 1) / 2);
+		heapPos = (heapPos - 1) / 2;
+	}
+}
+
+static void siftResponseTimeoutDown(uint8_t heapPos) {
+	uint8_t child;
+
+	while ((child = 2 * heapPos + 1) < responseTimeoutCount) {
+		if (child + 1 < responseTimeoutCount && isResponseDueBefore(child + 1, child)) {
+			child++;
 		}
+		if (!isResponseDueBefore(child, heapPos)) {
+			break;
+		}
+		swapResponseTimeouts(heapPos, child);
+		heapPos = child;
 	}
 }
 
-IoT_Error_t publishToShadowAction(const char * pThingName, ShadowActions_t action, const char *pJsonDocumentToBeSent) {
-	IoT_Error_t ret_val = NONE_ERROR;
-	char TemporaryTopicName[MAX_SHADOW_TOPIC_LENGTH_BYTES];
-	topicNameFromThingAndAction(TemporaryTopicName, pThingName, action, SHADOW_ACTION);
+static void releaseAckRecord(uint8_t index) {
+	uint8_t *pLink = &ackRecordBuckets[bucketOfClientToken(AckWaitList[index].clientTokenID)];
+	uint8_t heapPos = AckWaitList[index].heapPos;
+	uint8_t moved;
 
-	MQTTPublishParams pubParams = MQTTPublishParamsDefault;
-	pubParams.pTopic = TemporaryTopicName;
-	MQTTMessageParams msgParams = MQTTMessageParamsDefault;
-	msgParams.qos = QOS_0;
-	msgParams.PayloadLen = strlen(pJsonDocumentToBeSent) + 1;
-	msgParams.pPayload = (char *) pJsonDocumentToBeSent;
-	pubParams.MessageParams = msgParams;
-	ret_val = pMqttClient->publish(&pubParams);
+	if (AckWaitList[index].isFree) {
+		return;
+	}
 
-	return ret_val;
+	while (*pLink != index) {
+		pLink = &(AckWaitList[*pLink].nextInList);
+	}
+	*pLink = AckWaitList[index].nextInList;
+
+	responseTimeoutCount--;
+	if (heapPos != responseTimeoutCount) {
+		// the last record fills the hole and moves to where its timeout belongs
+		moved = responseTimeoutHeap[responseTimeoutCount];
+		swapResponseTimeouts(heapPos, responseTimeoutCount);
+		siftResponseTimeoutUp(heapPos);
+		siftResponseTimeoutDown(AckWaitList[moved].heapPos);
+	}
+
+	ThingTopicList[AckWaitList[index].thingIndex].pendingAcks--;
+	AckWaitList[index].isFree = true;
+	AckWaitList[index].nextInList = freeAckRecord;
+	freeAckRecord = index;
 }
 
-bool getNextFreeIndexOfAckWaitList(uint8_t *pIndex) {
-	uint8_t i;
-	if (pIndex != NULL) {
-		for (i = 0; i < MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME; i++) {
-			if (AckWaitList[i].isFree) {
-				*pIndex = i;
-				return true;
-			}
-		}
+// Takes a record off the free list before the action subscribes and publishes, so that a callback run
+// meanwhile cannot use up the last one. Counted as pending right away, which also keeps the thing topics
+int16_t reserveAckWaitRecord(int16_t thingIndex) {
+	uint8_t index = freeAckRecord;
+
+	if (ACK_RECORD_NONE == index) {
+		return -1;
 	}
-	return false;
+	freeAckRecord = AckWaitList[index].nextInList;
+
+	AckWaitList[index].thingIndex = (uint8_t) thingIndex;
+	ThingTopicList[thingIndex].pendingAcks++;
+
+	return index;
 }
 
-void addToAckWaitList(uint8_t indexAckWaitList, const char *pThingName, ShadowActions_t action,
-		const char *pExtractedClientToken, fpActionCallback_t callback, void *pCallbackContext,
-		uint32_t timeout_seconds) {
-	AckWaitList[indexAckWaitList].callback = callback;
-	strncpy(AckWaitList[indexAckWaitList].clientTokenID, pExtractedClientToken, MAX_SIZE_CLIENT_ID_WITH_SEQUENCE);
-	strncpy(AckWaitList[indexAckWaitList].thingName, pThingName, MAX_SIZE_OF_THING_NAME);
-	AckWaitList[indexAckWaitList].pCallbackContext = pCallbackContext;
-	AckWaitList[indexAckWaitList].action = action;
-	InitTimer(&(AckWaitList[indexAckWaitList].timer));
-	countdown(&(AckWaitList[indexAckWaitList].timer), timeout_seconds);
-	AckWaitList[indexAckWaitList].isFree = false;
+// Gives back a reserved record whose action failed before anything was waited for
+void cancelAckWaitRecord(int16_t recordIndex) {
+	ThingTopicList[AckWaitList[recordIndex].thingIndex].pendingAcks--;
+	AckWaitList[recordIndex].nextInList = freeAckRecord;
+	freeAckRecord = (uint8_t) recordIndex;
+}
+
+void addToAckWaitList(int16_t recordIndex, ShadowActions_t action, const char *pExtractedClientToken,
+		fpActionCallback_t callback, void *pCallbackContext, uint32_t timeout_seconds) {
+	uint8_t index = (uint8_t) recordIndex;
+	uint8_t bucket;
+
+	AckWaitList[index].callback = callback;
+	strncpy(AckWaitList[index].clientTokenID, pExtractedClientToken, MAX_SIZE_CLIENT_ID_WITH_SEQUENCE);
+	AckWaitList[index].pCallbackContext = pCallbackContext;
+	AckWaitList[index].action = action;
+	InitTimer(&(AckWaitList[index].timer));
+	countdown(&(AckWaitList[index].timer), timeout_seconds);
+	AckWaitList[index].isFree = false;
+
+	bucket = bucketOfClientToken(AckWaitList[index].clientTokenID);
+	AckWaitList[index].nextInList = ackRecordBuckets[bucket];
+	ackRecordBuckets[bucket] = index;
+
+	AckWaitList[index].heapPos = responseTimeoutCount;
+	responseTimeoutHeap[responseTimeoutCount] = index;
+	responseTimeoutCount++;
+	siftResponseTimeoutUp(AckWaitList[index].heapPos);
+}
+
+int32_t NextResponseTimeoutMs(void) {
+	return (0 < responseTimeoutCount) ? left_ms(&(AckWaitList[responseTimeoutHeap[0]].timer)) : -1;
 }
 
 void HandleExpiredResponseCallbacks(void) {
 	uint8_t i;
-	for (i = 0; i < MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME; i++) {
-		if (!AckWaitList[i].isFree) {
-			if (expired(&(AckWaitList[i].timer))) {
-				if (AckWaitList[i].callback != NULL) {
-					AckWaitList[i].callback(AckWaitList[i].thingName, AckWaitList[i].action, SHADOW_ACK_TIMEOUT,
-							shadowRxBuf, AckWaitList[i].pCallbackContext);
-				}
-				AckWaitList[i].isFree = true;
-				unsubscribeFromAcceptedAndRejected(i);
-			}
+
+	while (0 < responseTimeoutCount && expired(&(AckWaitList[responseTimeoutHeap[0]].timer))) {
+		i = responseTimeoutHeap[0];
+		if (AckWaitList[i].callback != NULL) {
+			AckWaitList[i].callback(ThingTopicList[AckWaitList[i].thingIndex].thingName, AckWaitList[i].action,
+					SHADOW_ACK_TIMEOUT, shadowRxBuf, AckWaitList[i].pCallbackContext);
 		}
+		releaseAckRecord(i);
+		unsubscribeFromAcceptedAndRejected(AckWaitList[i].thingIndex, AckWaitList[i].action);
+		releaseThingTopicsIfUnused(AckWaitList[i].thingIndex);
 	}
 }
 
 static int shadow_delta_callback(MQTTCallbackParams params) {
 
-	int32_t tokenCount;
-	uint32_t i = 0;
-	void *pJsonHandler;
-	int32_t DataPosition;
-	uint32_t dataLength;
+	ShadowJsonFields_t fields;
 
-	if (params.MessageParams.PayloadLen > SHADOW_MAX_SIZE_OF_RX_BUFFER) {
+	if (params.TotalPayloadLen >= SHADOW_MAX_SIZE_OF_RX_BUFFER) {
 		return GENERIC_ERROR;
 	}
 
-	memcpy(shadowRxBuf, params.MessageParams.pPayload, params.MessageParams.PayloadLen);
-	shadowRxBuf[params.MessageParams.PayloadLen] = '\0';	// jsmn_parse relies on a string
+	if (!collectShadowPayload(&params)) {
+		return NONE_ERROR;	// wait for the rest of a streamed document
+	}
 
-	if (!isJsonValidAndParse(shadowRxBuf, pJsonHandler, &tokenCount)) {
+	// registered keys are looked up while the document is walked, and applied once the version is checked
+	deltaMessageSeq++;
+	if (!parseShadowJson(shadowRxBuf, &fields, findDeltaKey)) {
 		WARN("Received JSON is not valid");
 		return GENERIC_ERROR;
 	}
 
-	if (shadowDiscardOldDeltaFlag) {
-		uint32_t tempVersionNumber = 0;
-		if (extractVersionNumber(shadowRxBuf, pJsonHandler, tokenCount, &tempVersionNumber)) {
-			if (tempVersionNumber > shadowJsonVersionNum) {
-				shadowJsonVersionNum = tempVersionNumber;
-				DEBUG("New Version number: %d", shadowJsonVersionNum);
-			} else {
-				WARN("Old Delta Message received - Ignoring rx: %d local: %d", tempVersionNumber, shadowJsonVersionNum);
-				return GENERIC_ERROR;
-			}
+	if (shadowDiscardOldDeltaFlag && fields.isVersionPresent) {
+		if (fields.version > shadowJsonVersionNum) {
+			shadowJsonVersionNum = fields.version;
+			DEBUG("New Version number: %d", shadowJsonVersionNum);
+		} else {
+			WARN("Old Delta Message received - Ignoring rx: %d local: %d", fields.version, shadowJsonVersionNum);
+			return GENERIC_ERROR;
 		}
 	}
 
-	for (i = 0; i < tokenTableIndex; i++) {
-		if (!tokenTable[i].isFree) {
-			if (isJsonKeyMatchingAndUpdateValue(shadowRxBuf, pJsonHandler, tokenCount, tokenTable[i].pStruct,
-					&dataLength, &DataPosition)) {
-				if (tokenTable[i].callback != NULL) {
-					tokenTable[i].callback(shadowRxBuf + DataPosition, dataLength, tokenTable[i].pStruct);
-				}
-			}
-		}
-	}
+	updateMatchedJsonKeys(shadowRxBuf);
 
 	return NONE_ERROR;
 }
@@ -29,16 +29,20 @@ extern char myThingName[MAX_SIZE_OF_THING_NAME];
 extern char mqttClientID[MAX_SIZE_OF_UNIQUE_CLIENT_ID_BYTES];
 
 void initializeRecords(MQTTClient_t *pClient);
-bool isSubscriptionPresent(const char *pThingName, ShadowActions_t action);
-IoT_Error_t subscribeToShadowActionAcks(const char *pThingName, ShadowActions_t action, bool isSticky);
-void incrementSubscriptionCnt(const char *pThingName, ShadowActions_t action, bool isSticky);
-
-IoT_Error_t publishToShadowAction(const char * pThingName, ShadowActions_t action, const char *pJsonDocumentToBeSent);
-void addToAckWaitList(uint8_t indexAckWaitList, const char *pThingName, ShadowActions_t action,
-		const char *pExtractedClientToken, fpActionCallback_t callback, void *pCallbackContext,
-		uint32_t timeout_seconds);
-bool getNextFreeIndexOfAckWaitList(uint8_t *pIndex);
+int16_t findOrAddThingTopics(const char *pThingName);
+void releaseThingTopicsIfUnused(int16_t thingIndex);
+bool isSubscriptionPresent(int16_t thingIndex, ShadowActions_t action);
+IoT_Error_t subscribeToShadowActionAcks(int16_t thingIndex, ShadowActions_t action, bool isSticky);
+void incrementSubscriptionCnt(int16_t thingIndex, ShadowActions_t action, bool isSticky);
+void unsubscribeFromAcceptedAndRejected(uint8_t thingIndex, ShadowActions_t action);
+
+IoT_Error_t publishToShadowAction(int16_t thingIndex, ShadowActions_t action, const char *pJsonDocumentToBeSent);
+int16_t reserveAckWaitRecord(int16_t thingIndex);
+void cancelAckWaitRecord(int16_t recordIndex);
+void addToAckWaitList(int16_t recordIndex, ShadowActions_t action, const char *pExtractedClientToken,
+		fpActionCallback_t callback, void *pCallbackContext, uint32_t timeout_seconds);
 void HandleExpiredResponseCallbacks(void);
+int32_t NextResponseTimeoutMs(void);
 void initDeltaTokens(void);
 IoT_Error_t registerJsonTokenOnDelta(jsonStruct_t *pStruct);
 
@@ -87,7 +87,16 @@ typedef enum {
 	/** The MQTT RX buffer received corrupt message  */
 	RX_MESSAGE_INVALID = -27,
 	/** The MQTT RX buffer received a bigger message. The message will be dropped  */
-	RX_MESSAGE_BIGGER_THAN_MQTT_RX_BUF = -28
+	RX_MESSAGE_BIGGER_THAN_MQTT_RX_BUF = -28,
+	/** The QoS1 publish was not sent because the maximum number of publishes are already waiting for a PUBACK */
+	PUBLISH_INFLIGHT_WINDOW_FULL = -29,
+	/** Every MQTT client context is in use.  See AWS_IOT_MQTT_MAX_CLIENTS */
+	MQTT_CLIENT_POOL_FULL = -30,
+	/** The command was not queued because the MQTT I/O thread has AWS_IOT_MQTT_COMMAND_QUEUE_LEN commands left to run */
+	MQTT_COMMAND_QUEUE_FULL = -31,
+	/** Not a failure.  The connection is down and auto-reconnect is bringing it back, or earlier kept publishes are still
+	 * being sent.  The publish was copied to the offline queue and goes out in order once it is its turn.  See AWS_IOT_MQTT_OFFLINE_QUEUE_LEN */
+	PUBLISH_STORED_OFFLINE = 2
 }IoT_Error_t;
 
 #endif /* AWS_IOT_SDK_SRC_IOT_ERROR_H_ */
@@ -18,47 +18,134 @@
 #include <string.h>
 
 static void MQTTForceDisconnect(Client *c);
+static void resetRxRing(Client *c);
+static uint8_t hasStreamingHandler(Client *c, const char *topic, size_t topicLen);
+static uint8_t hasBufferedPacket(Client *c);
+static MQTTReturnCode connectSession(Client *c, MQTTPacket_connectData *options, uint32_t *pSubscribesSent);
+static MQTTReturnCode writeResubscribe(Client *c, uint32_t pendingLen, Timer *timer, uint32_t *pPacketsSent);
+static MQTTReturnCode waitResubscribeAcks(Client *c, uint32_t packetsSent, Timer *timer);
+static MQTTReturnCode sendPublishNow(Client *c, const char *topicName, MQTTMessage *message);
+#if defined(MQTT_OFFLINE_QUEUE)
+static void drainOfflinePublishes(Client *c);
+#endif
+#if defined(MQTT_TASK)
+static void runQueuedCommands(Client *c);
+static uint8_t hasQueuedCommand(Client *c);
+#endif
+
+typedef struct {
+    uint8_t isComplete;
+    MQTTReturnCode rc;
+} BlockingPublishState;
 
 void NewMessageData(MessageData *md, MQTTString *aTopicName, MQTTMessage *aMessage, pApplicationHandler_t applicationHandler) {
     md->topicName = aTopicName;
     md->message = aMessage;
     md->applicationHandler = applicationHandler;
+    md->client = NULL;
+    md->payloadOffset = 0;
+    md->totalPayloadLen = (uint32_t)aMessage->payloadlen;
 }
 
-uint16_t getNextPacketId(Client *c) {
-    return c->nextPacketId = (uint16_t)((MAX_PACKET_ID == c->nextPacketId) ? 1 : (c->nextPacketId + 1));
+static uint32_t findResubscribeId(Client *c, uint16_t packetId) {
+    uint32_t i;
+
+    for(i = 0; i < c->resubscribeCount; ++i) {
+        if(packetId == c->resubscribeIds[i]) {
+            return i;
+        }
+    }
+    return c->resubscribeCount;
 }
 
-MQTTReturnCode sendPacket(Client *c, uint32_t length, Timer *timer) {
-    int32_t sentLen = 0;
-    uint32_t sent = 0;
+static uint8_t isPacketIdInUse(Client *c, uint16_t packetId) {
+    uint32_t i;
 
-    if(NULL == c || NULL == timer) {
-        return MQTT_NULL_VALUE_ERROR;
+    if(packetId == c->requestPacketId || c->resubscribeCount != findResubscribeId(c, packetId)) {
+        return 1;
     }
-
-    if(length >= c->bufSize) {
-    	return MQTTPACKET_BUFFER_TOO_SHORT;
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        if(NULL != c->inflightPublishes[i].topicName && packetId == c->inflightPublishes[i].message.id) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    while(sent < length && !expired(timer)) {
-        sentLen = c->networkStack.mqttwrite(&(c->networkStack), &c->buf[sent], (int)length, left_ms(timer));
+/* Ids still waiting for their acknowledgment are skipped. Only the in-flight publishes, the
+ * SUBSCRIBEs of a resubscribe and the last SUBSCRIBE/UNSUBSCRIBE hold an id, so at most
+ * MAX_INFLIGHT_PUBLISHES + MAX_MESSAGE_HANDLERS + 1 ids are passed over */
+uint16_t getNextPacketId(Client *c) {
+    do {
+        c->nextPacketId = (uint16_t)((MAX_PACKET_ID == c->nextPacketId) ? 1 : (c->nextPacketId + 1));
+    } while(isPacketIdInUse(c, c->nextPacketId));
+
+    return c->nextPacketId;
+}
+
+/* A SUBSCRIBE or UNSUBSCRIBE of the application waits for its ack before the next one, so only
+ * the id of the last one is kept out of use. Still skipping it after it was acknowledged does no
+ * harm. The SUBSCRIBEs of a resubscribe are written all at once and keep theirs in resubscribeIds */
+static uint16_t getNextRequestPacketId(Client *c) {
+    c->requestPacketId = getNextPacketId(c);
+    return c->requestPacketId;
+}
+
+/* Writes the vectors to the network in order, picking up after partial writes.
+ * Uses the scatter/gather write of the network when it has one, otherwise one write per vector.
+ * The vectors are advanced in place */
+static MQTTReturnCode sendVectors(Client *c, NetworkIOVector *vectors, int count, Timer *timer) {
+    int32_t sentLen = 0;
+
+    while(0 < count && !expired(timer)) {
+        if(NULL != c->networkStack.mqttwritev) {
+            sentLen = c->networkStack.mqttwritev(&(c->networkStack), vectors, count, left_ms(timer));
+        } else {
+            sentLen = c->networkStack.mqttwrite(&(c->networkStack), vectors[0].pBuffer, vectors[0].len,
+                                                left_ms(timer));
+        }
         if(sentLen < 0) {
             /* there was an error writing the data */
             break;
         }
-        sent = sent + (uint32_t)sentLen;
+
+        while(0 < count && sentLen >= vectors[0].len) {
+            sentLen -= vectors[0].len;
+            vectors++;
+            count--;
+        }
+        if(0 < count) {
+            vectors[0].pBuffer += sentLen;
+            vectors[0].len -= sentLen;
+        }
     }
 
-    if(sent == length) {
-        /* record the fact that we have successfully sent the packet */
-        //countdown(&c->pingTimer, c->keepAliveInterval);
+    if(0 == count) {
+        /* the broker only needs a PINGREQ after a keepalive interval without any packet from us */
+        countdown(&c->pingTimer, c->keepAliveInterval);
         return SUCCESS;
     }
 
     return FAILURE;
 }
 
+MQTTReturnCode sendPacket(Client *c, uint32_t length, Timer *timer) {
+    NetworkIOVector vector;
+
+    if(NULL == c || NULL == timer) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(length >= c->bufSize) {
+    	return MQTTPACKET_BUFFER_TOO_SHORT;
+    }
+
+    vector.pBuffer = c->buf;
+    vector.len = (int)length;
+
+    return sendVectors(c, &vector, 1, timer);
+}
+
 void copyMQTTConnectData(MQTTPacket_connectData *destination, MQTTPacket_connectData *source) {
     if(NULL == destination || NULL == source) {
         return;
@@ -94,7 +181,36 @@ MQTTReturnCode MQTTClient(Client *c, uint32_t commandTimeoutMs,
         c->messageHandlers[i].fp = NULL;
         c->messageHandlers[i].applicationHandler = NULL;
         c->messageHandlers[i].qos = 0;
-    }
+        c->messageHandlers[i].isStreaming = 0;
+        c->messageHandlers[i].trieNode = TOPIC_TRIE_NONE;
+        c->messageHandlers[i].nextHandler = TOPIC_TRIE_NONE;
+    }
+
+    for(i = 0; i < MAX_TOPIC_TRIE_NODES; ++i) {
+        c->topicTrie[i].isUsed = 0;
+        c->topicTrie[i].parent = TOPIC_TRIE_NONE;
+        c->topicTrie[i].firstChild = TOPIC_TRIE_NONE;
+        c->topicTrie[i].nextSibling = TOPIC_TRIE_NONE;
+        c->topicTrie[i].firstHandler = TOPIC_TRIE_NONE;
+    }
+    c->topicTrie[TOPIC_TRIE_ROOT].isUsed = 1;
+
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        c->inflightPublishes[i].topicName = NULL;
+        c->inflightPublishes[i].completionHandler = NULL;
+        c->inflightPublishes[i].applicationHandler = NULL;
+        c->inflightPublishes[i].pApplicationContext = NULL;
+        c->inflightPublishes[i].retryCount = 0;
+        c->inflightPublishes[i].isReleased = 0;
+        InitTimer(&(c->inflightPublishes[i].retryTimer));
+    }
+    c->inboundQoS2Count = 0;
+    c->requestPacketId = 0;
+    c->resubscribeCount = 0;
+    c->currentReconnectWaitInterval = MIN_RECONNECT_WAIT_INTERVAL;
+    c->reconnectAttempts = 0;
+    c->reconnectRandomState = 0;
+    c->isPhysicalLayerDown = 0;
 
     c->commandTimeoutMs = commandTimeoutMs;
     c->buf = buf;
@@ -119,98 +235,389 @@ MQTTReturnCode MQTTClient(Client *c, uint32_t commandTimeoutMs,
     c->tlsConnectParams.timeout_ms = tlsConnectParams->timeout_ms;
     c->tlsConnectParams.ServerVerificationFlag = tlsConnectParams->ServerVerificationFlag;
 
+    resetRxRing(c);
+
+    c->offlineDropPolicy = MQTT_OFFLINE_DROP_OLDEST;
+    c->offlineDroppedCount = 0;
+#if defined(MQTT_OFFLINE_QUEUE)
+    for(i = 0; i < MAX_OFFLINE_PUBLISHES; ++i) {
+        c->offlinePublishes[i].isUsed = 0;
+    }
+    c->offlinePublishCount = 0;
+    c->offlineInflightCount = 0;
+    InitTimer(&(c->offlineDrainTimer));
+#endif
+
+#if defined(MQTT_TASK)
+    for(i = 0; i < MAX_QUEUED_COMMANDS; ++i) {
+        c->commandQueue[i].sequence = i;
+    }
+    c->commandQueueHead = 0;
+    c->commandQueueTail = 0;
+    c->commandWakeHandler = NULL;
+#endif
+
+#if defined(MQTT_DISPATCH)
+    for(i = 0; i < MAX_DISPATCH_WORKERS; ++i) {
+        c->dispatchWorkers[i].head = 0;
+        c->dispatchWorkers[i].tail = 0;
+    }
+    c->dispatchWakeHandler = NULL;
+    c->pDispatchWakeContext = NULL;
+    c->dispatchDroppedCount = 0;
+#endif
+
     InitTimer(&(c->pingTimer));
+    InitTimer(&(c->pingRespTimer));
     InitTimer(&(c->reconnectDelayTimer));
 
     return SUCCESS;
 }
 
-MQTTReturnCode decodePacket(Client *c, uint32_t *value, uint32_t timeout) {
+static void resetRxRing(Client *c) {
+    c->rxRingStart = 0;
+    c->rxRingCount = 0;
+    c->rxDiscardLen = 0;
+    c->rxStream.isActive = 0;
+}
+
+static unsigned char peekRxRing(Client *c, size_t offset) {
+    return c->rxRing[(c->rxRingStart + offset) % MAX_RX_RING_LEN];
+}
+
+/* Moves len buffered bytes to dest, or drops them if dest is NULL */
+static void consumeRxRing(Client *c, unsigned char *dest, size_t len) {
+    size_t firstLen = MAX_RX_RING_LEN - c->rxRingStart;
+
+    if(firstLen > len) {
+        firstLen = len;
+    }
+    if(NULL != dest) {
+        memcpy(dest, c->rxRing + c->rxRingStart, firstLen);
+        memcpy(dest + firstLen, c->rxRing, len - firstLen);
+    }
+
+    c->rxRingStart = (c->rxRingStart + len) % MAX_RX_RING_LEN;
+    c->rxRingCount -= len;
+    if(0 == c->rxRingCount) {
+        /* keep the free space contiguous for the next fill */
+        c->rxRingStart = 0;
+    }
+}
+
+/* Reads as much as the network has ready into the ring, waiting up to timeout
+ * for the first byte. Networks without mqttrecv are asked for exactly wanted bytes.
+ * Returns the number of bytes added, 0 if nothing arrived */
+static size_t fillRxRing(Client *c, size_t wanted, uint32_t timeout) {
+    size_t tail = (c->rxRingStart + c->rxRingCount) % MAX_RX_RING_LEN;
+    size_t space = MAX_RX_RING_LEN - c->rxRingCount;
+    size_t contiguous = MAX_RX_RING_LEN - tail;
+    int ret_val;
+
+    if(contiguous > space) {
+        contiguous = space;
+    }
+    if(0 == contiguous) {
+        return 0;
+    }
+
+    if(NULL != c->networkStack.mqttrecv) {
+        ret_val = c->networkStack.mqttrecv(&(c->networkStack), c->rxRing + tail, (int)contiguous, (int)timeout);
+    } else {
+        if(wanted > contiguous) {
+            wanted = contiguous;
+        }
+        ret_val = c->networkStack.mqttread(&(c->networkStack), c->rxRing + tail, (int)wanted, (int)timeout);
+    }
+
+    /* Errors are reported as nothing read, a network disconnect is caught by keepalive */
+    if(0 >= ret_val) {
+        return 0;
+    }
+
+    c->rxRingCount += (size_t)ret_val;
+    return (size_t)ret_val;
+}
+
+/* Drops the rest of an oversized packet. Returns SUCCESS once it is all gone */
+static MQTTReturnCode discardRxRing(Client *c, Timer *timer) {
+    size_t chunk;
+
+    while(0 < c->rxDiscardLen) {
+        if(0 == c->rxRingCount && 0 == fillRxRing(c, c->rxDiscardLen, (uint32_t)left_ms(timer))) {
+            return MQTT_NOTHING_TO_READ;
+        }
+        chunk = (c->rxRingCount < c->rxDiscardLen) ? c->rxRingCount : c->rxDiscardLen;
+        consumeRxRing(c, NULL, chunk);
+        c->rxDiscardLen -= chunk;
+    }
+
+    return SUCCESS;
+}
+
+/* Waits until the ring holds at least len bytes. Returns MQTT_NOTHING_TO_READ if
+ * the timer runs out first, what did arrive stays buffered */
+static MQTTReturnCode waitForRxRing(Client *c, size_t len, Timer *timer) {
+    while(c->rxRingCount < len) {
+        if(0 == fillRxRing(c, len - c->rxRingCount, (uint32_t)left_ms(timer))) {
+            return MQTT_NOTHING_TO_READ;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/* Index of a received QoS2 message waiting for its PUBREL, MAX_INBOUND_QOS2 if there is none */
+static uint32_t findInboundQoS2(Client *c, uint16_t packetId) {
+    uint32_t i;
+
+    for(i = 0; i < c->inboundQoS2Count; ++i) {
+        if(packetId == c->inboundQoS2Ids[i]) {
+            return i;
+        }
+    }
+    return MAX_INBOUND_QOS2;
+}
+
+/* Starts streaming a PUBLISH that does not fit in readbuf. The topic name is moved
+ * to the start of readbuf, where it stays while the payload is handed out in chunks.
+ * Returns MQTTPACKET_BUFFER_TOO_SHORT if the packet can't be streamed and must be dropped */
+static MQTTReturnCode startStreamedPublish(Client *c, size_t headerLen, uint32_t rem_len, Timer *timer) {
+    MQTTHeader header = {0};
+    size_t topicLen;
+    size_t varHeaderLen;
+    unsigned char packetId[2];
+    MQTTReturnCode rc;
+
+    header.byte = peekRxRing(c, 0);
+    if(PUBLISH != header.bits.type) {
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    }
+
+    rc = waitForRxRing(c, headerLen + 2, timer);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    topicLen = ((size_t)peekRxRing(c, headerLen) << 8) | peekRxRing(c, headerLen + 1);
+    varHeaderLen = 2 + topicLen + ((QOS0 != header.bits.qos) ? 2 : 0);
+    if(topicLen >= c->readBufSize || varHeaderLen > rem_len || headerLen + varHeaderLen > MAX_RX_RING_LEN) {
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    }
+
+    rc = waitForRxRing(c, headerLen + varHeaderLen, timer);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    consumeRxRing(c, NULL, headerLen + 2);
+    consumeRxRing(c, c->readbuf, topicLen);
+    c->rxStream.id = 0;
+    if(QOS0 != header.bits.qos) {
+        consumeRxRing(c, packetId, 2);
+        c->rxStream.id = (uint16_t)((packetId[0] << 8) | packetId[1]);
+    }
+
+    c->rxStream.qos = (QoS)header.bits.qos;
+    c->rxStream.dup = header.bits.dup;
+    c->rxStream.retained = header.bits.retain;
+    c->rxStream.topicLen = (uint16_t)topicLen;
+    c->rxStream.totalLen = rem_len - (uint32_t)varHeaderLen;
+    c->rxStream.offset = 0;
+    c->rxStream.chunkLen = 0;
+    c->rxStream.isDuplicate = (QOS2 == c->rxStream.qos
+                               && MAX_INBOUND_QOS2 != findInboundQoS2(c, c->rxStream.id)) ? 1 : 0;
+
+    /* a new QoS2 message that can't be remembered is dropped unacknowledged, the broker sends it again */
+    if(!hasStreamingHandler(c, (const char *)c->readbuf, topicLen)
+       || (QOS2 == c->rxStream.qos && !c->rxStream.isDuplicate && MAX_INBOUND_QOS2 == c->inboundQoS2Count)) {
+        c->rxDiscardLen = c->rxStream.totalLen;
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    }
+
+    c->rxStream.isActive = 1;
+    return SUCCESS;
+}
+
+/* Places the next payload chunk of the streamed PUBLISH after the topic name in readbuf */
+static MQTTReturnCode readStreamedPublishChunk(Client *c, Timer *timer, uint8_t *packet_type) {
+    size_t chunk = c->rxStream.totalLen - c->rxStream.offset;
+    MQTTReturnCode rc;
+
+    if(chunk > c->readBufSize - c->rxStream.topicLen) {
+        chunk = c->readBufSize - c->rxStream.topicLen;
+    }
+    if(chunk > MAX_RX_RING_LEN) {
+        chunk = MAX_RX_RING_LEN;
+    }
+
+    rc = waitForRxRing(c, chunk, timer);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    consumeRxRing(c, c->readbuf + c->rxStream.topicLen, chunk);
+    c->rxStream.chunkLen = (uint32_t)chunk;
+    *packet_type = PUBLISH;
+
+    return SUCCESS;
+}
+
+/* Decodes the fixed header at the front of the ring without consuming it.
+ * headerLen is set to the fixed header length, or to the bytes needed so far
+ * if MQTT_NOTHING_TO_READ reports that the header is not complete yet */
+MQTTReturnCode decodePacket(Client *c, uint32_t *value, size_t *headerLen) {
     unsigned char i;
     uint32_t multiplier = 1;
-    uint32_t len = 0;
+    size_t len = 1;
     const uint32_t MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
 
-    if(NULL == c || NULL == value) {
+    if(NULL == c || NULL == value || NULL == headerLen) {
         return MQTT_NULL_VALUE_ERROR;
     }
 
     *value = 0;
 
     do {
-        if(++len > MAX_NO_OF_REMAINING_LENGTH_BYTES) {
+        if(len > MAX_NO_OF_REMAINING_LENGTH_BYTES) {
             /* bad data */
             return MQTTPACKET_READ_ERROR;
         }
 
-        if((c->networkStack.mqttread(&(c->networkStack), &i, 1, (int)timeout)) != 1) {
-            /* The value argument is the important value. len is just used temporarily
-             * and never used by the calling function for anything else */
-            return FAILURE;
+        if(c->rxRingCount <= len) {
+            *headerLen = len + 1;
+            return MQTT_NOTHING_TO_READ;
         }
 
+        i = peekRxRing(c, len++);
         *value += ((i & 127) * multiplier);
         multiplier *= 128;
     }while((i & 128) != 0);
 
-    /* The value argument is the important value. len is just used temporarily
-     * and never used by the calling function for anything else */
+    *headerLen = len;
     return SUCCESS;
 }
 
+/* Tells if the ring can be handled without waiting on the network: it holds a whole
+ * packet, or the next part of a packet that is streamed, dropped or too big for the ring */
+static uint8_t hasBufferedPacket(Client *c) {
+    uint32_t rem_len = 0;
+    size_t len = 0;
+    MQTTReturnCode rc;
+
+    if(0 == c->rxRingCount) {
+        return 0;
+    }
+    if(c->rxStream.isActive || 0 < c->rxDiscardLen) {
+        return 1;
+    }
+
+    rc = decodePacket(c, &rem_len, &len);
+    if(MQTT_NOTHING_TO_READ == rc) {
+        return 0;
+    }
+    if(SUCCESS != rc || rem_len >= c->readBufSize || len + rem_len > MAX_RX_RING_LEN) {
+        /* readPacket resyncs a bad stream and copies large packets as they arrive */
+        return 1;
+    }
+
+    return (c->rxRingCount >= len + rem_len) ? 1 : 0;
+}
+
+/* Tells if there is input to handle that polling the socket does not report: a buffered
+ * packet, or bytes the TLS layer decrypted but the last read had no room for */
+static uint8_t hasPendingInput(Client *c) {
+    if(hasBufferedPacket(c)) {
+        return 1;
+    }
+    if(NULL != c->networkStack.hasPending && c->networkStack.hasPending(&(c->networkStack))) {
+        return 1;
+    }
+    return 0;
+}
+
 MQTTReturnCode readPacket(Client *c, Timer *timer, uint8_t *packet_type) {
     MQTTHeader header = {0};
-    uint32_t len = 0;
+    size_t len = 0;
+    size_t total_len = 0;
+    size_t copied = 0;
+    size_t chunk = 0;
     uint32_t rem_len = 0;
-    uint32_t total_bytes_read = 0;
-    uint32_t bytes_to_be_read = 0;
-    int32_t ret_val = 0;
     MQTTReturnCode rc;
 
     if(NULL == c || NULL == timer) {
         return MQTT_NULL_VALUE_ERROR;
     }
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if(1 != c->networkStack.mqttread(&(c->networkStack), c->readbuf, 1, left_ms(timer))) {
-        /* If a network disconnect has occurred it would have been caught by keepalive already.
-         * If nothing is found at this point means there was nothing to read. Not 100% correct,
-         * but the only way to be sure is to pass proper error codes from the network stack
-         * which the mbedtls/openssl implementations do not return */
+    /* finish dropping a packet that did not fit, it may have been cut short by the last timeout */
+    if(SUCCESS != discardRxRing(c, timer)) {
         return MQTT_NOTHING_TO_READ;
     }
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    rc = decodePacket(c, &rem_len, (uint32_t)left_ms(timer));
+    if(c->rxStream.isActive) {
+        return readStreamedPublishChunk(c, timer, packet_type);
+    }
+
+    /* 1. frame the header byte and the remaining length from buffered data.
+     * Several small packets usually arrive in one read. A header still incomplete
+     * when the timer runs out stays buffered for the next call */
+    while(MQTT_NOTHING_TO_READ == (rc = decodePacket(c, &rem_len, &len))) {
+        if(0 == fillRxRing(c, len - c->rxRingCount, (uint32_t)left_ms(timer))) {
+            /* If a network disconnect has occurred it would have been caught by keepalive already.
+             * If nothing is found at this point means there was nothing to read. Not 100% correct,
+             * but the only way to be sure is to pass proper error codes from the network stack
+             * which the mbedtls/openssl implementations do not return */
+            return MQTT_NOTHING_TO_READ;
+        }
+    }
     if(SUCCESS != rc) {
+        /* the stream can't be framed any more, drop what is buffered */
+        resetRxRing(c);
         return rc;
     }
 
-    /* if the buffer is too short then the message will be dropped silently */
-	if (rem_len >= c->readBufSize) {
-		bytes_to_be_read = c->readBufSize;
-		do {
-			ret_val = c->networkStack.mqttread(&(c->networkStack), c->readbuf, bytes_to_be_read, left_ms(timer));
-			if (ret_val > 0) {
-				total_bytes_read += ret_val;
-				if((rem_len - total_bytes_read) >= c->readBufSize){
-					bytes_to_be_read = c->readBufSize;
-				}
-				else{
-					bytes_to_be_read = rem_len - total_bytes_read;
-				}
-			}
-		} while (total_bytes_read < rem_len && ret_val > 0);
-		return MQTTPACKET_BUFFER_TOO_SHORT;
-	}
+    total_len = len + rem_len;
 
-    /* put the original remaining length back into the buffer */
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len);
+    /* a PUBLISH too big for the buffer is streamed to handlers that asked for it,
+     * anything else that is too big is dropped silently */
+    if(rem_len >= c->readBufSize) {
+        rc = startStreamedPublish(c, len, rem_len, timer);
+        if(SUCCESS == rc) {
+            return readStreamedPublishChunk(c, timer, packet_type);
+        }
+        if(MQTT_NOTHING_TO_READ == rc) {
+            return rc;
+        }
+        if(0 == c->rxDiscardLen) {
+            c->rxDiscardLen = total_len;
+        }
+        discardRxRing(c, timer);
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    }
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if(rem_len > 0 && (c->networkStack.mqttread(&(c->networkStack), c->readbuf + len, (int)rem_len, left_ms(timer)) != (int)rem_len)) {
-        return FAILURE;
+    /* 2. copy the packet out once all of it is buffered, so a timeout leaves the stream in sync */
+    if(total_len <= MAX_RX_RING_LEN) {
+        while(c->rxRingCount < total_len) {
+            if(0 == fillRxRing(c, total_len - c->rxRingCount, (uint32_t)left_ms(timer))) {
+                return MQTT_NOTHING_TO_READ;
+            }
+        }
+        consumeRxRing(c, c->readbuf, total_len);
+    } else {
+        /* 3. packets larger than the ring are copied out as they arrive */
+        while(copied < total_len) {
+            if(0 == c->rxRingCount
+               && 0 == fillRxRing(c, total_len - copied, (uint32_t)left_ms(timer))) {
+                c->rxDiscardLen = total_len - copied;
+                return FAILURE;
+            }
+            chunk = c->rxRingCount;
+            if(chunk > total_len - copied) {
+                chunk = total_len - copied;
+            }
+            consumeRxRing(c, c->readbuf + copied, chunk);
+            copied += chunk;
+        }
     }
 
     header.byte = c->readbuf[0];
@@ -219,157 +626,644 @@ MQTTReturnCode readPacket(Client *c, Timer *timer, uint8_t *packet_type) {
     return SUCCESS;
 }
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-char isTopicMatched(char *topicFilter, MQTTString *topicName) {
-    char *curf = NULL;
-    char *curn = NULL;
-    char *curn_end = NULL;
+static const char *topicTrieLevel(Client *c, uint16_t node) {
+    return c->messageHandlers[c->topicTrie[node].ownerHandler].topicFilter
+           + c->topicTrie[node].levelOffset;
+}
 
-    if(NULL == topicFilter || NULL == topicName) {
-        return MQTT_NULL_VALUE_ERROR;
+static const char *topicLevelEnd(const char *level) {
+    while('\0' != *level && '/' != *level) {
+        level++;
     }
+    return level;
+}
 
-    curf = topicFilter;
-    curn = topicName->lenstring.data;
-    curn_end = curn + topicName->lenstring.len;
+static uint16_t findTopicTrieChild(Client *c, uint16_t node, const char *level, size_t levelLen) {
+    uint16_t child;
 
-    while(*curf && (curn < curn_end)) {
-        if(*curn == '/' && *curf != '/') {
-            break;
-        }
-        if(*curf != '+' && *curf != '#' && *curf != *curn) {
-            break;
-        }
-        if(*curf == '+') {
-            /* skip until we meet the next separator, or end of string */
-            char *nextpos = curn + 1;
-            while(nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        } else if(*curf == '#') {
-            /* skip until end of string */
-            curn = curn_end - 1;
+    for(child = c->topicTrie[node].firstChild; TOPIC_TRIE_NONE != child;
+        child = c->topicTrie[child].nextSibling) {
+        if(c->topicTrie[child].levelLen == levelLen
+           && 0 == memcmp(topicTrieLevel(c, child), level, levelLen)) {
+            return child;
         }
+    }
 
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
+    return TOPIC_TRIE_NONE;
 }
 
-MQTTReturnCode deliverMessage(Client *c, MQTTString *topicName, MQTTMessage *message) {
-    uint32_t i;
-    MessageData md;
+/* Returns the node of the last level of topicFilter, or TOPIC_TRIE_NONE if it is not in the trie */
+static uint16_t findTopicTrieNode(Client *c, const char *topicFilter) {
+    const char *level = topicFilter;
+    const char *end;
+    uint16_t node = TOPIC_TRIE_ROOT;
 
-    if(NULL == c || NULL == topicName || NULL == message) {
-        return MQTT_NULL_VALUE_ERROR;
+    while(TOPIC_TRIE_NONE != node) {
+        end = topicLevelEnd(level);
+        node = findTopicTrieChild(c, node, level, (size_t)(end - level));
+        if('\0' == *end) {
+            break;
+        }
+        level = end + 1;
     }
 
-    // we have to find the right message handler - indexed by topic
-    for(i = 0; i < MAX_MESSAGE_HANDLERS; ++i) {
-        if((c->messageHandlers[i].topicFilter != 0)
-           && (MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName))) {
-            if(c->messageHandlers[i].fp != NULL) {
-                NewMessageData(&md, topicName, message, c->messageHandlers[i].applicationHandler);
-                c->messageHandlers[i].fp(&md);
-                return SUCCESS;
-            }
+    return node;
+}
+
+/* Number of nodes that inserting topicFilter would have to allocate */
+static uint32_t topicTrieNodesNeeded(Client *c, const char *topicFilter) {
+    const char *level = topicFilter;
+    const char *end;
+    uint16_t node = TOPIC_TRIE_ROOT;
+    uint32_t needed = 0;
+
+    while(1) {
+        end = topicLevelEnd(level);
+        if(TOPIC_TRIE_NONE != node) {
+            node = findTopicTrieChild(c, node, level, (size_t)(end - level));
+        }
+        if(TOPIC_TRIE_NONE == node) {
+            needed++;
+        }
+        if('\0' == *end) {
+            break;
         }
+        level = end + 1;
     }
 
-    if(NULL != c->defaultMessageHandler) {
-        NewMessageData(&md, topicName, message, NULL);
-        c->defaultMessageHandler(&md);
-        return SUCCESS;
+    return needed;
+}
+
+static uint32_t topicTrieNodesFree(Client *c) {
+    uint32_t i;
+    uint32_t count = 0;
+
+    for(i = 0; i < MAX_TOPIC_TRIE_NODES; i++) {
+        if(!c->topicTrie[i].isUsed) {
+            count++;
+        }
     }
 
-    /* Message handler not found for topic */
-    return FAILURE;
+    return count;
 }
 
-MQTTReturnCode handleDisconnect(Client *c) {
-    MQTTReturnCode rc;
+static uint16_t allocTopicTrieNode(Client *c) {
+    uint16_t i;
 
-    if(NULL == c) {
-        return MQTT_NULL_VALUE_ERROR;
+    for(i = 0; i < MAX_TOPIC_TRIE_NODES; i++) {
+        if(!c->topicTrie[i].isUsed) {
+            c->topicTrie[i].isUsed = 1;
+            c->topicTrie[i].firstChild = TOPIC_TRIE_NONE;
+            c->topicTrie[i].firstHandler = TOPIC_TRIE_NONE;
+            return i;
+        }
     }
 
-    rc = MQTTDisconnect(c);
-    if(rc != SUCCESS){
-    	// If the sendPacket prevents us from sending a disconnect packet then we have to clean the stack
-    	MQTTForceDisconnect(c);
-    }
+    return TOPIC_TRIE_NONE;
+}
 
-    if(NULL != c->disconnectHandler) {
-        c->disconnectHandler();
+/* Frees empty nodes from node up towards the root, returns the first node left in place */
+static uint16_t pruneTopicTrie(Client *c, uint16_t node) {
+    uint16_t parent;
+    uint16_t *link;
+
+    while(TOPIC_TRIE_ROOT != node && TOPIC_TRIE_NONE == c->topicTrie[node].firstHandler
+          && TOPIC_TRIE_NONE == c->topicTrie[node].firstChild) {
+        parent = c->topicTrie[node].parent;
+        link = &(c->topicTrie[parent].firstChild);
+        while(*link != node) {
+            link = &(c->topicTrie[*link].nextSibling);
+        }
+        *link = c->topicTrie[node].nextSibling;
+        c->topicTrie[node].isUsed = 0;
+        node = parent;
     }
 
-    /* Reset to 0 since this was not a manual disconnect */
-    c->wasManuallyDisconnected = 0;
-    return MQTT_NETWORK_DISCONNECTED_ERROR;
+    return node;
 }
 
-MQTTReturnCode MQTTAttemptReconnect(Client *c) {
-    MQTTReturnCode rc = MQTT_ATTEMPTING_RECONNECT;
-
-    if(NULL == c) {
-        return MQTT_NULL_VALUE_ERROR;
+/* Links a registered handler into the trie, creating the missing levels of its filter.
+ * Callers check topicTrieNodesNeeded first, the pool running out here means that check was skipped */
+static MQTTReturnCode insertTopicTrie(Client *c, uint16_t handlerIndex) {
+    const char *topicFilter = c->messageHandlers[handlerIndex].topicFilter;
+    const char *level = topicFilter;
+    const char *end;
+    uint16_t node = TOPIC_TRIE_ROOT;
+    uint16_t child;
+
+    while(1) {
+        end = topicLevelEnd(level);
+        child = findTopicTrieChild(c, node, level, (size_t)(end - level));
+        if(TOPIC_TRIE_NONE == child) {
+            child = allocTopicTrieNode(c);
+            if(TOPIC_TRIE_NONE == child) {
+                pruneTopicTrie(c, node);
+                return MQTT_MAX_SUBSCRIPTIONS_REACHED_ERROR;
+            }
+            c->topicTrie[child].ownerHandler = handlerIndex;
+            c->topicTrie[child].levelOffset = (uint16_t)(level - topicFilter);
+            c->topicTrie[child].levelLen = (uint16_t)(end - level);
+            c->topicTrie[child].parent = node;
+            c->topicTrie[child].nextSibling = c->topicTrie[node].firstChild;
+            c->topicTrie[node].firstChild = child;
+        }
+        node = child;
+        if('\0' == *end) {
+            break;
+        }
+        level = end + 1;
     }
 
-    if(1 == c->isConnected) {
-        return MQTT_NETWORK_ALREADY_CONNECTED_ERROR;
-    }
+    c->messageHandlers[handlerIndex].trieNode = node;
+    c->messageHandlers[handlerIndex].nextHandler = c->topicTrie[node].firstHandler;
+    c->topicTrie[node].firstHandler = handlerIndex;
 
-    /* Ignoring return code. failures expected if network is disconnected */
-    rc = MQTTConnect(c, NULL);
+    return SUCCESS;
+}
 
-    /* If still disconnected handle disconnect */
-    if(0 == c->isConnected) {
-        return MQTT_ATTEMPTING_RECONNECT;
+static void removeTopicTrieHandler(Client *c, uint16_t handlerIndex) {
+    uint16_t node = c->messageHandlers[handlerIndex].trieNode;
+    uint16_t *link;
+    uint16_t itr;
+    uint16_t owner;
+
+    if(TOPIC_TRIE_NONE == node) {
+        return;
     }
 
-    rc = MQTTResubscribe(c);
-    if(SUCCESS != rc) {
-        return rc;
+    link = &(c->topicTrie[node].firstHandler);
+    while(*link != handlerIndex) {
+        link = &(c->messageHandlers[*link].nextHandler);
     }
+    *link = c->messageHandlers[handlerIndex].nextHandler;
+    c->messageHandlers[handlerIndex].trieNode = TOPIC_TRIE_NONE;
+    c->messageHandlers[handlerIndex].nextHandler = TOPIC_TRIE_NONE;
 
-    return MQTT_NETWORK_RECONNECTED;
+    /* Levels left whose text lives in the removed filter borrow it from another
+     * handler below them, every filter in a subtree shares the same prefix */
+    for(itr = pruneTopicTrie(c, node); TOPIC_TRIE_ROOT != itr; itr = c->topicTrie[itr].parent) {
+        if(c->topicTrie[itr].ownerHandler != handlerIndex) {
+            continue;
+        }
+        owner = itr;
+        while(TOPIC_TRIE_NONE == c->topicTrie[owner].firstHandler) {
+            owner = c->topicTrie[owner].firstChild;
+        }
+        c->topicTrie[itr].ownerHandler = c->topicTrie[owner].firstHandler;
+    }
 }
 
-MQTTReturnCode handleReconnect(Client *c) {
-    int8_t isPhysicalLayerConnected = 1;
-    MQTTReturnCode rc = MQTT_NETWORK_RECONNECTED;
+static void collectTopicTrieHandlers(Client *c, uint16_t node, uint16_t *matches, uint32_t *matchCount) {
+    uint16_t handler;
 
-    if(NULL == c) {
-        return MQTT_NULL_VALUE_ERROR;
+    for(handler = c->topicTrie[node].firstHandler; TOPIC_TRIE_NONE != handler;
+        handler = c->messageHandlers[handler].nextHandler) {
+        if(*matchCount < MAX_MESSAGE_HANDLERS) {
+            matches[(*matchCount)++] = handler;
+        }
     }
+}
 
-    if(!expired(&(c->reconnectDelayTimer))) {
-        /* Timer has not expired. Not time to attempt reconnect yet.
-         * Return attempting reconnect */
-        return MQTT_ATTEMPTING_RECONNECT;
+/* Walks the children of node that match the topic level starting at level,
+ * following literal and '+' levels down and collecting handlers of '#' levels */
+static void matchTopicTrie(Client *c, uint16_t node, const char *level, const char *topicEnd,
+                           uint16_t *matches, uint32_t *matchCount) {
+    const char *levelEnd = level;
+    const char *filterLevel;
+    uint16_t child;
+    uint16_t multiLevel;
+
+    while(levelEnd < topicEnd && '/' != *levelEnd) {
+        levelEnd++;
+    }
+
+    for(child = c->topicTrie[node].firstChild; TOPIC_TRIE_NONE != child;
+        child = c->topicTrie[child].nextSibling) {
+        filterLevel = topicTrieLevel(c, child);
+        if(1 == c->topicTrie[child].levelLen && '#' == filterLevel[0]) {
+            collectTopicTrieHandlers(c, child, matches, matchCount);
+            continue;
+        }
+        if(!(1 == c->topicTrie[child].levelLen && '+' == filterLevel[0])
+           && (c->topicTrie[child].levelLen != (size_t)(levelEnd - level)
+               || 0 != memcmp(filterLevel, level, (size_t)(levelEnd - level)))) {
+            continue;
+        }
+        if(levelEnd == topicEnd) {
+            collectTopicTrieHandlers(c, child, matches, matchCount);
+            /* "a/#" also matches the parent level "a" */
+            multiLevel = findTopicTrieChild(c, child, "#", 1);
+            if(TOPIC_TRIE_NONE != multiLevel) {
+                collectTopicTrieHandlers(c, multiLevel, matches, matchCount);
+            }
+        } else {
+            matchTopicTrie(c, child, levelEnd + 1, topicEnd, matches, matchCount);
+        }
+    }
+}
+
+static uint8_t hasStreamingHandler(Client *c, const char *topic, size_t topicLen) {
+    uint32_t i;
+    uint32_t matchCount = 0;
+    uint16_t matches[MAX_MESSAGE_HANDLERS];
+
+    matchTopicTrie(c, TOPIC_TRIE_ROOT, topic, topic + topicLen, matches, &matchCount);
+    for(i = 0; i < matchCount; ++i) {
+        if(c->messageHandlers[matches[i]].isStreaming) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Calls every handler whose filter matches topicName. A chunk of a streamed
+ * message only goes to handlers subscribed with streaming enabled */
+static MQTTReturnCode deliverMessageChunk(Client *c, MQTTString *topicName, MQTTMessage *message,
+                                          uint8_t isStreamed, uint32_t payloadOffset, uint32_t totalPayloadLen) {
+    uint32_t i;
+    uint32_t matchCount = 0;
+    uint16_t matches[MAX_MESSAGE_HANDLERS];
+    uint16_t handler;
+    const char *topic;
+    size_t topicLen;
+    MessageData md;
+
+    if(NULL == c || NULL == topicName || NULL == message) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(NULL != topicName->cstring) {
+        topic = topicName->cstring;
+        topicLen = strlen(topic);
+    } else {
+        topic = topicName->lenstring.data;
+        topicLen = topicName->lenstring.len;
+    }
+
+    /* Find every matching handler before calling any of them, handlers are
+     * allowed to unsubscribe and that changes the trie */
+    matchTopicTrie(c, TOPIC_TRIE_ROOT, topic, topic + topicLen, matches, &matchCount);
+
+    for(i = 0; i < matchCount; ++i) {
+        handler = matches[i];
+        /* skip handlers removed by an earlier callback for this message */
+        if(NULL == c->messageHandlers[handler].topicFilter || NULL == c->messageHandlers[handler].fp) {
+            continue;
+        }
+        if(isStreamed && !c->messageHandlers[handler].isStreaming) {
+            continue;
+        }
+        NewMessageData(&md, topicName, message, c->messageHandlers[handler].applicationHandler);
+        md.client = c;
+        md.payloadOffset = payloadOffset;
+        md.totalPayloadLen = totalPayloadLen;
+        c->messageHandlers[handler].fp(&md);
+    }
+
+    if(0 < matchCount || isStreamed) {
+        return SUCCESS;
+    }
+
+    if(NULL != c->defaultMessageHandler) {
+        NewMessageData(&md, topicName, message, NULL);
+        md.client = c;
+        c->defaultMessageHandler(&md);
+        return SUCCESS;
+    }
+
+    /* Message handler not found for topic */
+    return FAILURE;
+}
+
+/* FNV-1a */
+static uint32_t hashBytes(const char *bytes, size_t len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; ++i) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#if defined(MQTT_DISPATCH)
+/* any stable hash works as long as one topic always picks the same worker */
+static uint32_t dispatchWorkerOf(const char *topic, size_t topicLen) {
+    return hashBytes(topic, topicLen) % MAX_DISPATCH_WORKERS;
+}
+
+/* Copies the message and its matching handlers to a worker queue, never waits for room.
+ * A message on a streaming subscription is delivered on the I/O thread like its chunks, so
+ * such a handler sees every message on one thread and may call the client directly */
+static MQTTReturnCode dispatchMessage(Client *c, MQTTString *topicName, MQTTMessage *message) {
+    uint32_t i;
+    uint32_t matchCount = 0;
+    uint16_t matches[MAX_MESSAGE_HANDLERS];
+    uint16_t handler;
+    const char *topic;
+    size_t topicLen;
+    uint32_t worker;
+    uint32_t payloadLen;
+    struct DispatchWorker *pWorker;
+    struct DispatchedMessage *pMessage;
+
+    if(NULL == c || NULL == topicName) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(NULL != topicName->cstring) {
+        topic = topicName->cstring;
+        topicLen = strlen(topic);
+    } else {
+        topic = topicName->lenstring.data;
+        topicLen = topicName->lenstring.len;
+    }
+
+    matchTopicTrie(c, TOPIC_TRIE_ROOT, topic, topic + topicLen, matches, &matchCount);
+    if(0 == matchCount && NULL == c->defaultMessageHandler) {
+        /* Message handler not found for topic */
+        return FAILURE;
+    }
+
+    /* the publish deserializer only fills the low 32 bits of payloadlen */
+    payloadLen = (uint32_t)message->payloadlen;
+    for(i = 0; i < matchCount; ++i) {
+        if(c->messageHandlers[matches[i]].isStreaming) {
+            message->payloadlen = payloadLen;
+            return deliverMessageChunk(c, topicName, message, 0, 0, payloadLen);
+        }
+    }
+    worker = dispatchWorkerOf(topic, topicLen);
+    pWorker = &(c->dispatchWorkers[worker]);
+    if(MAX_DISPATCHED_MESSAGES == pWorker->head - __atomic_load_n(&(pWorker->tail), __ATOMIC_ACQUIRE)
+       || MAX_DISPATCHED_MESSAGE_LEN < topicLen + payloadLen) {
+        c->dispatchDroppedCount++;
+        return MQTT_DISPATCH_QUEUE_FULL_ERROR;
+    }
+
+    pMessage = &(pWorker->messages[pWorker->head & (MAX_DISPATCHED_MESSAGES - 1)]);
+    pMessage->handlerCount = 0;
+    for(i = 0; i < matchCount; ++i) {
+        handler = matches[i];
+        if(NULL == c->messageHandlers[handler].fp) {
+            continue;
+        }
+        pMessage->handlers[pMessage->handlerCount].fp = c->messageHandlers[handler].fp;
+        pMessage->handlers[pMessage->handlerCount].applicationHandler =
+                c->messageHandlers[handler].applicationHandler;
+        pMessage->handlerCount++;
+    }
+    if(0 == matchCount) {
+        pMessage->handlers[0].fp = c->defaultMessageHandler;
+        pMessage->handlers[0].applicationHandler = NULL;
+        pMessage->handlerCount = 1;
+    }
+
+    pMessage->message = *message;
+    pMessage->topicLen = (uint16_t)topicLen;
+    memcpy(pMessage->buf, topic, topicLen);
+    memcpy(pMessage->buf + topicLen, message->payload, payloadLen);
+    pMessage->message.payload = pMessage->buf + topicLen;
+    pMessage->message.payloadlen = payloadLen;
+
+    __atomic_store_n(&(pWorker->head), pWorker->head + 1, __ATOMIC_RELEASE);
+
+    if(NULL != c->dispatchWakeHandler) {
+        c->dispatchWakeHandler(c->pDispatchWakeContext, worker);
+    }
+
+    return SUCCESS;
+}
+
+MQTTReturnCode MQTTRunDispatchWorker(Client *c, uint32_t worker) {
+    struct DispatchWorker *pWorker;
+    struct DispatchedMessage *pMessage;
+    MQTTString topicName = MQTTString_initializer;
+    MessageData md;
+    uint32_t i;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(MAX_DISPATCH_WORKERS <= worker) {
+        return FAILURE;
+    }
+
+    pWorker = &(c->dispatchWorkers[worker]);
+    while(pWorker->tail != __atomic_load_n(&(pWorker->head), __ATOMIC_ACQUIRE)) {
+        pMessage = &(pWorker->messages[pWorker->tail & (MAX_DISPATCHED_MESSAGES - 1)]);
+        topicName.lenstring.data = (char *)pMessage->buf;
+        topicName.lenstring.len = pMessage->topicLen;
+
+        for(i = 0; i < pMessage->handlerCount; ++i) {
+            NewMessageData(&md, &topicName, &(pMessage->message), pMessage->handlers[i].applicationHandler);
+            md.client = c;
+            md.payloadOffset = 0;
+            md.totalPayloadLen = (uint32_t)pMessage->message.payloadlen;
+            pMessage->handlers[i].fp(&md);
+        }
+
+        /* hands the entry back to the I/O thread */
+        __atomic_store_n(&(pWorker->tail), pWorker->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return SUCCESS;
+}
+
+MQTTReturnCode setDispatchWakeHandler(Client *c, dispatchWakeHandler_t wakeHandler, void *pContext) {
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    c->dispatchWakeHandler = wakeHandler;
+    c->pDispatchWakeContext = pContext;
+    return SUCCESS;
+}
+
+uint32_t MQTTGetDispatchDroppedCount(Client *c) {
+    return c->dispatchDroppedCount;
+}
+#endif
+
+MQTTReturnCode deliverMessage(Client *c, MQTTString *topicName, MQTTMessage *message) {
+    if(NULL == message) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+#if defined(MQTT_DISPATCH)
+    return dispatchMessage(c, topicName, message);
+#else
+    return deliverMessageChunk(c, topicName, message, 0, 0, (uint32_t)message->payloadlen);
+#endif
+}
+
+MQTTReturnCode handleDisconnect(Client *c) {
+    MQTTReturnCode rc;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    rc = MQTTDisconnect(c);
+    if(rc != SUCCESS){
+    	// If the sendPacket prevents us from sending a disconnect packet then we have to clean the stack
+    	MQTTForceDisconnect(c);
+    }
+
+    if(NULL != c->disconnectHandler) {
+        c->disconnectHandler(c);
+    }
+
+    /* Reset to 0 since this was not a manual disconnect */
+    c->wasManuallyDisconnected = 0;
+    return MQTT_NETWORK_DISCONNECTED_ERROR;
+}
+
+MQTTReturnCode MQTTAttemptReconnect(Client *c) {
+    MQTTReturnCode rc = MQTT_ATTEMPTING_RECONNECT;
+    uint32_t subscribesSent = 0;
+    Timer timer;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(1 == c->isConnected) {
+        return MQTT_NETWORK_ALREADY_CONNECTED_ERROR;
+    }
+
+    if(PIPELINED_RECONNECT) {
+        /* Ignoring return code. failures expected if network is disconnected */
+        rc = connectSession(c, NULL, &subscribesSent);
+        if(0 == c->isConnected) {
+            return MQTT_ATTEMPTING_RECONNECT;
+        }
+
+        /* the SUBACKs follow the CONNACK, the whole session is back after one round trip */
+        InitTimer(&timer);
+        countdown_ms(&timer, c->commandTimeoutMs);
+        rc = waitResubscribeAcks(c, subscribesSent, &timer);
+        if(SUCCESS != rc) {
+            return rc;
+        }
+
+        return MQTT_NETWORK_RECONNECTED;
+    }
+
+    /* Ignoring return code. failures expected if network is disconnected */
+    rc = MQTTConnect(c, NULL);
+
+    /* If still disconnected handle disconnect */
+    if(0 == c->isConnected) {
+        return MQTT_ATTEMPTING_RECONNECT;
+    }
+
+    rc = MQTTResubscribe(c);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    return MQTT_NETWORK_RECONNECTED;
+}
+
+static uint8_t hasReconnectGivenUp(Client *c) {
+#if (0 < MAX_RECONNECT_ATTEMPTS)
+    return (MAX_RECONNECT_ATTEMPTS <= c->reconnectAttempts) ? 1 : 0;
+#else
+    /* retries forever */
+    (void)c;
+    return 0;
+#endif
+}
+
+/* xorshift32. The state is seeded from the client id, so devices cut off by the same outage
+ * pick different waits and do not all come back to the broker at once */
+static uint32_t nextReconnectRandom(Client *c) {
+    uint32_t x = c->reconnectRandomState;
+
+    if(0 == x) {
+        if(NULL != c->options.clientID.cstring) {
+            x = hashBytes(c->options.clientID.cstring, strlen(c->options.clientID.cstring));
+        } else {
+            x = hashBytes(c->options.clientID.lenstring.data, (size_t)c->options.clientID.lenstring.len);
+        }
+        x ^= (uint32_t)(uintptr_t)c;
+        if(0 == x) {
+            x = 1;
+        }
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    c->reconnectRandomState = x;
+    return x;
+}
+
+/* Decorrelated jitter: the next wait is drawn between the minimum and three times the last wait */
+static void scheduleReconnect(Client *c) {
+    uint32_t upper = c->currentReconnectWaitInterval * 3;
+
+    if(MAX_RECONNECT_WAIT_INTERVAL < upper || upper < c->currentReconnectWaitInterval) {
+        upper = MAX_RECONNECT_WAIT_INTERVAL;
+    }
+    c->currentReconnectWaitInterval = MIN_RECONNECT_WAIT_INTERVAL
+                                      + (nextReconnectRandom(c) % (upper - MIN_RECONNECT_WAIT_INTERVAL + 1));
+    countdown_ms(&(c->reconnectDelayTimer), c->currentReconnectWaitInterval);
+}
+
+static void startReconnect(Client *c) {
+    c->reconnectAttempts = 0;
+    c->isPhysicalLayerDown = 0;
+    c->currentReconnectWaitInterval = MIN_RECONNECT_WAIT_INTERVAL;
+    scheduleReconnect(c);
+}
+
+MQTTReturnCode handleReconnect(Client *c) {
+    int8_t isPhysicalLayerConnected = 1;
+    MQTTReturnCode rc = MQTT_NETWORK_RECONNECTED;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(hasReconnectGivenUp(c)) {
+        return MQTT_RECONNECT_TIMED_OUT;
     }
 
     if(NULL != c->networkStack.isConnected) {
         isPhysicalLayerConnected = (int8_t)c->networkStack.isConnected(&(c->networkStack));
     }
 
-    if(isPhysicalLayerConnected) {
-        rc = MQTTAttemptReconnect(c);
-        if(MQTT_NETWORK_RECONNECTED == rc) {
-            return MQTT_NETWORK_RECONNECTED;
+    if(!isPhysicalLayerConnected) {
+        /* Attempts would fail anyway and are not counted. Look again after the shortest wait,
+         * the first attempt is made as soon as the link is back */
+        c->isPhysicalLayerDown = 1;
+        if(expired(&(c->reconnectDelayTimer))) {
+            countdown_ms(&(c->reconnectDelayTimer), MIN_RECONNECT_WAIT_INTERVAL);
         }
+        return MQTT_ATTEMPTING_RECONNECT;
     }
 
-    c->currentReconnectWaitInterval *= 2;
+    if(!c->isPhysicalLayerDown && !expired(&(c->reconnectDelayTimer))) {
+        /* Timer has not expired. Not time to attempt reconnect yet.
+         * Return attempting reconnect */
+        return MQTT_ATTEMPTING_RECONNECT;
+    }
+    c->isPhysicalLayerDown = 0;
 
-    if(MAX_RECONNECT_WAIT_INTERVAL < c->currentReconnectWaitInterval) {
+    rc = MQTTAttemptReconnect(c);
+    if(MQTT_NETWORK_RECONNECTED == rc) {
+        return MQTT_NETWORK_RECONNECTED;
+    }
+
+    c->reconnectAttempts++;
+    if(hasReconnectGivenUp(c)) {
         return MQTT_RECONNECT_TIMED_OUT;
     }
-    countdown_ms(&(c->reconnectDelayTimer), c->currentReconnectWaitInterval);
+    scheduleReconnect(c);
     return rc;
 }
 
@@ -386,12 +1280,16 @@ MQTTReturnCode keepalive(Client *c) {
 		return SUCCESS;
 	}
 
-	if(!expired(&c->pingTimer)) {
+    if(c->isPingOutstanding) {
+        /* nothing has been received since the PINGREQ went out */
+        if(expired(&c->pingRespTimer)) {
+            return handleDisconnect(c);
+        }
         return SUCCESS;
     }
 
-    if(c->isPingOutstanding) {
-        return handleDisconnect(c);
+	if(!expired(&c->pingTimer)) {
+        return SUCCESS;
     }
 
     /* there is no ping outstanding - send one */
@@ -411,28 +1309,89 @@ MQTTReturnCode keepalive(Client *c) {
 
     c->isPingOutstanding = 1;
     /* start a timer to wait for PINGRESP from server */
-    countdown(&c->pingTimer, c->keepAliveInterval / 2);
+    countdown_ms(&c->pingRespTimer, PING_RESPONSE_TIMEOUT);
 
     return SUCCESS;
 }
 
+/* Hands the chunk readPacket placed in readbuf to the streaming handlers.
+ * Sets isComplete once the last chunk of the message has been delivered */
+static MQTTReturnCode handleStreamedPublish(Client *c, MQTTMessage *msg, uint8_t *isComplete) {
+    MQTTString topicName = MQTTString_initializer;
+    uint32_t payloadOffset = c->rxStream.offset;
+
+    topicName.lenstring.data = (char *)c->readbuf;
+    topicName.lenstring.len = c->rxStream.topicLen;
+
+    msg->qos = c->rxStream.qos;
+    msg->dup = c->rxStream.dup;
+    msg->retained = c->rxStream.retained;
+    msg->id = c->rxStream.id;
+    msg->payload = c->readbuf + c->rxStream.topicLen;
+    msg->payloadlen = c->rxStream.chunkLen;
+
+    /* advance before calling out, a handler may cycle the client again */
+    c->rxStream.offset += c->rxStream.chunkLen;
+    *isComplete = (c->rxStream.offset >= c->rxStream.totalLen) ? 1 : 0;
+    if(*isComplete) {
+        c->rxStream.isActive = 0;
+    }
+
+    if(c->rxStream.isDuplicate) {
+        return SUCCESS;
+    }
+
+    return deliverMessageChunk(c, &topicName, msg, 1, payloadOffset, c->rxStream.totalLen);
+}
+
 MQTTReturnCode handlePublish(Client *c, Timer *timer) {
     MQTTString topicName;
     MQTTMessage msg;
     MQTTReturnCode rc;
     uint32_t len = 0;
+    uint8_t isComplete = 1;
+    uint8_t isDuplicate = 0;
 
-    rc = MQTTDeserialize_publish((unsigned char *) &msg.dup, (QoS *) &msg.qos, (unsigned char *) &msg.retained,
-                                 (uint16_t *)&msg.id, &topicName,
-                                 (unsigned char **) &msg.payload, (uint32_t *) &msg.payloadlen, c->readbuf,
-                                 c->readBufSize);
-    if(SUCCESS != rc) {
-        return rc;
+    if(c->rxStream.isActive) {
+        rc = handleStreamedPublish(c, &msg, &isComplete);
+        if(SUCCESS != rc || !isComplete) {
+            /* the message is acknowledged after its last chunk */
+            return rc;
+        }
+        isDuplicate = c->rxStream.isDuplicate;
+    } else {
+        rc = MQTTDeserialize_publish((unsigned char *) &msg.dup, (QoS *) &msg.qos, (unsigned char *) &msg.retained,
+                                     (uint16_t *)&msg.id, &topicName,
+                                     (unsigned char **) &msg.payload, (uint32_t *) &msg.payloadlen, c->readbuf,
+                                     c->readBufSize);
+        if(SUCCESS != rc) {
+            return rc;
+        }
+
+        if(QOS2 == msg.qos) {
+            isDuplicate = (MAX_INBOUND_QOS2 != findInboundQoS2(c, msg.id)) ? 1 : 0;
+        }
+
+        if(!isDuplicate) {
+            rc = deliverMessage(c, &topicName, &msg);
+#if defined(MQTT_DISPATCH)
+            if(MQTT_DISPATCH_QUEUE_FULL_ERROR == rc) {
+                /* Dropped and counted rather than waiting on a worker. It is acknowledged all the same,
+                 * a broker only sends an unacknowledged message again after a reconnect */
+                rc = SUCCESS;
+            }
+#endif
+            if(SUCCESS != rc) {
+                return rc;
+            }
+        }
     }
 
-    rc = deliverMessage(c, &topicName, &msg);
-    if(SUCCESS != rc) {
-        return rc;
+    /* Handled once, a copy sent again before the PUBREL is only acknowledged. Past MAX_INBOUND_QOS2
+     * the id can't be remembered: the message is still handled and acknowledged rather than
+     * stalling the connection, and a copy sent again would be handled a second time */
+    if(QOS2 == msg.qos && !isDuplicate && MAX_INBOUND_QOS2 > c->inboundQoS2Count) {
+        c->inboundQoS2Ids[c->inboundQoS2Count++] = msg.id;
     }
 
     if(QOS0 == msg.qos) {
@@ -458,29 +1417,203 @@ MQTTReturnCode handlePublish(Client *c, Timer *timer) {
     return SUCCESS;
 }
 
+/* Sends PUBREL or PUBCOMP, the acks of the QoS2 exchange that carry only a packet id */
+static MQTTReturnCode sendAck(Client *c, unsigned char type, uint16_t packetId, Timer *timer) {
+    MQTTReturnCode rc;
+    uint32_t len;
+
+    rc = MQTTSerialize_ack(c->buf, c->bufSize, type, 0, packetId, &len);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    return sendPacket(c, len, timer);
+}
+
+static uint32_t findInflightPublish(Client *c, uint16_t packetId) {
+    uint32_t i;
+
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        if(NULL != c->inflightPublishes[i].topicName && packetId == c->inflightPublishes[i].message.id) {
+            return i;
+        }
+    }
+    return MAX_INFLIGHT_PUBLISHES;
+}
+
 MQTTReturnCode handlePubrec(Client *c, Timer *timer) {
     uint16_t packet_id;
     unsigned char dup, type;
     MQTTReturnCode rc;
-    uint32_t len;
+    uint32_t i;
+
+    rc = MQTTDeserialize_ack(&type, &dup, &packet_id, c->readbuf, c->readBufSize);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    /* From here on the PUBREL is what gets retried, the publish itself is not sent again */
+    i = findInflightPublish(c, packet_id);
+    if(MAX_INFLIGHT_PUBLISHES != i && QOS2 == c->inflightPublishes[i].message.qos) {
+        c->inflightPublishes[i].isReleased = 1;
+        c->inflightPublishes[i].retryCount = 0;
+        countdown_ms(&(c->inflightPublishes[i].retryTimer), c->commandTimeoutMs);
+    }
+
+    /* send the PUBREL packet */
+    return sendAck(c, PUBREL, packet_id, timer);
+}
+
+MQTTReturnCode handlePubrel(Client *c, Timer *timer) {
+    uint16_t packet_id;
+    unsigned char dup, type;
+    MQTTReturnCode rc;
+    uint32_t i;
 
     rc = MQTTDeserialize_ack(&type, &dup, &packet_id, c->readbuf, c->readBufSize);
     if(SUCCESS != rc) {
         return rc;
     }
 
-    rc = MQTTSerialize_ack(c->buf, c->bufSize, PUBREL, 0, packet_id, &len);
+    /* the broker won't send this message again, forget its id */
+    i = findInboundQoS2(c, packet_id);
+    if(MAX_INBOUND_QOS2 != i) {
+        c->inboundQoS2Ids[i] = c->inboundQoS2Ids[--c->inboundQoS2Count];
+    }
+
+    /* A PUBREL sent again after our PUBCOMP got lost is answered the same way */
+    return sendAck(c, PUBCOMP, packet_id, timer);
+}
+
+/* Frees the in-flight slot before calling the completion handler so that
+ * the handler can publish again from its own context */
+static void completeInflightPublish(Client *c, uint32_t index, MQTTReturnCode rc) {
+    PublishCompletionData cd;
+    publishCompletionHandler_t completionHandler = c->inflightPublishes[index].completionHandler;
+
+    cd.packetId = c->inflightPublishes[index].message.id;
+    cd.rc = rc;
+    cd.applicationHandler = c->inflightPublishes[index].applicationHandler;
+    cd.pApplicationContext = c->inflightPublishes[index].pApplicationContext;
+
+    c->inflightPublishes[index].topicName = NULL;
+
+    if(NULL != completionHandler) {
+        completionHandler(&cd);
+    }
+}
+
+MQTTReturnCode handlePuback(Client *c) {
+    uint16_t packet_id;
+    unsigned char dup, type;
+    uint32_t i;
+    MQTTReturnCode rc;
+
+    rc = MQTTDeserialize_ack(&type, &dup, &packet_id, c->readbuf, c->readBufSize);
     if(SUCCESS != rc) {
         return rc;
     }
 
-    /* send the PUBREL packet */
-    rc = sendPacket(c, len, timer);
+    /* PUBACKs can arrive in any order, match them by packet id */
+    i = findInflightPublish(c, packet_id);
+    if(MAX_INFLIGHT_PUBLISHES != i) {
+        completeInflightPublish(c, i, SUCCESS);
+    }
+
+    /* An unknown packet id is a late PUBACK for a publish that already timed out. Ignore it */
+    return SUCCESS;
+}
+
+MQTTReturnCode handlePubcomp(Client *c) {
+    uint16_t packet_id;
+    unsigned char dup, type;
+    uint32_t i;
+    MQTTReturnCode rc;
+
+    rc = MQTTDeserialize_ack(&type, &dup, &packet_id, c->readbuf, c->readBufSize);
     if(SUCCESS != rc) {
-        /* there was a problem */
         return rc;
     }
 
+    i = findInflightPublish(c, packet_id);
+    if(MAX_INFLIGHT_PUBLISHES != i && c->inflightPublishes[i].isReleased) {
+        completeInflightPublish(c, i, SUCCESS);
+    }
+
+    return SUCCESS;
+}
+
+/* A payload that fits behind the header is copied into the TX buffer so the packet
+ * leaves in one network write. Only larger payloads are written from the caller's
+ * memory, after the header, topic and packet id */
+static MQTTReturnCode sendPublish(Client *c, const char *topicName, MQTTMessage *message,
+                                  uint8_t dup, Timer *timer) {
+    MQTTString topic = MQTTString_initializer;
+    NetworkIOVector vectors[2];
+    uint32_t len = 0;
+    MQTTReturnCode rc;
+
+    topic.cstring = (char *)topicName;
+
+    if(NULL == message->payload && 0 < message->payloadlen) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    rc = MQTTSerialize_publishHeader(c->buf, c->bufSize, dup, message->qos, message->retained, message->id,
+              topic, message->payloadlen, &len);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    if(len + message->payloadlen < c->bufSize) {
+        memcpy(c->buf + len, message->payload, message->payloadlen);
+        return sendPacket(c, len + (uint32_t)message->payloadlen, timer);
+    }
+
+    vectors[0].pBuffer = c->buf;
+    vectors[0].len = (int)len;
+    vectors[1].pBuffer = (unsigned char *)message->payload;
+    vectors[1].len = (int)message->payloadlen;
+
+    return sendVectors(c, vectors, 2, timer);
+}
+
+MQTTReturnCode retryInflightPublishes(Client *c) {
+    Timer timer;
+    uint32_t i;
+    MQTTReturnCode rc = SUCCESS;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        if(NULL == c->inflightPublishes[i].topicName || !expired(&(c->inflightPublishes[i].retryTimer))) {
+            continue;
+        }
+
+        if(MAX_PUBLISH_RETRIES <= c->inflightPublishes[i].retryCount) {
+            completeInflightPublish(c, i, MQTT_PUBLISH_ACK_TIMEOUT_ERROR);
+            continue;
+        }
+
+        InitTimer(&timer);
+        countdown_ms(&timer, c->commandTimeoutMs);
+        if(c->inflightPublishes[i].isReleased) {
+            rc = sendAck(c, PUBREL, c->inflightPublishes[i].message.id, &timer);
+        } else {
+            rc = sendPublish(c, c->inflightPublishes[i].topicName, &(c->inflightPublishes[i].message), 1, &timer);
+        }
+        if(SUCCESS != rc) {
+            /* Keep the entry, it is sent again once the connection is usable */
+            return rc;
+        }
+
+        c->inflightPublishes[i].message.dup = 1;
+        c->inflightPublishes[i].retryCount++;
+        countdown_ms(&(c->inflightPublishes[i].retryTimer), c->commandTimeoutMs);
+    }
+
     return SUCCESS;
 }
 
@@ -500,9 +1633,15 @@ MQTTReturnCode cycle(Client *c, Timer *timer, uint8_t *packet_type) {
         return rc;
     }
 
+    /* any packet from the broker shows the connection is alive, not only a PINGRESP */
+    c->isPingOutstanding = 0;
+
     switch(*packet_type) {
+        case PUBACK: {
+            rc = handlePuback(c);
+            break;
+        }
         case CONNACK:
-        case PUBACK:
         case SUBACK:
         case UNSUBACK:
             break;
@@ -514,13 +1653,16 @@ MQTTReturnCode cycle(Client *c, Timer *timer, uint8_t *packet_type) {
             rc = handlePubrec(c, timer);
             break;
         }
-        case PUBCOMP:
+        case PUBREL: {
+            rc = handlePubrel(c, timer);
             break;
-        case PINGRESP: {
-            c->isPingOutstanding = 0;
-            countdown(&c->pingTimer, c->keepAliveInterval);
+        }
+        case PUBCOMP: {
+            rc = handlePubcomp(c);
             break;
         }
+        case PINGRESP:
+            break;
         default: {
             /* Either unknown packet type or Failure occurred
              * Should not happen */
@@ -532,6 +1674,166 @@ MQTTReturnCode cycle(Client *c, Timer *timer, uint8_t *packet_type) {
     return rc;
 }
 
+/* A publish is copied to the offline queue while auto-reconnect brings the connection back,
+ * and behind the kept ones until all of them went out */
+static uint8_t isPublishKeptOffline(Client *c) {
+#if defined(MQTT_OFFLINE_QUEUE)
+    if(!c->isConnected) {
+        return (c->isAutoReconnectEnabled && !c->wasManuallyDisconnected) ? 1 : 0;
+    }
+    return (0 < c->offlinePublishCount) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+#if defined(MQTT_TASK)
+/* Bounded multi-producer queue: a slot's sequence tells whose turn it is. A producer claims
+ * position pos by moving the head on while the slot still reads pos, fills the slot and then
+ * publishes it by storing pos + 1. The I/O thread runs the slot once it reads tail + 1 and hands
+ * it back to producers for the next lap by storing tail + MAX_QUEUED_COMMANDS */
+MQTTReturnCode MQTTEnqueueCommand(Client *c, const MQTTCommand *command) {
+    struct QueuedCommand *slot;
+    uint32_t pos;
+    int32_t diff;
+
+    if(NULL == c || NULL == command || NULL == command->topic) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    pos = __atomic_load_n(&(c->commandQueueHead), __ATOMIC_RELAXED);
+    for(;;) {
+        slot = &(c->commandQueue[pos & (MAX_QUEUED_COMMANDS - 1)]);
+        diff = (int32_t)(__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) - pos);
+        if(0 == diff) {
+            if(__atomic_compare_exchange_n(&(c->commandQueueHead), &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* another producer took it, pos now holds the current head */
+        } else if(0 > diff) {
+            /* the slot of the previous lap has not been run yet */
+            return MQTT_COMMAND_QUEUE_FULL_ERROR;
+        } else {
+            pos = __atomic_load_n(&(c->commandQueueHead), __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->command = *command;
+    __atomic_store_n(&(slot->sequence), pos + 1, __ATOMIC_RELEASE);
+
+    if(NULL != c->commandWakeHandler) {
+        c->commandWakeHandler(c);
+    }
+
+    return SUCCESS;
+}
+
+MQTTReturnCode setCommandWakeHandler(Client *c, commandWakeHandler_t wakeHandler) {
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    c->commandWakeHandler = wakeHandler;
+    return SUCCESS;
+}
+
+/* Only called on the I/O thread, the one consumer */
+static struct QueuedCommand *peekQueuedCommand(Client *c) {
+    uint32_t pos = c->commandQueueTail;
+    struct QueuedCommand *slot = &(c->commandQueue[pos & (MAX_QUEUED_COMMANDS - 1)]);
+
+    if(0 > (int32_t)(__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) - (pos + 1))) {
+        return NULL;
+    }
+    return slot;
+}
+
+static uint8_t hasQueuedCommand(Client *c) {
+    return (NULL != peekQueuedCommand(c)) ? 1 : 0;
+}
+
+static void completeQueuedCommand(MQTTCommand *command, uint16_t packetId, MQTTReturnCode rc) {
+    PublishCompletionData cd;
+
+    if(NULL == command->completionHandler) {
+        return;
+    }
+    cd.packetId = packetId;
+    cd.rc = rc;
+    cd.applicationHandler = command->completionApplicationHandler;
+    cd.pApplicationContext = command->pApplicationContext;
+    command->completionHandler(&cd);
+}
+
+static void runQueuedCommands(Client *c) {
+    struct QueuedCommand *slot;
+    MQTTCommand *command;
+    MQTTReturnCode rc;
+
+    while(NULL != (slot = peekQueuedCommand(c))) {
+        command = &(slot->command);
+
+        if(MQTT_COMMAND_PUBLISH == command->type && isPublishKeptOffline(c)) {
+            /* copied like a direct publish, the completion handler only learns that it was kept */
+            rc = MQTTPublishWithPriority(c, command->topic, &(command->message), command->priority);
+            completeQueuedCommand(command, 0, rc);
+        } else if(0 == c->isConnected) {
+            rc = MQTT_NETWORK_DISCONNECTED_ERROR;
+            completeQueuedCommand(command, 0, rc);
+        } else if(MQTT_COMMAND_PUBLISH == command->type && QOS0 != command->message.qos) {
+            /* the completion handler is called once the PUBACK or PUBCOMP arrives */
+            rc = MQTTPublishAsync(c, command->topic, &(command->message), command->completionHandler,
+                                  command->completionApplicationHandler, command->pApplicationContext);
+            if(MQTT_MAX_INFLIGHT_PUBLISHES_REACHED_ERROR == rc) {
+                /* keep it, and everything queued behind it, until a PUBACK frees an entry */
+                return;
+            }
+            if(SUCCESS != rc) {
+                completeQueuedCommand(command, 0, rc);
+            }
+        } else if(MQTT_COMMAND_PUBLISH == command->type) {
+            rc = MQTTPublish(c, command->topic, &(command->message));
+            completeQueuedCommand(command, command->message.id, rc);
+        } else if(MQTT_COMMAND_SUBSCRIBE == command->type) {
+            rc = MQTTSubscribeMany(c, 1, &(command->topic), &(command->qos), command->messageHandler,
+                                   &(command->applicationHandler), &(command->isStreaming));
+            completeQueuedCommand(command, 0, rc);
+        } else {
+            rc = MQTTUnsubscribe(c, command->topic);
+            completeQueuedCommand(command, 0, rc);
+        }
+
+        __atomic_store_n(&(slot->sequence), c->commandQueueTail + MAX_QUEUED_COMMANDS, __ATOMIC_RELEASE);
+        c->commandQueueTail++;
+    }
+}
+#endif
+
+/* Runs the timed work of a connected client: keepalive pings and publish retries.
+ * A lost connection starts the reconnect back off when auto-reconnect is enabled */
+static MQTTReturnCode handleTimers(Client *c) {
+    MQTTReturnCode rc = keepalive(c);
+
+    if(SUCCESS == rc && c->isConnected) {
+        /* A failed retransmission is caught by keepalive on the next call */
+        retryInflightPublishes(c);
+#if defined(MQTT_OFFLINE_QUEUE)
+        drainOfflinePublishes(c);
+#endif
+    }
+    if(MQTT_NETWORK_DISCONNECTED_ERROR == rc && 1 == c->isAutoReconnectEnabled) {
+        startReconnect(c);
+        c->counterNetworkDisconnected++;
+        /* Depending on timer values, it is possible that yield timer has expired
+         * Set to rc to attempting reconnect to inform client that autoreconnect
+         * attempt has started */
+        rc = MQTT_ATTEMPTING_RECONNECT;
+    }
+
+    return rc;
+}
+
 MQTTReturnCode MQTTYield(Client *c, uint32_t timeout_ms) {
     MQTTReturnCode rc = SUCCESS;
     Timer timer;
@@ -555,12 +1857,14 @@ MQTTReturnCode MQTTYield(Client *c, uint32_t timeout_ms) {
     countdown_ms(&timer, timeout_ms);
 
     while(!expired(&timer)) {
+#if defined(MQTT_TASK)
+        runQueuedCommands(c);
+#endif
         if(0 == c->isConnected) {
-            if(MAX_RECONNECT_WAIT_INTERVAL < c->currentReconnectWaitInterval) {
-                rc = MQTT_RECONNECT_TIMED_OUT;
+            rc = handleReconnect(c);
+            if(MQTT_RECONNECT_TIMED_OUT == rc) {
                 break;
             }
-            rc = handleReconnect(c);
             /* Network reconnect attempted, check if yield timer expired before
              * doing anything else */
             continue;
@@ -568,24 +1872,124 @@ MQTTReturnCode MQTTYield(Client *c, uint32_t timeout_ms) {
 
         rc = cycle(c, &timer, &packet_type);
         if(SUCCESS != rc) {
-            break;
-        }
-
-        rc = keepalive(c);
-        if(MQTT_NETWORK_DISCONNECTED_ERROR == rc && 1 == c->isAutoReconnectEnabled) {
-            c->currentReconnectWaitInterval = MIN_RECONNECT_WAIT_INTERVAL;
-            countdown_ms(&(c->reconnectDelayTimer), c->currentReconnectWaitInterval);
-            c->counterNetworkDisconnected++;
-            /* Depending on timer values, it is possible that yield timer has expired
-             * Set to rc to attempting reconnect to inform client that autoreconnect
-             * attempt has started */
-            rc = MQTT_ATTEMPTING_RECONNECT;
-        } else if(SUCCESS != rc) {
-            break;
+            break;
+        }
+
+        rc = handleTimers(c);
+        if(SUCCESS != rc && MQTT_ATTEMPTING_RECONNECT != rc) {
+            break;
+        }
+    }
+
+    return rc;
+}
+
+int MQTTGetPollFd(Client *c) {
+    if(NULL == c || 0 == c->isConnected) {
+        return -1;
+    }
+
+    /* only the port knows where its socket is, my_socket may hold a TLS context instead */
+    if(NULL == c->networkStack.getPollFd) {
+        return -1;
+    }
+    return c->networkStack.getPollFd(&(c->networkStack));
+}
+
+int32_t MQTTNextDeadlineMs(Client *c) {
+    int32_t deadline = -1;
+    int32_t left;
+    uint32_t i;
+
+    if(NULL == c) {
+        return -1;
+    }
+
+    if(0 == c->isConnected) {
+        if(1 == c->wasManuallyDisconnected || 0 == c->isAutoReconnectEnabled || hasReconnectGivenUp(c)) {
+            /* nothing will happen until the application acts */
+            return -1;
+        }
+        return left_ms(&(c->reconnectDelayTimer));
+    }
+
+    if(hasPendingInput(c)) {
+        return 0;
+    }
+
+#if defined(MQTT_TASK)
+    if(hasQueuedCommand(c)) {
+        return 0;
+    }
+#endif
+
+    if(0 != c->keepAliveInterval) {
+        deadline = left_ms(c->isPingOutstanding ? &(c->pingRespTimer) : &(c->pingTimer));
+    }
+
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        if(NULL == c->inflightPublishes[i].topicName) {
+            continue;
+        }
+        left = left_ms(&(c->inflightPublishes[i].retryTimer));
+        if(-1 == deadline || left < deadline) {
+            deadline = left;
+        }
+    }
+
+#if defined(MQTT_OFFLINE_QUEUE)
+    if(c->offlineInflightCount < c->offlinePublishCount) {
+        left = left_ms(&(c->offlineDrainTimer));
+        if(-1 == deadline || left < deadline) {
+            deadline = left;
+        }
+    }
+#endif
+
+    return deadline;
+}
+
+MQTTReturnCode MQTTProcess(Client *c, uint8_t events) {
+    MQTTReturnCode rc;
+    Timer timer;
+    uint8_t packet_type;
+    uint8_t isReadable;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(0 == c->isConnected && 1 == c->wasManuallyDisconnected) {
+        return MQTT_NETWORK_MANUALLY_DISCONNECTED;
+    }
+
+    if(0 == c->isConnected && 0 == c->isAutoReconnectEnabled) {
+        return MQTT_NETWORK_DISCONNECTED_ERROR;
+    }
+
+#if defined(MQTT_TASK)
+    runQueuedCommands(c);
+#endif
+
+    if(0 == c->isConnected) {
+        /* does nothing until the reconnect delay has passed */
+        return handleReconnect(c);
+    }
+
+    /* read what the socket signalled, then whatever that read left buffered in the ring or the TLS layer.
+     * The timer only bounds the rest of a packet that has started to arrive and the acks sent back */
+    isReadable = (events & MQTT_EVENT_READABLE) ? 1 : 0;
+    while(c->isConnected && (isReadable || hasPendingInput(c))) {
+        isReadable = 0;
+        InitTimer(&timer);
+        countdown_ms(&timer, c->commandTimeoutMs);
+        rc = cycle(c, &timer, &packet_type);
+        if(SUCCESS != rc) {
+            return rc;
         }
     }
 
-    return rc;
+    return handleTimers(c);
 }
 
 /* only used in single-threaded mode where one command at a time is in process */
@@ -612,7 +2016,20 @@ MQTTReturnCode waitfor(Client *c, uint8_t packet_type, Timer *timer) {
     return rc;
 }
 
-MQTTReturnCode MQTTConnect(Client *c, MQTTPacket_connectData *options) {
+static void abortPipelinedConnect(Client *c, uint32_t *pSubscribesSent) {
+    if(NULL == pSubscribesSent) {
+        return;
+    }
+    /* SUBSCRIBEs already written are void, the broker drops them with the connection */
+    *pSubscribesSent = 0;
+    c->resubscribeCount = 0;
+    c->networkStack.disconnect(&(c->networkStack));
+}
+
+/* With pSubscribesSent the SUBSCRIBEs restoring the message handlers are written together with
+ * the CONNECT, MQTT 3.1.1 lets a client send them before the CONNACK. If the broker does not
+ * accept the connection the network is closed again, the handlers are left as they were */
+static MQTTReturnCode connectSession(Client *c, MQTTPacket_connectData *options, uint32_t *pSubscribesSent) {
     Timer connect_timer;
     MQTTReturnCode connack_rc = FAILURE;
     char sessionPresent = 0;
@@ -636,7 +2053,13 @@ MQTTReturnCode MQTTConnect(Client *c, MQTTPacket_connectData *options) {
         copyMQTTConnectData(&(c->options), options);
     }
 
-    c->networkInitHandler(&(c->networkStack));
+    /* Network ports without a partial read leave mqttrecv untouched */
+    c->networkStack.mqttrecv = NULL;
+    if(0 != c->networkInitHandler(&(c->networkStack))) {
+        /* Network port could not set up its per-connection state */
+        return FAILURE;
+    }
+    resetRxRing(c);
     rc = c->networkStack.connect(&(c->networkStack), c->tlsConnectParams);
     if(0 != rc) {
         /* TLS Connect failed, return error */
@@ -650,27 +2073,40 @@ MQTTReturnCode MQTTConnect(Client *c, MQTTPacket_connectData *options) {
     }
 
     /* send the connect packet */
-    rc = sendPacket(c, len, &connect_timer);
+    if(NULL == pSubscribesSent) {
+        rc = sendPacket(c, len, &connect_timer);
+    } else {
+        rc = writeResubscribe(c, len, &connect_timer, pSubscribesSent);
+    }
     if(SUCCESS != rc) {
+        abortPipelinedConnect(c, pSubscribesSent);
         return rc;
     }
 
     /* this will be a blocking call, wait for the CONNACK */
     rc = waitfor(c, CONNACK, &connect_timer);
     if(SUCCESS != rc) {
+        abortPipelinedConnect(c, pSubscribesSent);
         return rc;
     }
 
     /* Received CONNACK, check the return code */
     rc = MQTTDeserialize_connack((unsigned char *)&sessionPresent, &connack_rc, c->readbuf, c->readBufSize);
     if(SUCCESS != rc) {
+        abortPipelinedConnect(c, pSubscribesSent);
         return rc;
     }
 
     if(MQTT_CONNACK_CONNECTION_ACCEPTED != connack_rc) {
+        abortPipelinedConnect(c, pSubscribesSent);
         return connack_rc;
     }
 
+    if(!sessionPresent) {
+        /* the broker kept no session, it won't send the PUBRELs still expected */
+        c->inboundQoS2Count = 0;
+    }
+
     c->isConnected = 1;
     c->wasManuallyDisconnected = 0;
     c->isPingOutstanding = 0;
@@ -679,6 +2115,10 @@ MQTTReturnCode MQTTConnect(Client *c, MQTTPacket_connectData *options) {
     return SUCCESS;
 }
 
+MQTTReturnCode MQTTConnect(Client *c, MQTTPacket_connectData *options) {
+    return connectSession(c, options, NULL);
+}
+
 /* Return MAX_MESSAGE_HANDLERS value if no free index is available */
 uint32_t GetFreeMessageHandlerIndex(Client *c) {
     uint32_t itr;
@@ -691,41 +2131,62 @@ uint32_t GetFreeMessageHandlerIndex(Client *c) {
     return itr;
 }
 
-MQTTReturnCode MQTTSubscribe(Client *c, const char *topicFilter, QoS qos,
-                  messageHandler messageHandler, pApplicationHandler_t applicationHandler) {
+MQTTReturnCode MQTTSubscribeMany(Client *c, uint32_t count, const char *topicFilters[], QoS qos[],
+                                 messageHandler messageHandler, pApplicationHandler_t applicationHandlers[],
+                                 const uint8_t isStreaming[]) {
     MQTTReturnCode rc = FAILURE;
     Timer timer;
     uint32_t len = 0;
-    uint32_t indexOfFreeMessageHandler;
-    uint32_t count = 0;
-    QoS grantedQoS[3] = {QOS0, QOS0, QOS0};
+    uint32_t grantedCount = 0;
+    uint32_t itr = 0;
+    uint32_t freeCount = 0;
+    uint32_t trieNodesNeeded = 0;
+    uint32_t indexOfFreeMessageHandler[MAX_FILTERS_PER_SUBSCRIBE];
+    QoS grantedQoS[MAX_FILTERS_PER_SUBSCRIBE];
+    MQTTString topics[MAX_FILTERS_PER_SUBSCRIBE];
+    MQTTString emptyTopic = MQTTString_initializer;
     uint16_t packetId;
-    MQTTString topic = MQTTString_initializer;
 
-    if(NULL == c || NULL == topicFilter
-       || NULL == messageHandler || NULL == applicationHandler) {
+    if(NULL == c || NULL == topicFilters || NULL == qos
+       || NULL == messageHandler || NULL == applicationHandlers || 0 == count) {
         return MQTT_NULL_VALUE_ERROR;
     }
 
+    if(MAX_FILTERS_PER_SUBSCRIBE < count || MAX_MESSAGE_HANDLERS < count) {
+        return MQTT_MAX_SUBSCRIPTIONS_REACHED_ERROR;
+    }
+
+    for(itr = 0; itr < count; itr++) {
+        if(NULL == topicFilters[itr] || NULL == applicationHandlers[itr]) {
+            return MQTT_NULL_VALUE_ERROR;
+        }
+        topics[itr] = emptyTopic;
+        topics[itr].cstring = (char *)topicFilters[itr];
+        trieNodesNeeded += topicTrieNodesNeeded(c, topicFilters[itr]);
+    }
+
     if(!c->isConnected) {
         return MQTT_NETWORK_DISCONNECTED_ERROR;
     }
 
-    topic.cstring = (char *)topicFilter;
+    /* Reserve a handler slot for every filter before anything goes on the wire */
+    for(itr = 0; itr < MAX_MESSAGE_HANDLERS && freeCount < count; itr++) {
+        if(NULL == c->messageHandlers[itr].topicFilter) {
+            indexOfFreeMessageHandler[freeCount++] = itr;
+        }
+    }
+    if(freeCount < count || topicTrieNodesFree(c) < trieNodesNeeded) {
+        return MQTT_MAX_SUBSCRIPTIONS_REACHED_ERROR;
+    }
 
     InitTimer(&timer);
     countdown_ms(&timer, c->commandTimeoutMs);
 
-    rc = MQTTSerialize_subscribe(c->buf, c->bufSize, 0, getNextPacketId(c), 1, &topic, &qos, &len);
+    rc = MQTTSerialize_subscribe(c->buf, c->bufSize, 0, getNextRequestPacketId(c), count, topics, qos, &len);
     if(SUCCESS != rc) {
         return rc;
     }
 
-    indexOfFreeMessageHandler = GetFreeMessageHandlerIndex(c);
-    if(MAX_MESSAGE_HANDLERS <= indexOfFreeMessageHandler) {
-        return MQTT_MAX_SUBSCRIPTIONS_REACHED_ERROR;
-    }
-
     /* send the subscribe packet */
     rc = sendPacket(c, len, &timer);
     if(SUCCESS != rc) {
@@ -738,75 +2199,173 @@ MQTTReturnCode MQTTSubscribe(Client *c, const char *topicFilter, QoS qos,
         return rc;
     }
 
-    /* Granted QoS can be 0, 1 or 2 */
-    rc = MQTTDeserialize_suback(&packetId, 1, &count, grantedQoS, c->readbuf, c->readBufSize);
+    /* Granted QoS can be 0, 1, 2 or 0x80 for each filter, in request order */
+    rc = MQTTDeserialize_suback(&packetId, count, &grantedCount, grantedQoS, c->readbuf, c->readBufSize);
     if(SUCCESS != rc) {
         return rc;
     }
 
-    c->messageHandlers[indexOfFreeMessageHandler].topicFilter =
-            topicFilter;
-    c->messageHandlers[indexOfFreeMessageHandler].fp = messageHandler;
-    c->messageHandlers[indexOfFreeMessageHandler].applicationHandler =
-            applicationHandler;
-    c->messageHandlers[indexOfFreeMessageHandler].qos = qos;
+    if(grantedCount != count) {
+        return FAILURE;
+    }
 
-    return SUCCESS;
+    /* Filters the broker accepted are registered even if another one in the
+     * same packet was rejected, the caller decides whether to unsubscribe them */
+    for(itr = 0; itr < count; itr++) {
+        if(MQTT_SUBACK_FAILURE == (uint8_t)grantedQoS[itr]) {
+            rc = MQTT_SUBSCRIBE_REJECTED_ERROR;
+            continue;
+        }
+        c->messageHandlers[indexOfFreeMessageHandler[itr]].topicFilter = topicFilters[itr];
+        c->messageHandlers[indexOfFreeMessageHandler[itr]].fp = messageHandler;
+        c->messageHandlers[indexOfFreeMessageHandler[itr]].applicationHandler =
+                applicationHandlers[itr];
+        c->messageHandlers[indexOfFreeMessageHandler[itr]].qos = qos[itr];
+        c->messageHandlers[indexOfFreeMessageHandler[itr]].isStreaming =
+                (NULL != isStreaming) ? isStreaming[itr] : 0;
+        insertTopicTrie(c, (uint16_t)indexOfFreeMessageHandler[itr]);
+    }
+
+    return rc;
 }
 
-MQTTReturnCode MQTTResubscribe(Client *c) {
+MQTTReturnCode MQTTSubscribe(Client *c, const char *topicFilter, QoS qos,
+                  messageHandler messageHandler, pApplicationHandler_t applicationHandler) {
+    return MQTTSubscribeMany(c, 1, &topicFilter, &qos, messageHandler, &applicationHandler, NULL);
+}
+
+/* Serializes SUBSCRIBEs for every message handler after the pendingLen bytes already in buf,
+ * putting as many filters in each as the send buffer holds. The buffer is written out whenever
+ * the next packet does not fit, so everything goes out in as few writes as possible */
+static MQTTReturnCode writeResubscribe(Client *c, uint32_t pendingLen, Timer *timer, uint32_t *pPacketsSent) {
     MQTTReturnCode rc = FAILURE;
-    Timer timer;
     uint32_t len = 0;
-    uint32_t count = 0;
-    QoS grantedQoS[3] = {QOS0, QOS0, QOS0};
+    MQTTString topics[MAX_FILTERS_PER_SUBSCRIBE];
+    MQTTString emptyTopic = MQTTString_initializer;
+    QoS qos[MAX_FILTERS_PER_SUBSCRIBE];
+    uint32_t batchCount = 0;
+    uint32_t packetLen = 0;
+    uint32_t handler = 0;
     uint16_t packetId;
-    uint32_t existingSubCount = 0;
-    uint32_t itr = 0;
-
-    if(NULL == c) {
-        return MQTT_NULL_VALUE_ERROR;
-    }
-
-    if(!c->isConnected) {
-        return MQTT_NETWORK_DISCONNECTED_ERROR;
-    }
 
-    existingSubCount = GetFreeMessageHandlerIndex(c);
+    *pPacketsSent = 0;
+    c->resubscribeCount = 0;
 
-    for(itr = 0; itr < existingSubCount; itr++) {
-        MQTTString topic = MQTTString_initializer;
-        topic.cstring = (char *)c->messageHandlers[itr].topicFilter;
+    while(handler < MAX_MESSAGE_HANDLERS) {
+        batchCount = 0;
+        while(handler < MAX_MESSAGE_HANDLERS && batchCount < MAX_FILTERS_PER_SUBSCRIBE) {
+            if(NULL == c->messageHandlers[handler].topicFilter) {
+                handler++;
+                continue;
+            }
+            topics[batchCount] = emptyTopic;
+            topics[batchCount].cstring = (char *)c->messageHandlers[handler].topicFilter;
+            qos[batchCount] = c->messageHandlers[handler].qos;
+            if(0 < batchCount
+               && MQTTPacket_len(MQTTSerialize_GetSubscribePacketLength(batchCount + 1, topics)) > c->bufSize) {
+                /* goes first in the next packet */
+                break;
+            }
+            batchCount++;
+            handler++;
+        }
 
-        InitTimer(&timer);
-        countdown_ms(&timer, c->commandTimeoutMs);
+        if(0 == batchCount) {
+            break;
+        }
 
-        rc = MQTTSerialize_subscribe(c->buf, c->bufSize, 0, getNextPacketId(c), 1,
-                                     &topic, &(c->messageHandlers[itr].qos), &len);
-        if(SUCCESS != rc) {
-            return rc;
+        packetLen = (uint32_t)MQTTPacket_len(MQTTSerialize_GetSubscribePacketLength(batchCount, topics));
+        if(0 < pendingLen && pendingLen + packetLen >= c->bufSize) {
+            rc = sendPacket(c, pendingLen, timer);
+            if(SUCCESS != rc) {
+                return rc;
+            }
+            pendingLen = 0;
         }
 
-        /* send the subscribe packet */
-        rc = sendPacket(c, len, &timer);
+        packetId = getNextPacketId(c);
+        rc = MQTTSerialize_subscribe(c->buf + pendingLen, c->bufSize - pendingLen, 0, packetId,
+                                     batchCount, topics, qos, &len);
         if(SUCCESS != rc) {
             return rc;
         }
+        /* held until its SUBACK, the next packet must not get the same id */
+        c->resubscribeIds[c->resubscribeCount++] = packetId;
+        pendingLen += len;
+        (*pPacketsSent)++;
+    }
+
+    if(0 < pendingLen) {
+        return sendPacket(c, pendingLen, timer);
+    }
+
+    return SUCCESS;
+}
+
+/* Matches the SUBACKs to the SUBSCRIBEs of writeResubscribe by packet id, a late SUBACK of an
+ * earlier request is skipped. The ids are let go once all arrived or the wait is given up */
+static MQTTReturnCode waitResubscribeAcks(Client *c, uint32_t packetsSent, Timer *timer) {
+    MQTTReturnCode rc = SUCCESS;
+    MQTTReturnCode ackRc = SUCCESS;
+    uint32_t count = 0;
+    QoS grantedQoS[MAX_FILTERS_PER_SUBSCRIBE];
+    uint16_t packetId;
+    uint32_t itr = 0;
 
+    while(0 < packetsSent) {
         /* wait for suback */
-        rc = waitfor(c, SUBACK, &timer);
-        if(SUCCESS != rc) {
-            return rc;
+        ackRc = waitfor(c, SUBACK, timer);
+        if(SUCCESS != ackRc) {
+            break;
         }
 
-        /* Granted QoS can be 0, 1 or 2 */
-        rc = MQTTDeserialize_suback(&packetId, 1, &count, grantedQoS, c->readbuf, c->readBufSize);
-        if(SUCCESS != rc) {
-            return rc;
+        ackRc = MQTTDeserialize_suback(&packetId, MAX_FILTERS_PER_SUBSCRIBE, &count, grantedQoS,
+                                       c->readbuf, c->readBufSize);
+        if(SUCCESS != ackRc) {
+            break;
+        }
+
+        itr = findResubscribeId(c, packetId);
+        if(c->resubscribeCount == itr) {
+            continue;
+        }
+        c->resubscribeIds[itr] = c->resubscribeIds[--c->resubscribeCount];
+
+        for(itr = 0; itr < count; itr++) {
+            if(MQTT_SUBACK_FAILURE == (uint8_t)grantedQoS[itr]) {
+                rc = MQTT_SUBSCRIBE_REJECTED_ERROR;
+            }
         }
+        packetsSent--;
     }
 
-    return SUCCESS;
+    c->resubscribeCount = 0;
+    return (SUCCESS != ackRc) ? ackRc : rc;
+}
+
+MQTTReturnCode MQTTResubscribe(Client *c) {
+    MQTTReturnCode rc = FAILURE;
+    Timer timer;
+    uint32_t packetsSent = 0;
+
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    if(!c->isConnected) {
+        return MQTT_NETWORK_DISCONNECTED_ERROR;
+    }
+
+    InitTimer(&timer);
+    countdown_ms(&timer, c->commandTimeoutMs);
+
+    /* every packet is sent before waiting so the whole set costs a single round trip */
+    rc = writeResubscribe(c, 0, &timer, &packetsSent);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    return waitResubscribeAcks(c, packetsSent, &timer);
 }
 
 MQTTReturnCode MQTTUnsubscribe(Client *c, const char *topicFilter) {
@@ -814,7 +2373,9 @@ MQTTReturnCode MQTTUnsubscribe(Client *c, const char *topicFilter) {
     Timer timer;
     MQTTString topic = MQTTString_initializer;
     uint32_t len = 0;
-    uint32_t i = 0;
+    uint16_t handler;
+    uint16_t nextHandler;
+    uint16_t node;
     uint16_t packet_id;
 
     if(NULL == c || NULL == topicFilter) {
@@ -830,7 +2391,7 @@ MQTTReturnCode MQTTUnsubscribe(Client *c, const char *topicFilter) {
     InitTimer(&timer);
     countdown_ms(&timer, c->commandTimeoutMs);
 
-    rc = MQTTSerialize_unsubscribe(c->buf, c->bufSize, 0, getNextPacketId(c), 1, &topic, &len);
+    rc = MQTTSerialize_unsubscribe(c->buf, c->bufSize, 0, getNextRequestPacketId(c), 1, &topic, &len);
     if(SUCCESS != rc) {
         return rc;
     }
@@ -851,35 +2412,51 @@ MQTTReturnCode MQTTUnsubscribe(Client *c, const char *topicFilter) {
         return rc;
     }
 
-    /* Remove from message handler array */
-    for(i = 0; i < MAX_MESSAGE_HANDLERS; ++i) {
-        if(c->messageHandlers[i].topicFilter != NULL &&
-            (strcmp(c->messageHandlers[i].topicFilter, topicFilter) == 0)) {
-            c->messageHandlers[i].topicFilter = NULL;
-            /* We don't want to break here, if the same topic is registered
-             * with 2 callbacks. Unlikely scenario */
+    /* Remove from message handler array, every handler on the node has the
+     * same filter. The same topic may be registered with 2 callbacks */
+    node = findTopicTrieNode(c, topicFilter);
+    if(TOPIC_TRIE_NONE != node) {
+        handler = c->topicTrie[node].firstHandler;
+        while(TOPIC_TRIE_NONE != handler) {
+            nextHandler = c->messageHandlers[handler].nextHandler;
+            removeTopicTrieHandler(c, handler);
+            c->messageHandlers[handler].topicFilter = NULL;
+            handler = nextHandler;
         }
     }
 
     return SUCCESS;
 }
 
-MQTTReturnCode MQTTPublish(Client *c, const char *topicName, MQTTMessage *message) {
+static void blockingPublishCompleted(PublishCompletionData *cd) {
+    BlockingPublishState *state = (BlockingPublishState *)cd->pApplicationContext;
+    state->rc = cd->rc;
+    state->isComplete = 1;
+}
+
+/* Return MAX_INFLIGHT_PUBLISHES value if no free index is available */
+static uint32_t GetFreeInflightPublishIndex(Client *c) {
+    uint32_t itr;
+    for(itr = 0; itr < MAX_INFLIGHT_PUBLISHES; itr++) {
+        if(c->inflightPublishes[itr].topicName == NULL) {
+            break;
+        }
+    }
+
+    return itr;
+}
+
+MQTTReturnCode MQTTPublishAsync(Client *c, const char *topicName, MQTTMessage *message,
+                                publishCompletionHandler_t completionHandler,
+                                pApplicationHandler_t applicationHandler, void *pApplicationContext) {
     Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    uint32_t len = 0;
-    uint8_t waitForAck = 0;
-    uint8_t packetType = PUBACK;
-    uint16_t packet_id;
-    unsigned char dup, type;
+    uint32_t indexOfFreeInflightPublish;
     MQTTReturnCode rc = FAILURE;
 
     if(NULL == c || NULL == topicName || NULL == message) {
         return MQTT_NULL_VALUE_ERROR;
     }
 
-    topic.cstring = (char *)topicName;
-
     if(!c->isConnected) {
         return MQTT_NETWORK_DISCONNECTED_ERROR;
     }
@@ -887,41 +2464,228 @@ MQTTReturnCode MQTTPublish(Client *c, const char *topicName, MQTTMessage *messag
     InitTimer(&timer);
     countdown_ms(&timer, c->commandTimeoutMs);
 
-    if(QOS1 == message->qos || QOS2 == message->qos) {
-        message->id = getNextPacketId(c);
-        waitForAck = 1;
-        if(QOS2 == message->qos) {
-            packetType = PUBCOMP;
+    if(QOS0 == message->qos) {
+        rc = sendPublish(c, topicName, message, 0, &timer);
+        if(SUCCESS == rc && NULL != completionHandler) {
+            PublishCompletionData cd;
+            cd.packetId = 0;
+            cd.rc = SUCCESS;
+            cd.applicationHandler = applicationHandler;
+            cd.pApplicationContext = pApplicationContext;
+            completionHandler(&cd);
         }
+        return rc;
     }
 
-    rc = MQTTSerialize_publish(c->buf, c->bufSize, 0, message->qos, message->retained, message->id,
-              topic, (unsigned char*)message->payload, message->payloadlen, &len);
-    if(SUCCESS != rc) {
-        return rc;
+    indexOfFreeInflightPublish = GetFreeInflightPublishIndex(c);
+    if(MAX_INFLIGHT_PUBLISHES <= indexOfFreeInflightPublish) {
+        return MQTT_MAX_INFLIGHT_PUBLISHES_REACHED_ERROR;
     }
 
+    message->id = getNextPacketId(c);
+    message->dup = 0;
+
     /* send the publish packet */
-    rc = sendPacket(c, len, &timer);
+    rc = sendPublish(c, topicName, message, 0, &timer);
     if(SUCCESS != rc) {
         return rc;
     }
 
-    /* Wait for ack if QoS1 or QoS2 */
-    if(1 == waitForAck) {
-        rc = waitfor(c, packetType, &timer);
-        if(SUCCESS != rc) {
-            return rc;
+    /* The PUBACK, or PUBREC and PUBCOMP, are matched in cycle(). Topic and payload are referenced, not copied */
+    c->inflightPublishes[indexOfFreeInflightPublish].message = *message;
+    c->inflightPublishes[indexOfFreeInflightPublish].completionHandler = completionHandler;
+    c->inflightPublishes[indexOfFreeInflightPublish].applicationHandler = applicationHandler;
+    c->inflightPublishes[indexOfFreeInflightPublish].pApplicationContext = pApplicationContext;
+    c->inflightPublishes[indexOfFreeInflightPublish].retryCount = 0;
+    c->inflightPublishes[indexOfFreeInflightPublish].isReleased = 0;
+    InitTimer(&(c->inflightPublishes[indexOfFreeInflightPublish].retryTimer));
+    countdown_ms(&(c->inflightPublishes[indexOfFreeInflightPublish].retryTimer), c->commandTimeoutMs);
+    c->inflightPublishes[indexOfFreeInflightPublish].topicName = topicName;
+
+    return SUCCESS;
+}
+
+#if defined(MQTT_OFFLINE_QUEUE)
+/* Frees the slot at position pos of the send order */
+static void removeOfflinePublish(Client *c, uint32_t pos) {
+    c->offlinePublishes[c->offlineOrder[pos]].isUsed = 0;
+    c->offlinePublishCount--;
+    memmove(&(c->offlineOrder[pos]), &(c->offlineOrder[pos + 1]),
+            (c->offlinePublishCount - pos) * sizeof(c->offlineOrder[0]));
+}
+
+/* Copies a publish made while disconnected, making room by the drop policy when full */
+static MQTTReturnCode storeOfflinePublish(Client *c, const char *topicName, MQTTMessage *message,
+                                          uint8_t priority) {
+    struct OfflinePublish *pStored;
+    size_t topicLen = strlen(topicName);
+    uint32_t victim;
+    uint32_t slot;
+    uint32_t i;
+
+    /* the topic is kept NUL terminated, followed by the payload */
+    if(MAX_OFFLINE_MESSAGE_LEN < topicLen + 1 + message->payloadlen) {
+        return BUFFER_OVERFLOW;
+    }
+
+    if(MAX_OFFLINE_PUBLISHES == c->offlinePublishCount) {
+        /* a publish waiting for its ack is referenced by the in-flight window, it can't give way */
+        victim = c->offlineInflightCount;
+        if(c->offlinePublishCount == victim) {
+            c->offlineDroppedCount++;
+            return MQTT_OFFLINE_QUEUE_FULL_ERROR;
+        }
+        if(MQTT_OFFLINE_DROP_LOWEST_PRIORITY == c->offlineDropPolicy) {
+            for(i = victim + 1; i < c->offlinePublishCount; ++i) {
+                if(c->offlinePublishes[c->offlineOrder[i]].priority
+                   < c->offlinePublishes[c->offlineOrder[victim]].priority) {
+                    victim = i;
+                }
+            }
+            if(priority < c->offlinePublishes[c->offlineOrder[victim]].priority) {
+                c->offlineDroppedCount++;
+                return MQTT_OFFLINE_QUEUE_FULL_ERROR;
+            }
         }
+        removeOfflinePublish(c, victim);
+        c->offlineDroppedCount++;
+    }
 
-        rc = MQTTDeserialize_ack(&type, &dup, &packet_id, c->readbuf, c->readBufSize);
-        if(SUCCESS != rc) {
-            return rc;
+    slot = 0;
+    while(c->offlinePublishes[slot].isUsed) {
+        slot++;
+    }
+
+    pStored = &(c->offlinePublishes[slot]);
+    pStored->message = *message;
+    pStored->message.payload = NULL;
+    pStored->priority = priority;
+    pStored->isUsed = 1;
+    pStored->topicLen = (uint16_t)topicLen;
+    memcpy(pStored->buf, topicName, topicLen + 1);
+    memcpy(pStored->buf + topicLen + 1, message->payload, message->payloadlen);
+    c->offlineOrder[c->offlinePublishCount++] = slot;
+
+    return MQTT_PUBLISH_STORED_OFFLINE;
+}
+
+/* A kept QoS1/QoS2 publish is let go once the in-flight window is done with it,
+ * counted as dropped when it ran out of retries */
+static void offlinePublishCompleted(PublishCompletionData *cd) {
+    Client *c = (Client *)cd->pApplicationContext;
+    uint32_t pos;
+
+    for(pos = 0; pos < c->offlineInflightCount; ++pos) {
+        if(cd->packetId == c->offlinePublishes[c->offlineOrder[pos]].message.id) {
+            if(SUCCESS != cd->rc) {
+                c->offlineDroppedCount++;
+            }
+            c->offlineInflightCount--;
+            removeOfflinePublish(c, pos);
+            return;
         }
     }
+}
 
-    return SUCCESS;
+/* Sends the oldest kept publish not sent yet once the drain interval has passed, without
+ * waiting for its ack. QoS1/QoS2 ones go through the in-flight window, which retries them
+ * from the slot. A QoS0 one is let go once it went out, or when the broker connection is
+ * up and it still failed */
+static void drainOfflinePublishes(Client *c) {
+    struct OfflinePublish *pStored;
+    MQTTMessage message;
+    MQTTReturnCode rc;
+
+    if(c->offlineInflightCount == c->offlinePublishCount || !expired(&(c->offlineDrainTimer))) {
+        return;
+    }
+    countdown_ms(&(c->offlineDrainTimer), OFFLINE_DRAIN_INTERVAL);
+
+    pStored = &(c->offlinePublishes[c->offlineOrder[c->offlineInflightCount]]);
+    message = pStored->message;
+    message.payload = pStored->buf + pStored->topicLen + 1;
+
+    rc = MQTTPublishAsync(c, (const char *)pStored->buf, &message, offlinePublishCompleted, NULL, c);
+    if(MQTT_MAX_INFLIGHT_PUBLISHES_REACHED_ERROR == rc || !c->isConnected) {
+        /* kept for the next interval or the next reconnect */
+        return;
+    }
+    if(SUCCESS == rc && QOS0 != message.qos) {
+        pStored->message.id = message.id;
+        c->offlineInflightCount++;
+        return;
+    }
+    if(SUCCESS != rc) {
+        c->offlineDroppedCount++;
+    }
+    removeOfflinePublish(c, c->offlineInflightCount);
+}
+#endif
+
+MQTTReturnCode MQTTPublish(Client *c, const char *topicName, MQTTMessage *message) {
+    return MQTTPublishWithPriority(c, topicName, message, 0);
+}
+
+MQTTReturnCode MQTTPublishWithPriority(Client *c, const char *topicName, MQTTMessage *message, uint8_t priority) {
+    if(NULL == c || NULL == topicName || NULL == message) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+#if defined(MQTT_OFFLINE_QUEUE)
+    if(isPublishKeptOffline(c)) {
+        /* once connected, a newer document must not be overwritten by an older kept one */
+        return storeOfflinePublish(c, topicName, message, priority);
+    }
+#endif
+
+    if(!c->isConnected) {
+        return MQTT_NETWORK_DISCONNECTED_ERROR;
+    }
+
+    return sendPublishNow(c, topicName, message);
+}
+
+/* Publishes on the connected client and waits for the PUBACK or PUBCOMP of QoS1 and QoS2 */
+static MQTTReturnCode sendPublishNow(Client *c, const char *topicName, MQTTMessage *message) {
+    Timer timer;
+    uint32_t i;
+    uint8_t read_packet_type = 0;
+    BlockingPublishState state = {0, FAILURE};
+    MQTTReturnCode rc = FAILURE;
+
+    InitTimer(&timer);
+    countdown_ms(&timer, c->commandTimeoutMs);
+
+    if(QOS0 == message->qos) {
+        return MQTTPublishAsync(c, topicName, message, NULL, NULL, NULL);
+    }
+
+    /* Go through the in-flight window so that only our own PUBACK or PUBCOMP completes the call */
+    rc = MQTTPublishAsync(c, topicName, message, blockingPublishCompleted, NULL, &state);
+    if(SUCCESS != rc) {
+        return rc;
+    }
+
+    while(!state.isComplete && !expired(&timer)) {
+        rc = cycle(c, &timer, &read_packet_type);
+        if(MQTT_NETWORK_DISCONNECTED_ERROR == rc) {
+            break;
+        }
+    }
+
+    if(state.isComplete) {
+        return state.rc;
+    }
+
+    /* Timed out. The caller owns topic and payload, so drop the entry instead of retrying it */
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        if(&state == c->inflightPublishes[i].pApplicationContext) {
+            c->inflightPublishes[i].topicName = NULL;
+        }
+    }
+    return (MQTT_NETWORK_DISCONNECTED_ERROR == rc) ? rc : FAILURE;
 }
+
 /**
  * This is for the case when the sendPacket Fails.
  */
@@ -1011,6 +2775,15 @@ MQTTReturnCode setAutoReconnectEnabled(Client *c, uint8_t value) {
     return SUCCESS;
 }
 
+MQTTReturnCode setOfflineDropPolicy(Client *c, MQTTOfflineDropPolicy policy) {
+    if(NULL == c) {
+        return MQTT_NULL_VALUE_ERROR;
+    }
+
+    c->offlineDropPolicy = policy;
+    return SUCCESS;
+}
+
 uint32_t MQTTGetNetworkDisconnectedCount(Client *c) {
     return c->counterNetworkDisconnected;
 }
@@ -1018,3 +2791,40 @@ uint32_t MQTTGetNetworkDisconnectedCount(Client *c) {
 void MQTTResetNetworkDisconnectedCount(Client *c) {
     c->counterNetworkDisconnected = 0;
 }
+
+uint32_t MQTTGetInflightPublishCount(Client *c) {
+    uint32_t i;
+    uint32_t count = 0;
+
+    if(NULL == c) {
+        return 0;
+    }
+
+    for(i = 0; i < MAX_INFLIGHT_PUBLISHES; ++i) {
+        if(NULL != c->inflightPublishes[i].topicName) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+uint32_t MQTTGetOfflinePublishCount(Client *c) {
+    if(NULL == c) {
+        return 0;
+    }
+
+#if defined(MQTT_OFFLINE_QUEUE)
+    return c->offlinePublishCount;
+#else
+    return 0;
+#endif
+}
+
+uint32_t MQTTGetOfflineDroppedCount(Client *c) {
+    if(NULL == c) {
+        return 0;
+    }
+
+    return c->offlineDroppedCount;
+}
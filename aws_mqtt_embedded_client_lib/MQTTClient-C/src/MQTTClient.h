@@ -36,49 +36,173 @@
 
 #define MAX_PACKET_ID 65535
 #define MAX_MESSAGE_HANDLERS AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS
+#define MAX_TOPIC_TRIE_NODES AWS_IOT_MQTT_MAX_TOPIC_TRIE_NODES
+#define MAX_FILTERS_PER_SUBSCRIBE 16
+#define MAX_RX_RING_LEN AWS_IOT_MQTT_RX_RING_LEN
+#define TOPIC_TRIE_NONE 0xFFFF
+#define TOPIC_TRIE_ROOT 0
+#define MAX_INFLIGHT_PUBLISHES AWS_IOT_MQTT_MAX_INFLIGHT_PUBLISHES
+#define MAX_PUBLISH_RETRIES AWS_IOT_MQTT_MAX_PUBLISH_RETRIES
+#define MAX_INBOUND_QOS2 AWS_IOT_MQTT_MAX_INBOUND_QOS2
+#define MAX_QUEUED_COMMANDS AWS_IOT_MQTT_COMMAND_QUEUE_LEN
+#define PING_RESPONSE_TIMEOUT AWS_IOT_MQTT_PING_RESPONSE_TIMEOUT_MS
+
+#if defined(MQTT_TASK) && (0 != (MAX_QUEUED_COMMANDS & (MAX_QUEUED_COMMANDS - 1)))
+#error "AWS_IOT_MQTT_COMMAND_QUEUE_LEN must be a power of two"
+#endif
+
+#if defined(MQTT_TASK) && (0 < AWS_IOT_MQTT_DISPATCH_WORKERS)
+#define MQTT_DISPATCH
+#define MAX_DISPATCH_WORKERS AWS_IOT_MQTT_DISPATCH_WORKERS
+#define MAX_DISPATCHED_MESSAGES AWS_IOT_MQTT_DISPATCH_QUEUE_LEN
+#define MAX_DISPATCHED_MESSAGE_LEN AWS_IOT_MQTT_RX_BUF_LEN
+#if (0 != (MAX_DISPATCHED_MESSAGES & (MAX_DISPATCHED_MESSAGES - 1)))
+#error "AWS_IOT_MQTT_DISPATCH_QUEUE_LEN must be a power of two"
+#endif
+#endif
+
+#if (0 < AWS_IOT_MQTT_OFFLINE_QUEUE_LEN)
+#define MQTT_OFFLINE_QUEUE
+#define MAX_OFFLINE_PUBLISHES AWS_IOT_MQTT_OFFLINE_QUEUE_LEN
+#define MAX_OFFLINE_MESSAGE_LEN AWS_IOT_MQTT_OFFLINE_MESSAGE_LEN
+#define OFFLINE_DRAIN_INTERVAL AWS_IOT_MQTT_OFFLINE_DRAIN_INTERVAL_MS
+#endif
 
 #define MIN_RECONNECT_WAIT_INTERVAL AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL
 #define MAX_RECONNECT_WAIT_INTERVAL AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL
+#define MAX_RECONNECT_ATTEMPTS AWS_IOT_MQTT_MAX_RECONNECT_ATTEMPTS
+#define PIPELINED_RECONNECT AWS_IOT_MQTT_PIPELINED_RECONNECT
+
+#if (MAX_RECONNECT_WAIT_INTERVAL < MIN_RECONNECT_WAIT_INTERVAL)
+#error "AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL must not be below AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL"
+#endif
 
 void NewTimer(Timer *);
 
 typedef struct Client Client;
 
 typedef struct MessageData MessageData;
+typedef struct PublishCompletionData PublishCompletionData;
 
 typedef void (*messageHandler)(MessageData *);
+typedef void (*publishCompletionHandler_t)(PublishCompletionData *);
 typedef void (*pApplicationHandler_t)(void);
-typedef void (*disconnectHandler_t)(void);
+typedef void (*disconnectHandler_t)(Client *);
 typedef int (*networkInitHandler_t)(Network *);
 
+/* Which publish gives way when the offline queue is full */
+typedef enum {
+    MQTT_OFFLINE_DROP_OLDEST,               /* the oldest kept publish */
+    MQTT_OFFLINE_DROP_LOWEST_PRIORITY       /* the oldest of the lowest priority, the new one if it is lower still */
+} MQTTOfflineDropPolicy;
+
 struct MessageData {
     MQTTMessage *message;
     MQTTString *topicName;
     pApplicationHandler_t applicationHandler;
+    Client *client;             /* client the message was received on */
+    uint32_t payloadOffset;     /* position of message->payload within the whole payload */
+    uint32_t totalPayloadLen;   /* larger than message->payloadlen when the payload is streamed in chunks */
+};
+
+struct PublishCompletionData {
+    uint16_t packetId;
+    MQTTReturnCode rc;
+    pApplicationHandler_t applicationHandler;
+    void *pApplicationContext;
 };
 
 MQTTReturnCode MQTTConnect(Client *c, MQTTPacket_connectData *options);
 MQTTReturnCode MQTTPublish (Client *, const char *, MQTTMessage *);
+/* While auto-reconnect is bringing the connection back, a publish is copied to the offline queue
+ * and MQTT_PUBLISH_STORED_OFFLINE is returned. Kept publishes are sent in order after the reconnect,
+ * a publish made while some are still kept is queued behind them the same way */
+MQTTReturnCode MQTTPublishWithPriority(Client *c, const char *topicName, MQTTMessage *message, uint8_t priority);
+MQTTReturnCode MQTTPublishAsync(Client *c, const char *topicName, MQTTMessage *message,
+                                publishCompletionHandler_t completionHandler,
+                                pApplicationHandler_t applicationHandler, void *pApplicationContext);
 MQTTReturnCode MQTTSubscribe(Client *c, const char *topicFilter, QoS qos,
                              messageHandler messageHandler, pApplicationHandler_t applicationHandler);
+MQTTReturnCode MQTTSubscribeMany(Client *c, uint32_t count, const char *topicFilters[], QoS qos[],
+                                 messageHandler messageHandler, pApplicationHandler_t applicationHandlers[],
+                                 const uint8_t isStreaming[]);
 MQTTReturnCode MQTTResubscribe(Client *c);
 MQTTReturnCode MQTTUnsubscribe(Client *c, const char *topicFilter);
 MQTTReturnCode MQTTDisconnect (Client *);
 MQTTReturnCode MQTTYield (Client *, uint32_t);
 MQTTReturnCode MQTTAttemptReconnect(Client *c);
 
+/* Non-blocking alternative to MQTTYield for host event loops: wait until MQTTGetPollFd
+ * is readable or MQTTNextDeadlineMs has passed, then let MQTTProcess do the work that is due */
+#define MQTT_EVENT_READABLE 0x01
+
+int MQTTGetPollFd(Client *c);
+int32_t MQTTNextDeadlineMs(Client *c);
+MQTTReturnCode MQTTProcess(Client *c, uint8_t events);
+
+#if defined(MQTT_TASK)
+/* Threaded mode: one I/O thread calls MQTTYield or MQTTProcess and is the only one to touch
+ * the connection. Any other thread hands publish/subscribe work to it through a lock-free queue
+ * and learns the outcome from the completion handler, called on the I/O thread. A publish run
+ * when MQTTPublishWithPriority would keep it offline is copied there and completed at once
+ * with MQTT_PUBLISH_STORED_OFFLINE */
+typedef enum {
+    MQTT_COMMAND_PUBLISH,
+    MQTT_COMMAND_SUBSCRIBE,
+    MQTT_COMMAND_UNSUBSCRIBE
+} MQTTCommandType;
+
+typedef struct {
+    MQTTCommandType type;
+    const char *topic;                                  /* topic name or filter, must stay valid until completion */
+    MQTTMessage message;                                /* PUBLISH, the payload must stay valid until completion */
+    uint8_t priority;                                   /* PUBLISH, see MQTTPublishWithPriority */
+    QoS qos;                                            /* SUBSCRIBE */
+    uint8_t isStreaming;                                /* SUBSCRIBE */
+    messageHandler messageHandler;                      /* SUBSCRIBE */
+    pApplicationHandler_t applicationHandler;           /* SUBSCRIBE, handed to messageHandler */
+    publishCompletionHandler_t completionHandler;       /* may be NULL, packetId is 0 for (UN)SUBSCRIBE */
+    pApplicationHandler_t completionApplicationHandler;
+    void *pApplicationContext;
+} MQTTCommand;
+
+typedef void (*commandWakeHandler_t)(Client *);
+
+MQTTReturnCode MQTTEnqueueCommand(Client *c, const MQTTCommand *command);
+MQTTReturnCode setCommandWakeHandler(Client *c, commandWakeHandler_t wakeHandler);
+#endif
+
+#if defined(MQTT_DISPATCH)
+/* Received messages are copied to the queue of one of MAX_DISPATCH_WORKERS workers, picked by a
+ * hash of the topic, and their handlers are called from MQTTRunDispatchWorker on the thread that
+ * serves that worker. A handler running there must use MQTTEnqueueCommand to publish or
+ * (un)subscribe. Subscriptions with streaming enabled, like the Thing Shadow ones, have all their
+ * messages and chunks delivered on the I/O thread instead. When a worker queue is full
+ * the message is dropped, counted by MQTTGetDispatchDroppedCount and still acknowledged:
+ * the broker does not send it again */
+typedef void (*dispatchWakeHandler_t)(void *pContext, uint32_t worker);
+
+MQTTReturnCode MQTTRunDispatchWorker(Client *c, uint32_t worker);
+MQTTReturnCode setDispatchWakeHandler(Client *c, dispatchWakeHandler_t wakeHandler, void *pContext);
+uint32_t MQTTGetDispatchDroppedCount(Client *c);
+#endif
+
 uint8_t MQTTIsConnected(Client *);
 uint8_t MQTTIsAutoReconnectEnabled(Client *c);
 
 void setDefaultMessageHandler(Client *, messageHandler);
 MQTTReturnCode setDisconnectHandler(Client *c, disconnectHandler_t disconnectHandler);
 MQTTReturnCode setAutoReconnectEnabled(Client *c, uint8_t value);
+MQTTReturnCode setOfflineDropPolicy(Client *c, MQTTOfflineDropPolicy policy);
 
 MQTTReturnCode MQTTClient(Client *, uint32_t, unsigned char *, size_t, unsigned char *,
                           size_t, uint8_t, networkInitHandler_t, TLSConnectParams *);
 
 uint32_t MQTTGetNetworkDisconnectedCount(Client *c);
 void MQTTResetNetworkDisconnectedCount(Client *c);
+uint32_t MQTTGetInflightPublishCount(Client *c);
+uint32_t MQTTGetOfflinePublishCount(Client *c);
+uint32_t MQTTGetOfflineDroppedCount(Client *c);
 
 struct Client {
     uint8_t isConnected;
@@ -87,10 +211,16 @@ struct Client {
     uint8_t isAutoReconnectEnabled;
 
     uint16_t nextPacketId;
+    uint16_t requestPacketId;   /* id of the last SUBSCRIBE/UNSUBSCRIBE, 0 if none */
+    uint16_t resubscribeIds[MAX_MESSAGE_HANDLERS];  /* ids of the SUBSCRIBEs restoring the handlers, until their SUBACK */
+    uint32_t resubscribeCount;
 
     uint32_t commandTimeoutMs;
     uint32_t keepAliveInterval;
     uint32_t currentReconnectWaitInterval;
+    uint32_t reconnectAttempts;         /* failed attempts since the connection was lost */
+    uint32_t reconnectRandomState;      /* jitter of the reconnect waits, 0 until first used */
+    uint8_t isPhysicalLayerDown;        /* the link was down, reconnect as soon as it is back */
     uint32_t counterNetworkDisconnected;
 
     size_t bufSize;
@@ -99,11 +229,30 @@ struct Client {
     unsigned char *buf;  
     unsigned char *readbuf;
 
+    unsigned char rxRing[MAX_RX_RING_LEN];   /* bytes read from the network but not framed yet */
+    size_t rxRingStart;
+    size_t rxRingCount;
+    size_t rxDiscardLen;                     /* bytes left of an oversized packet being dropped */
+
+    struct StreamedPublish {
+        uint8_t isActive;
+        QoS qos;
+        uint8_t dup;
+        uint8_t retained;
+        uint16_t id;
+        uint16_t topicLen;      /* the topic name is kept at the start of readbuf */
+        uint32_t totalLen;
+        uint32_t offset;
+        uint32_t chunkLen;      /* payload bytes stored after the topic name in readbuf */
+        uint8_t isDuplicate;    /* QoS2 message already handled, only acknowledged again */
+    } rxStream;                 /* PUBLISH larger than readbuf being handed out in chunks */
+
     TLSConnectParams tlsConnectParams;
     MQTTPacket_connectData options;
 
     Network networkStack;
-    Timer pingTimer;
+    Timer pingTimer;            /* runs out a keepalive interval after the last packet sent */
+    Timer pingRespTimer;        /* runs out when the broker has not answered a PINGREQ */
     Timer reconnectDelayTimer;
 
     struct MessageHandlers {
@@ -111,11 +260,85 @@ struct Client {
         void (*fp) (MessageData *);
         pApplicationHandler_t applicationHandler;
         QoS qos;
+        uint8_t isStreaming;     /* accepts PUBLISH payloads larger than readbuf in chunks */
+        uint16_t trieNode;       /* trie node of the last level of topicFilter */
+        uint16_t nextHandler;    /* next handler registered on the same trie node */
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
-    
+
+    struct TopicTrieNode {
+        uint16_t ownerHandler;   /* handler whose topicFilter holds the text of this level */
+        uint16_t levelOffset;
+        uint16_t levelLen;
+        uint16_t parent;
+        uint16_t firstChild;
+        uint16_t nextSibling;
+        uint16_t firstHandler;
+        uint8_t isUsed;
+    } topicTrie[MAX_TOPIC_TRIE_NODES];            /* One node per filter level, node 0 is the root above the first level */
+
+    struct InflightPublish {
+        const char *topicName;
+        MQTTMessage message;
+        publishCompletionHandler_t completionHandler;
+        pApplicationHandler_t applicationHandler;
+        void *pApplicationContext;
+        uint8_t retryCount;
+        uint8_t isReleased;      /* QoS2: PUBREC received and PUBREL sent, waiting for the PUBCOMP */
+        Timer retryTimer;
+    } inflightPublishes[MAX_INFLIGHT_PUBLISHES];  /* QoS1/QoS2 publishes waiting for a PUBACK/PUBCOMP, free if topicName is NULL */
+
+    uint16_t inboundQoS2Ids[MAX_INBOUND_QOS2];    /* packet ids of received QoS2 messages waiting for a PUBREL */
+    uint32_t inboundQoS2Count;
+
+    MQTTOfflineDropPolicy offlineDropPolicy;
+    uint32_t offlineDroppedCount;
+#if defined(MQTT_OFFLINE_QUEUE)
+    struct OfflinePublish {
+        MQTTMessage message;                      /* the payload follows the topic in buf */
+        uint8_t priority;
+        uint8_t isUsed;
+        uint16_t topicLen;
+        unsigned char buf[MAX_OFFLINE_MESSAGE_LEN];
+    } offlinePublishes[MAX_OFFLINE_PUBLISHES];    /* publishes made while disconnected, a slot stays put until it is let go */
+    uint32_t offlineOrder[MAX_OFFLINE_PUBLISHES]; /* slots oldest first, the first offlineInflightCount wait for their PUBACK/PUBCOMP */
+    uint32_t offlinePublishCount;
+    uint32_t offlineInflightCount;
+    Timer offlineDrainTimer;
+#endif
+
     void (* defaultMessageHandler) (MessageData *);
     disconnectHandler_t disconnectHandler;
     networkInitHandler_t networkInitHandler;
+
+#if defined(MQTT_TASK)
+    struct QueuedCommand {
+        uint32_t sequence;       /* position the slot is free for, or position + 1 once it is filled */
+        MQTTCommand command;
+    } commandQueue[MAX_QUEUED_COMMANDS];          /* bounded multi-producer queue, only the I/O thread takes from it */
+    uint32_t commandQueueHead;                    /* next position producers claim */
+    uint32_t commandQueueTail;                    /* next position the I/O thread runs */
+    commandWakeHandler_t commandWakeHandler;      /* lets a host event loop wake up the I/O thread */
+#endif
+
+#if defined(MQTT_DISPATCH)
+    struct DispatchWorker {
+        struct DispatchedMessage {
+            MQTTMessage message;                  /* payload points into buf after the topic */
+            uint16_t topicLen;
+            uint32_t handlerCount;
+            struct {
+                messageHandler fp;
+                pApplicationHandler_t applicationHandler;
+            } handlers[MAX_MESSAGE_HANDLERS];     /* matched on the I/O thread when the message arrived */
+            unsigned char buf[MAX_DISPATCHED_MESSAGE_LEN];
+        } messages[MAX_DISPATCHED_MESSAGES];      /* single producer (I/O thread), single consumer (worker) */
+        uint32_t head;                            /* written by the I/O thread only */
+        uint32_t tail;                            /* written by the worker only */
+    } dispatchWorkers[MAX_DISPATCH_WORKERS];
+    dispatchWakeHandler_t dispatchWakeHandler;
+    void *pDispatchWakeContext;
+    uint32_t dispatchDroppedCount;
+#endif
 };
 
 #define DefaultClient {0, 0, 0, 0, NULL, NULL, 0, 0, 0}
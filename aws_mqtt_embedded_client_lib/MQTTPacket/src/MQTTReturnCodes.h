@@ -23,6 +23,7 @@
 
 /* all failure return codes must be negative */
 typedef enum {
+    MQTT_PUBLISH_STORED_OFFLINE = 6,
     MQTT_NETWORK_MANUALLY_DISCONNECTED = 5,
     MQTT_CONNACK_CONNECTION_ACCEPTED = 4,
     MQTT_ATTEMPTING_RECONNECT = 3,
@@ -46,7 +47,13 @@ typedef enum {
     MQTT_CONNACK_SERVER_UNAVAILABLE_ERROR = -15,
     MQTT_CONNACK_BAD_USERDATA_ERROR = -16,
     MQTT_CONNACK_NOT_AUTHORIZED_ERROR = -17,
-	MQTT_BUFFER_RX_MESSAGE_INVALID = -18
+	MQTT_BUFFER_RX_MESSAGE_INVALID = -18,
+    MQTT_MAX_INFLIGHT_PUBLISHES_REACHED_ERROR = -19,
+    MQTT_PUBLISH_ACK_TIMEOUT_ERROR = -20,
+    MQTT_SUBSCRIBE_REJECTED_ERROR = -21,
+    MQTT_COMMAND_QUEUE_FULL_ERROR = -22,
+    MQTT_DISPATCH_QUEUE_FULL_ERROR = -23,
+    MQTT_OFFLINE_QUEUE_FULL_ERROR = -24
 }MQTTReturnCode;
 
 #endif //__MQTT_ERRORCODES_H
@@ -40,21 +40,21 @@ size_t MQTTSerialize_GetPublishLength(uint8_t qos, MQTTString topicName, size_t
 
 
 /**
-  * Serializes the supplied publish data into the supplied buffer, ready for sending
-  * @param buf the buffer into which the packet will be serialized
+  * Serializes everything of a publish packet up to its payload into the supplied buffer.
+  * The payload itself can then be sent straight from the caller's memory
+  * @param buf the buffer into which the packet header will be serialized
   * @param buflen the length in bytes of the supplied buffer
   * @param dup integer - the MQTT dup flag
   * @param qos integer - the MQTT QoS value
   * @param retained integer - the MQTT retained flag
   * @param packetid integer - the MQTT packet identifier
   * @param topicName MQTTString - the MQTT topic in the publish
-  * @param payload byte buffer - the MQTT publish payload
-  * @param payloadlen integer - the length of the MQTT payload
+  * @param payloadlen integer - the length of the MQTT payload that will follow
   * @return the length of the serialized data.  <= 0 indicates error
   */
-MQTTReturnCode MQTTSerialize_publish(unsigned char *buf, size_t buflen, uint8_t dup,
+MQTTReturnCode MQTTSerialize_publishHeader(unsigned char *buf, size_t buflen, uint8_t dup,
 						  QoS qos, uint8_t retained, uint16_t packetid,
-						  MQTTString topicName, unsigned char *payload, size_t payloadlen,
+						  MQTTString topicName, size_t payloadlen,
 						  uint32_t *serialized_len) {
         unsigned char *ptr = buf;
         MQTTHeader header = {0};
@@ -62,13 +62,13 @@ MQTTReturnCode MQTTSerialize_publish(unsigned char *buf, size_t buflen, uint8_t
         MQTTReturnCode rc = MQTTPacket_InitHeader(&header, PUBLISH, qos, dup, retained);
 
 	FUNC_ENTRY;
-	if(NULL == buf || NULL == payload || NULL == serialized_len) {
+	if(NULL == buf || NULL == serialized_len) {
 		FUNC_EXIT_RC(MQTT_NULL_VALUE_ERROR);
 		return MQTT_NULL_VALUE_ERROR;
 	}
 
 	rem_len = MQTTSerialize_GetPublishLength(qos, topicName, payloadlen);
-	if(MQTTPacket_len(rem_len) > buflen) {
+	if(MQTTPacket_len(rem_len) - payloadlen > buflen) {
 		FUNC_EXIT_RC(MQTTPACKET_BUFFER_TOO_SHORT);
 		return MQTTPACKET_BUFFER_TOO_SHORT;
 	}
@@ -87,15 +87,56 @@ MQTTReturnCode MQTTSerialize_publish(unsigned char *buf, size_t buflen, uint8_t
 		writeInt(&ptr, packetid);
 	}
 
-	memcpy(ptr, payload, payloadlen);
-	ptr += payloadlen;
-
 	*serialized_len = (uint32_t)(ptr - buf);
 
 	FUNC_EXIT_RC(SUCCESS);
 	return SUCCESS;
 }
 
+/**
+  * Serializes the supplied publish data into the supplied buffer, ready for sending
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+MQTTReturnCode MQTTSerialize_publish(unsigned char *buf, size_t buflen, uint8_t dup,
+						  QoS qos, uint8_t retained, uint16_t packetid,
+						  MQTTString topicName, unsigned char *payload, size_t payloadlen,
+						  uint32_t *serialized_len) {
+	MQTTReturnCode rc;
+
+	FUNC_ENTRY;
+	if(NULL == buf || NULL == payload || NULL == serialized_len) {
+		FUNC_EXIT_RC(MQTT_NULL_VALUE_ERROR);
+		return MQTT_NULL_VALUE_ERROR;
+	}
+
+	if(MQTTPacket_len(MQTTSerialize_GetPublishLength(qos, topicName, payloadlen)) > buflen) {
+		FUNC_EXIT_RC(MQTTPACKET_BUFFER_TOO_SHORT);
+		return MQTTPACKET_BUFFER_TOO_SHORT;
+	}
+
+	rc = MQTTSerialize_publishHeader(buf, buflen, dup, qos, retained, packetid, topicName, payloadlen,
+									 serialized_len);
+	if(SUCCESS != rc) {
+		FUNC_EXIT_RC(rc);
+		return rc;
+	}
+
+	memcpy(buf + *serialized_len, payload, payloadlen);
+	*serialized_len += (uint32_t)payloadlen;
+
+	FUNC_EXIT_RC(SUCCESS);
+	return SUCCESS;
+}
+
 /**
   * Serializes the ack packet into the supplied buffer.
   * @param buf the buffer into which the packet will be serialized
@@ -25,6 +25,11 @@
   #define DLLExport
 #endif
 
+/* Granted QoS value returned in a SUBACK for a rejected topic filter, MQTT v3.1.1 Specification 3.9.3 */
+#define MQTT_SUBACK_FAILURE 0x80
+
+DLLExport size_t MQTTSerialize_GetSubscribePacketLength(uint32_t count, MQTTString topicFilters[]);
+
 DLLExport MQTTReturnCode MQTTSerialize_subscribe(unsigned char *buf, size_t buflen,
                                                  unsigned char dup, uint16_t packetid, uint32_t count,
                                                  MQTTString topicFilters[], QoS requestedQoSs[],
@@ -26,7 +26,11 @@ bool AWSSH_Init(aws_smarthome_t *awssh, const char *host, uint32_t port) {
 
 	awssh->json_doc_size = sizeof(awssh->json_doc) / sizeof(char);
 
-	aws_iot_mqtt_init(&awssh->client);
+	awssh->last_error = aws_iot_mqtt_init(&awssh->client);
+	if (NONE_ERROR != awssh->last_error) {
+		ERROR("MQTT Client Initialization Error (%d)", awssh->last_error);
+		return false;
+	}
 
 	awssh->sp = ShadowParametersDefault;
 	awssh->sp.pMyThingName = AWS_IOT_MY_THING_NAME;
@@ -53,7 +57,7 @@ bool AWSSH_Init(aws_smarthome_t *awssh, const char *host, uint32_t port) {
 		return false;
 	}
 
-	awssh->last_error = awssh->client.setAutoReconnectStatus(true);
+	awssh->last_error = awssh->client.setAutoReconnectStatus(&awssh->client, true);
 	if (NONE_ERROR != awssh->last_error) {
 		ERROR("Unable to set Auto Reconnect to true - %d", awssh->last_error);
 		return false;
@@ -135,6 +139,8 @@ void AWSSH_Shutdown(aws_smarthome_t* awssh) {
     if (NONE_ERROR != awssh->last_error) {
         ERROR("Disconnect error %d", awssh->last_error);
     }
+
+    aws_iot_mqtt_free(&awssh->client);
 }
 
 